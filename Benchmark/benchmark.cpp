@@ -0,0 +1,1144 @@
+// Headless benchmark of the core DensityMap operations
+// Prints the results as JSON so they can be compared between builds
+//
+// Usage: DensityMapBenchmark [--dims 64,128,256,512] [--output results.json] [--quick] [--replay session.journal] [--verify]
+
+#include "densityMap.h"
+#include "workloadGenerator.h"
+#include "journal.h"
+#include "sharedMemoryRing.h"
+#include "ingestServer.h"
+#include "checkpoint.h"
+#include "volumeSequence.h"
+#include "volumeKernels.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(__linux__)
+#include <unistd.h>
+#elif defined(__APPLE__)
+#include <mach/mach.h>
+#include <unistd.h>
+#endif
+
+typedef std::chrono::steady_clock Clock;
+
+// One measured operation
+struct Result {
+	Result(std::string name, int dim, int samplesPerLine, std::string writeMode)
+		: name(name), dim(dim), samplesPerLine(samplesPerLine), writeMode(writeMode) {
+	}
+
+	std::string name;
+	int dim;
+	int samplesPerLine;
+	std::string writeMode;
+
+	// Number of operations and how long each one took
+	std::vector<double> nanoseconds;
+
+	// Things processed per operation (samples, cells...)
+	double itemsPerOp = 0;
+	std::string itemName;
+
+	long long int rssBytes = 0;
+
+	// Size of the file written (for snapshots)
+	long long int fileBytes = 0;
+
+	// Memory used by compressed data (for volume sequences)
+	long long int storedBytes = 0;
+};
+
+// Options from the command line
+struct Options {
+	std::vector<int> dims = { 64, 128, 256, 512 };
+	std::string output;
+	bool quick = false;
+
+	// Largest volume clear() is measured on
+	int maxClearDim = 512;
+
+	// Journal to replay instead of the synthetic benchmarks
+	std::string replay;
+
+	// Check the kernels against their float versions instead of benchmarking
+	bool verify = false;
+};
+
+// Resident memory of the process in bytes (0 if unknown)
+long long int residentBytes() {
+#if defined(__linux__)
+	std::ifstream statm("/proc/self/statm");
+	long long int pages = 0, resident = 0;
+	statm >> pages >> resident;
+	return resident * sysconf(_SC_PAGESIZE);
+#elif defined(__APPLE__)
+	// Current resident size, not the peak that getrusage() reports
+	mach_task_basic_info_data_t info;
+	mach_msg_type_number_t count = MACH_TASK_BASIC_INFO_COUNT;
+	if (task_info(mach_task_self(), MACH_TASK_BASIC_INFO, (task_info_t)&info, &count) != KERN_SUCCESS) {
+		return 0;
+	}
+	return info.resident_size;
+#else
+	return 0;
+#endif
+}
+
+double elapsedNanoseconds(Clock::time_point start) {
+	return std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+}
+
+double percentile(std::vector<double> sorted, double p) {
+	if (sorted.empty()) {
+		return 0;
+	}
+
+	size_t index = std::min(sorted.size() - 1, size_t(p / 100 * (sorted.size() - 1) + 0.5));
+	return sorted[index];
+}
+
+glm::vec3 randomPoint(std::mt19937& rng) {
+	std::uniform_real_distribution<float> dist(0.0f, 0.999f);
+	return glm::vec3(dist(rng), dist(rng), dist(rng));
+}
+
+std::vector<unsigned char> randomSamples(std::mt19937& rng, int count) {
+	std::vector<unsigned char> samples(count);
+	for (unsigned char& sample : samples) {
+		sample = rng() & 0xFF;
+	}
+
+	return samples;
+}
+
+const char* writeModeName(DensityMap::WriteMode mode) {
+	switch (mode) {
+	case DensityMap::WriteMode::Max:
+		return "Max";
+	case DensityMap::WriteMode::Splat:
+		return "Splat";
+	case DensityMap::WriteMode::Compound:
+		return "Compound";
+	default:
+		return "Avg";
+	}
+}
+
+// Producer side: how fast lines can be queued
+Result benchWriteLine(DensityMap& map, int dim, int samplesPerLine, DensityMap::WriteMode mode, int numLines, std::mt19937& rng) {
+	Result result = { "writeLine", dim, samplesPerLine, writeModeName(mode) };
+	result.itemsPerOp = samplesPerLine;
+	result.itemName = "samples";
+
+	std::vector<unsigned char> samples = randomSamples(rng, samplesPerLine);
+
+	for (int i = 0; i < numLines; i++) {
+		glm::vec3 p1 = randomPoint(rng);
+		glm::vec3 p2 = randomPoint(rng);
+
+		Clock::time_point start = Clock::now();
+		map.writeLine(p1, p2, samples, mode);
+		result.nanoseconds.push_back(elapsedNanoseconds(start));
+	}
+
+	map.resolveQueues();
+	result.rssBytes = residentBytes();
+
+	return result;
+}
+
+// Consumer side: how long it takes to apply a batch of lines
+Result benchResolveQueues(DensityMap& map, int dim, int samplesPerLine, DensityMap::WriteMode mode, int linesPerBatch, int numBatches, std::mt19937& rng) {
+	Result result = { "resolveQueues", dim, samplesPerLine, writeModeName(mode) };
+	result.itemsPerOp = double(samplesPerLine) * linesPerBatch;
+	result.itemName = "samples";
+
+	std::vector<unsigned char> samples = randomSamples(rng, samplesPerLine);
+
+	for (int b = 0; b < numBatches; b++) {
+		for (int i = 0; i < linesPerBatch; i++) {
+			map.writeLine(randomPoint(rng), randomPoint(rng), samples, mode);
+		}
+
+		Clock::time_point start = Clock::now();
+		map.resolveQueues();
+		result.nanoseconds.push_back(elapsedNanoseconds(start));
+	}
+
+	result.rssBytes = residentBytes();
+
+	return result;
+}
+
+Result benchReadLine(DensityMap& map, int dim, int samplesPerLine, int numLines, std::mt19937& rng) {
+	Result result = { "readLine", dim, samplesPerLine, "" };
+	result.itemsPerOp = samplesPerLine;
+	result.itemName = "samples";
+
+	std::vector<unsigned char> values(samplesPerLine);
+
+	for (int i = 0; i < numLines; i++) {
+		glm::vec3 p1 = randomPoint(rng);
+		glm::vec3 p2 = randomPoint(rng);
+
+		Clock::time_point start = Clock::now();
+		map.readLine(p1, p2, samplesPerLine, values.data());
+		result.nanoseconds.push_back(elapsedNanoseconds(start));
+	}
+
+	result.rssBytes = residentBytes();
+
+	return result;
+}
+
+// clear() followed by the resolveQueues() that applies it
+Result benchClear(DensityMap& map, int dim, int repetitions) {
+	Result result = { "clear", dim, 0, "" };
+	result.itemsPerOp = double(dim) * dim * dim;
+	result.itemName = "cells";
+
+	for (int i = 0; i < repetitions; i++) {
+		Clock::time_point start = Clock::now();
+		map.clear(i & 1);
+		map.resolveQueues();
+		result.nanoseconds.push_back(elapsedNanoseconds(start));
+	}
+
+	result.rssBytes = residentBytes();
+
+	return result;
+}
+
+// A burst of lines that arrive at once, resolved a frame at a time with a budget of
+// budgetMicroseconds per frame (0 for none, which resolves the burst in one frame)
+// Each operation is one frame's resolveQueues(), until the whole burst has been written
+Result benchBurst(int dim, int samplesPerLine, int numLines, int budgetMicroseconds, std::mt19937& rng) {
+	Result result = { budgetMicroseconds > 0 ? "burst_budget_" + std::to_string(budgetMicroseconds) + "us" : "burst", dim, samplesPerLine, "Avg" };
+	result.itemName = "samples";
+
+	DensityMap map(dim, true);
+	std::vector<unsigned char> samples = randomSamples(rng, samplesPerLine);
+
+	for (int i = 0; i < numLines; i++) {
+		map.writeLine(randomPoint(rng), randomPoint(rng), samples);
+	}
+
+	for (bool resolved = false; !resolved;) {
+		Clock::time_point start = Clock::now();
+		resolved = map.resolveQueues(budgetMicroseconds);
+		result.nanoseconds.push_back(elapsedNanoseconds(start));
+	}
+
+	result.itemsPerOp = double(samplesPerLine) * numLines / result.nanoseconds.size();
+	result.rssBytes = residentBytes();
+
+	return result;
+}
+
+// Batches of cell writes where most cells are written several times, as from a dense point source
+// Each operation is one writeCells() call and the resolveQueues() that applies it
+Result benchCellWrites(int dim, int writesPerBatch, int numBatches, std::mt19937& rng) {
+	Result result = { "writeCells", dim, 0, "" };
+	result.itemsPerOp = writesPerBatch;
+	result.itemName = "cells";
+
+	DensityMap map(dim, true);
+
+	// A quarter of the volume, so the batches hit the same cells many times
+	std::uniform_int_distribution<unsigned int> position(0, dim / 4 - 1);
+	std::vector<DensityMap::CellValue> writes(writesPerBatch);
+
+	for (int i = 0; i < numBatches; i++) {
+		for (DensityMap::CellValue& write : writes) {
+			write.x = position(rng);
+			write.y = position(rng);
+			write.z = position(rng);
+			write.value = rng() & 0xFF;
+		}
+
+		Clock::time_point start = Clock::now();
+		map.writeCells(writes.data(), writesPerBatch);
+		map.resolveQueues();
+		result.nanoseconds.push_back(elapsedNanoseconds(start));
+	}
+
+	result.rssBytes = residentBytes();
+
+	return result;
+}
+
+// Overwrites a block of an eighth of the volume at a random place, partly outside the window
+Result benchWriteBlock(int dim, int repetitions, std::mt19937& rng) {
+	Result result = { "writeBlock", dim, 0, "" };
+	glm::ivec3 size(dim / 2);
+	result.itemsPerOp = double(size.x) * size.y * size.z;
+	result.itemName = "cells";
+
+	DensityMap map(dim, true);
+	std::vector<unsigned char> values = randomSamples(rng, size.x * size.y * size.z);
+	std::uniform_int_distribution<int> position(-dim / 4, dim - dim / 4);
+
+	for (int i = 0; i < repetitions; i++) {
+		glm::ivec3 blockStart(position(rng), position(rng), position(rng));
+
+		Clock::time_point start = Clock::now();
+		map.writeBlock(blockStart, size, values.data());
+		result.nanoseconds.push_back(elapsedNanoseconds(start));
+	}
+
+	result.rssBytes = residentBytes();
+
+	return result;
+}
+
+// Simulated probe sweeps at 60 frames per second
+// Each operation is one frame: writing that frame's lines and resolving them
+Result benchWorkload(int dim, WorkloadGenerator::Sweep sweep, int numFrames) {
+	WorkloadGenerator::Settings settings;
+	settings.sweep = sweep;
+	settings.linesPerSecond = 10000;
+	settings.samplesPerLine = 512;
+
+	Result result = { std::string("workload_") + WorkloadGenerator::sweepName(sweep), dim, settings.samplesPerLine, "Avg" };
+	result.itemsPerOp = settings.linesPerSecond / 60 * settings.samplesPerLine;
+	result.itemName = "samples";
+
+	DensityMap map(dim, true);
+	WorkloadGenerator generator(settings);
+
+	for (int i = 0; i < numFrames; i++) {
+		Clock::time_point start = Clock::now();
+		generator.advance(map, 1.0 / 60);
+		map.resolveQueues();
+		result.nanoseconds.push_back(elapsedNanoseconds(start));
+	}
+
+	result.rssBytes = residentBytes();
+
+	return result;
+}
+
+// Lines of a wide, deep sector that leave the volume for a large part of their length
+// Each operation is one integrateLines() call with every line, and only the samples inside are written
+Result benchClippedLines(int dim, int numLines, int repetitions) {
+	WorkloadGenerator::Settings settings;
+	settings.depth = 1.4f;
+	settings.sectorAngle = 2.4f;
+
+	Result result = { "integrate_clipped", dim, settings.samplesPerLine, "Avg" };
+	result.itemsPerOp = double(numLines) * settings.samplesPerLine;
+	result.itemName = "samples";
+
+	WorkloadGenerator generator(settings);
+	std::vector<WorkloadGenerator::Line> lines(numLines);
+	std::vector<DensityMap::ScanlineView> views(numLines);
+
+	for (int i = 0; i < numLines; i++) {
+		generator.nextLine(lines[i]);
+		views[i] = { lines[i].p1, lines[i].p2, lines[i].samples.data(), static_cast<int>(lines[i].samples.size()), settings.writeMode };
+	}
+
+	DensityMap map(dim, true);
+
+	for (int i = 0; i < repetitions; i++) {
+		Clock::time_point start = Clock::now();
+		map.integrateLines(views.data(), numLines);
+		result.nanoseconds.push_back(elapsedNanoseconds(start));
+	}
+
+	result.rssBytes = residentBytes();
+
+	return result;
+}
+
+#ifdef DENSITYMAP_HAS_SHARED_MEMORY
+// Lines sent through shared memory by another thread and integrated without copying
+// Each operation is one consume() call
+Result benchSharedMemory(int dim, int samplesPerLine, int numLines, std::mt19937& rng) {
+	Result result = { "sharedMemory", dim, samplesPerLine, "Avg" };
+	result.itemName = "samples";
+
+	std::string name = "/densitymap-benchmark-" + std::to_string(getpid());
+	SharedMemoryRingProducer producer(name, 16 << 20);
+	SharedMemoryRingConsumer consumer(name);
+
+	if (!producer.isOpen() || !consumer.isOpen()) {
+		std::cerr << "Could not create shared memory " << name << std::endl;
+		return result;
+	}
+
+	std::vector<glm::vec3> points;
+	for (int i = 0; i < 256; i++) {
+		points.push_back(randomPoint(rng));
+	}
+
+	std::vector<unsigned char> samples = randomSamples(rng, samplesPerLine);
+
+	std::thread producerThread([&]() {
+		for (int i = 0; i < numLines; i++) {
+			while (!producer.write(points[i % 256], points[(i + 1) % 256], samples.data(), samplesPerLine, DensityMap::WriteMode::Avg)) {
+				std::this_thread::yield();
+			}
+		}
+	});
+
+	DensityMap map(dim, true);
+
+	int consumed = 0;
+	while (consumed < numLines) {
+		Clock::time_point start = Clock::now();
+		int lines = consumer.consume(map);
+
+		if (lines > 0) {
+			result.nanoseconds.push_back(elapsedNanoseconds(start));
+			consumed += lines;
+		}
+	}
+
+	producerThread.join();
+
+	result.itemsPerOp = result.nanoseconds.empty() ? 0 : double(consumed) * samplesPerLine / result.nanoseconds.size();
+	result.rssBytes = residentBytes();
+
+	return result;
+}
+#endif
+
+#ifdef DENSITYMAP_HAS_INGEST_SERVER
+// Batches of 64 lines sent to an IngestServer over a Unix domain socket
+// The one operation is sending every batch until the server has integrated the last one
+Result benchIngestServer(int dim, int samplesPerLine, int numBatches, std::mt19937& rng) {
+	const int linesPerBatch = 64;
+
+	Result result = { "ingestServer", dim, samplesPerLine, "Avg" };
+	result.itemsPerOp = double(linesPerBatch) * samplesPerLine * numBatches;
+	result.itemName = "samples";
+
+	DensityMap map(dim, true);
+	IngestServer server(map);
+
+	std::string path = "/tmp/densitymap-benchmark-" + std::to_string(getpid()) + ".sock";
+	IngestClient client;
+
+	if (!server.listenUnix(path) || !server.start() || !client.connectUnix(path)) {
+		std::cerr << "Could not start the ingest server on " << path << std::endl;
+		return result;
+	}
+
+	std::vector<unsigned char> samples = randomSamples(rng, samplesPerLine);
+
+	std::vector<glm::vec3> points;
+	for (int i = 0; i <= linesPerBatch; i++) {
+		points.push_back(randomPoint(rng));
+	}
+
+	Clock::time_point start = Clock::now();
+
+	for (int b = 0; b < numBatches; b++) {
+		for (int i = 0; i < linesPerBatch; i++) {
+			client.addLine(points[i], points[i + 1], samples.data(), samplesPerLine, DensityMap::WriteMode::Avg);
+		}
+
+		client.send();
+	}
+
+	client.close();
+	while (server.getStats().lines < (unsigned long long)numBatches * linesPerBatch && server.getStats().rejectedFrames == 0) {
+		std::this_thread::yield();
+	}
+
+	result.nanoseconds.push_back(elapsedNanoseconds(start));
+
+	result.rssBytes = residentBytes();
+
+	return result;
+}
+#endif
+
+// Saving and loading a snapshot of a volume filled by a simulated sweep
+Result benchSnapshot(const std::string& name, int dim, int repetitions) {
+	Result result = { name, dim, 0, "" };
+	result.itemsPerOp = double(dim) * dim * dim;
+	result.itemName = "cells";
+
+	DensityMap map(dim, true);
+
+	WorkloadGenerator::Settings settings;
+	WorkloadGenerator generator(settings);
+	for (int i = 0; i < 60; i++) {
+		generator.advance(map, 1.0 / 60);
+		map.resolveQueues();
+	}
+
+	std::string path = "densitymap-benchmark.snapshot";
+	map.saveSnapshot(path);
+
+	for (int i = 0; i < repetitions; i++) {
+		Clock::time_point start = Clock::now();
+		if (name == "saveSnapshot") {
+			map.saveSnapshot(path);
+		}
+		else {
+			map.loadSnapshot(path);
+		}
+		result.nanoseconds.push_back(elapsedNanoseconds(start));
+	}
+
+	std::ifstream file(path, std::ios::binary | std::ios::ate);
+	result.fileBytes = file.tellg();
+	file.close();
+	std::remove(path.c_str());
+
+	result.rssBytes = residentBytes();
+
+	return result;
+}
+
+// Sweeps a volume and writes a delta checkpoint after every second of data
+// Each operation is one checkpoint, and fileBytes is the size of the deltas
+Result benchCheckpoint(int dim, int numCheckpoints) {
+	Result result = { "checkpoint", dim, 0, "" };
+	result.itemName = "bricks";
+
+	DensityMap map(dim, true);
+
+	WorkloadGenerator::Settings settings;
+	WorkloadGenerator generator(settings);
+
+	std::string path = "densitymap-benchmark.checkpoint";
+	unsigned long long bricks = 0;
+
+	{
+		Checkpointer checkpointer(map, path, 0, 0);
+
+		for (int c = 0; c < numCheckpoints; c++) {
+			for (int i = 0; i < 60; i++) {
+				generator.advance(map, 1.0 / 60);
+				map.resolveQueues();
+			}
+
+			unsigned long long bricksBefore = checkpointer.getStats().bricks;
+
+			Clock::time_point start = Clock::now();
+			checkpointer.checkpoint();
+			result.nanoseconds.push_back(elapsedNanoseconds(start));
+
+			bricks += checkpointer.getStats().bricks - bricksBefore;
+		}
+
+		result.fileBytes = checkpointer.getStats().deltaBytes;
+	}
+
+	result.itemsPerOp = double(bricks) / numCheckpoints;
+	result.rssBytes = residentBytes();
+
+	std::remove(path.c_str());
+	std::remove((path + ".0.base").c_str());
+
+	return result;
+}
+
+// Records a ring of frames, a quarter of a second of sweeping apart, and plays them back in a loop
+// Each operation is one showFrame() (like cine playback), and storedBytes is the memory the frames use
+Result benchSequence(int dim, int numFrames, int numShows) {
+	Result result = { "sequence_playback", dim, 0, "" };
+	result.itemsPerOp = double(dim) * dim * dim;
+	result.itemName = "cells";
+
+	DensityMap map(dim, true);
+	DensityMap view(dim, true);
+
+	WorkloadGenerator::Settings settings;
+	WorkloadGenerator generator(settings);
+
+	VolumeSequence sequence(dim, numFrames);
+
+	for (int f = 0; f < numFrames; f++) {
+		for (int i = 0; i < 15; i++) {
+			generator.advance(map, 1.0 / 60);
+			map.resolveQueues();
+		}
+
+		sequence.addFrame(map);
+	}
+
+	for (int i = 0; i < numShows; i++) {
+		Clock::time_point start = Clock::now();
+		sequence.showFrame(i % numFrames, view);
+		result.nanoseconds.push_back(elapsedNanoseconds(start));
+	}
+
+	result.storedBytes = sequence.getBytesUsed();
+	result.rssBytes = residentBytes();
+
+	return result;
+}
+
+// Scrolls the window one cell at a time, cycling through the axes
+// Each operation is one scroll(), which clears the dim^2 cells that come into view
+Result benchScroll(int dim, int repetitions) {
+	Result result = { "scroll", dim, 0, "" };
+	result.itemsPerOp = double(dim) * dim;
+	result.itemName = "cells";
+
+	DensityMap map(dim, true);
+	map.clear(1);
+	map.resolveQueues();
+
+	for (int i = 0; i < repetitions; i++) {
+		glm::ivec3 step(0);
+		step[i % 3] = 1;
+
+		Clock::time_point start = Clock::now();
+		map.scroll(step);
+		result.nanoseconds.push_back(elapsedNanoseconds(start));
+	}
+
+	result.rssBytes = residentBytes();
+
+	return result;
+}
+
+// Freehand sweep with hole filling on: each op fills one frame's budget of bricks
+Result benchHoleFilling(int dim, int radius, int numFrames) {
+	WorkloadGenerator::Settings settings;
+	settings.sweep = WorkloadGenerator::Sweep::FreehandRotation;
+	settings.linesPerSecond = 10000;
+	settings.samplesPerLine = 512;
+
+	const int bricksPerFrame = 256;
+
+	Result result = { "fillHoles_r" + std::to_string(radius), dim, settings.samplesPerLine, "Avg" };
+	result.itemsPerOp = bricksPerFrame;
+	result.itemName = "bricks";
+
+	DensityMap map(dim, true);
+	WorkloadGenerator generator(settings);
+	map.setHoleFilling(radius, bricksPerFrame);
+
+	// Filling the whole volume once first, so every op is a full budget of changed bricks
+	while (map.fillHoles(bricksPerFrame) > 0) {
+	}
+
+	for (int i = 0; i < numFrames; i++) {
+		generator.advance(map, 1.0 / 60);
+		map.resolveQueues();
+
+		Clock::time_point start = Clock::now();
+		map.fillHoles(bricksPerFrame);
+		result.nanoseconds.push_back(elapsedNanoseconds(start));
+	}
+
+	result.rssBytes = residentBytes();
+
+	return result;
+}
+
+// A frame of live data: one fade, then a few lines that catch up the bricks they touch
+Result benchFade(int dim, int samplesPerLine, int numFrames, std::mt19937& rng) {
+	Result result = { "fade", dim, samplesPerLine, "Avg" };
+	result.itemsPerOp = double(dim) * dim * dim;
+	result.itemName = "cells";
+
+	DensityMap map(dim, true);
+	map.setPersistence(0.95f);
+	map.clear(255);
+	map.resolveQueues();
+
+	std::vector<unsigned char> samples = randomSamples(rng, samplesPerLine);
+
+	for (int i = 0; i < numFrames; i++) {
+		for (int l = 0; l < 16; l++) {
+			map.writeLine(randomPoint(rng), randomPoint(rng), samples);
+		}
+
+		Clock::time_point start = Clock::now();
+		map.fade();
+		map.resolveQueues();
+		result.nanoseconds.push_back(elapsedNanoseconds(start));
+	}
+
+	result.rssBytes = residentBytes();
+
+	return result;
+}
+
+// Replays a recorded journal as fast as possible, one 60 Hz frame of it at a time
+// Each operation is one frame: writing that frame's records and resolving them
+Result benchReplay(int dim, const std::string& path) {
+	Result result = { "replay", dim, 0, "" };
+	result.itemName = "records";
+
+	JournalReplayer replayer(path);
+	if (!replayer.isOpen()) {
+		std::cerr << "Could not open journal " << path << std::endl;
+		std::exit(1);
+	}
+
+	DensityMap map(dim, true);
+
+	unsigned long long records = 0;
+	for (double time = 1.0 / 60; records < replayer.getNumRecords(); time += 1.0 / 60) {
+		Clock::time_point start = Clock::now();
+		records += replayer.replayUntil(map, time);
+		map.resolveQueues();
+		result.nanoseconds.push_back(elapsedNanoseconds(start));
+	}
+
+	result.itemsPerOp = result.nanoseconds.empty() ? 0 : double(records) / result.nanoseconds.size();
+	result.rssBytes = residentBytes();
+
+	return result;
+}
+
+void writeJson(std::ostream& out, const std::vector<Result>& results) {
+	out << "{\n  \"benchmark\": \"DensityMap\",\n  \"results\": [\n";
+
+	for (size_t r = 0; r < results.size(); r++) {
+		const Result& result = results[r];
+
+		std::vector<double> sorted = result.nanoseconds;
+		std::sort(sorted.begin(), sorted.end());
+
+		double total = 0;
+		for (double ns : sorted) {
+			total += ns;
+		}
+
+		double nsPerOp = sorted.empty() ? 0 : total / sorted.size();
+		double opsPerSec = total > 0 ? sorted.size() / (total * 1e-9) : 0;
+
+		out << "    {";
+		out << "\"name\": \"" << result.name << "\", ";
+		out << "\"dim\": " << result.dim << ", ";
+		if (result.samplesPerLine > 0) {
+			out << "\"samples_per_line\": " << result.samplesPerLine << ", ";
+		}
+		if (!result.writeMode.empty()) {
+			out << "\"write_mode\": \"" << result.writeMode << "\", ";
+		}
+		out << "\"ops\": " << sorted.size() << ", ";
+		out << "\"ops_per_sec\": " << opsPerSec << ", ";
+		out << "\"ns_per_op\": " << nsPerOp << ", ";
+		out << "\"" << result.itemName << "_per_sec\": " << opsPerSec * result.itemsPerOp << ", ";
+		out << "\"p50_ns\": " << percentile(sorted, 50) << ", ";
+		out << "\"p90_ns\": " << percentile(sorted, 90) << ", ";
+		out << "\"p99_ns\": " << percentile(sorted, 99) << ", ";
+		out << "\"max_ns\": " << (sorted.empty() ? 0 : sorted.back()) << ", ";
+		if (result.fileBytes > 0) {
+			out << "\"file_bytes\": " << result.fileBytes << ", ";
+		}
+
+		if (result.storedBytes > 0) {
+			out << "\"stored_bytes\": " << result.storedBytes << ", ";
+		}
+		out << "\"rss_bytes\": " << result.rssBytes;
+		out << "}" << (r + 1 < results.size() ? "," : "") << "\n";
+	}
+
+	out << "  ]\n}\n";
+}
+
+// Compares blendCells() with the float blend it replaced for every cell and value
+// and a sweep of coefficients, and returns false if any result is off by more than 1
+// or if blendSplats() blends a splatted mean differently from blendCells()
+bool verifyBlend() {
+	const int numCoefficients = 1001;
+
+	std::vector<unsigned char> current(256 * 256);
+	std::vector<unsigned char> values(256 * 256);
+	std::vector<unsigned char> blended(256 * 256);
+	std::vector<unsigned char> splatted(256 * 256);
+	std::vector<float> weights(256 * 256);
+	std::vector<float> sums(256 * 256);
+	for (int i = 0; i < 256 * 256; i++) {
+		current[i] = static_cast<unsigned char>(i >> 8);
+		values[i] = static_cast<unsigned char>(i & 0xFF);
+	}
+
+	int maxError = 0;
+	unsigned long long numOff = 0;
+	unsigned long long numSplatsOff = 0;
+
+	for (int c = 0; c < numCoefficients; c++) {
+		float coefficient = float(c) / (numCoefficients - 1);
+		blendCells(current.data(), values.data(), blended.data(), blendWeight(coefficient), 256 * 256);
+
+		// Every third cell gets no splats and has to stay as it is
+		for (int i = 0; i < 256 * 256; i++) {
+			weights[i] = i % 3 == 0 ? 0.0f : 0.25f;
+			sums[i] = weights[i] * values[i];
+		}
+
+		splatted = current;
+		blendSplats(splatted.data(), weights.data(), sums.data(), blendWeight(coefficient), 256 * 256);
+
+		for (int i = 0; i < 256 * 256; i++) {
+			unsigned char reference = values[i];
+			if (current[i] != 0) {
+				reference = static_cast<unsigned char>(coefficient * values[i] + (1 - coefficient) * current[i]);
+			}
+
+			int error = std::abs(blended[i] - reference);
+			maxError = std::max(maxError, error);
+			numOff += error != 0;
+			numSplatsOff += splatted[i] != (i % 3 == 0 ? current[i] : blended[i]);
+		}
+	}
+
+	std::cout << "blendCells: " << numCoefficients * 256ULL * 256 << " blends, " << numOff << " off by 1, max error " << maxError << std::endl;
+	std::cout << "blendSplats: " << numSplatsOff << " cells differ from blendCells" << std::endl;
+
+	return maxError <= 1 && numSplatsOff == 0;
+}
+
+// Runs a random mix of fades, cell and block writes, scrolls and copies on a map with lazy fades
+// and checks its cells, copyCells() and a copy kept up to date with copyChangedBricks() (what an
+// upload sees) against an array faded eagerly on every tick. Returns false if any cell differs
+bool verifyFade() {
+	const int dim = 40;
+	const int numSteps = 4000;
+	const float persistence = 0.9f;
+
+	DensityMap map(dim, true);
+	map.setPersistence(persistence);
+	int weight = blendWeight(persistence);
+
+	std::mt19937 rng(4242);
+	auto random = [&](int n) {
+		return static_cast<int>(rng() % n);
+	};
+
+	// Everything is kept where the map stores it, (window + wrap) % dim on each axis
+	std::vector<unsigned char> reference(size_t(dim) * dim * dim, 0);
+	std::vector<std::pair<size_t, unsigned char>> queued;
+	glm::ivec3 origin(0);
+	glm::ivec3 wrap(0);
+	auto stored = [&](glm::ivec3 cell) {
+		glm::ivec3 s = (cell + wrap) % dim;
+		return (size_t(s.x) * dim + s.y) * dim + s.z;
+	};
+
+	std::vector<unsigned char> copied(reference.size(), 0);
+	std::vector<unsigned char> bricksCopied(reference.size(), 0);
+	unsigned long long version = 0;
+	std::vector<glm::ivec3> bricks;
+	std::vector<unsigned char> brickCells;
+
+	unsigned long long numChecked = 0;
+	unsigned long long numOff = 0;
+	int firstOffStep = -1;
+	auto check = [&](int step, const std::vector<unsigned char>& cells) {
+		for (size_t i = 0; i < cells.size(); i++) {
+			numOff += cells[i] != reference[i];
+		}
+
+		numChecked += cells.size();
+		if (numOff > 0 && firstOffStep < 0) {
+			firstOffStep = step;
+		}
+	};
+
+	for (int step = 0; step < numSteps; step++) {
+		switch (random(8)) {
+		case 0:
+		case 1: {
+			// Mostly single fades, now and then enough of them to take everything to 0
+			int ticks = random(20) == 0 ? 1 + random(60) : 1;
+			map.fade(ticks);
+			for (int t = 0; t < ticks; t++) {
+				for (unsigned char& cell : reference) {
+					cell = static_cast<unsigned char>((cell * weight) >> 8);
+				}
+			}
+			break;
+		}
+		case 2: {
+			// Queued writes land when the queues are resolved, after any fades in between
+			for (int i = random(64); i > 0; i--) {
+				glm::ivec3 cell(random(dim), random(dim), random(dim));
+				unsigned char value = static_cast<unsigned char>(1 + random(255));
+				map.writeCell(cell.x, cell.y, cell.z, value);
+				queued.push_back(std::make_pair(stored(cell), value));
+			}
+			break;
+		}
+		case 3: {
+			// Blocks go in straight away, under anything still queued
+			glm::ivec3 start(random(dim), random(dim), random(dim));
+			glm::ivec3 size(1 + random(20), 1 + random(20), 1 + random(20));
+			std::vector<unsigned char> values(size_t(size.x) * size.y * size.z);
+			for (unsigned char& value : values) {
+				value = static_cast<unsigned char>(random(256));
+			}
+
+			map.writeBlock(start, size, values.data());
+			glm::ivec3 end = glm::min(start + size, glm::ivec3(dim));
+			for (int x = start.x; x < end.x; x++) {
+				for (int y = start.y; y < end.y; y++) {
+					for (int z = start.z; z < end.z; z++) {
+						reference[stored(glm::ivec3(x, y, z))] = values[(size_t(x - start.x) * size.y + y - start.y) * size.z + z - start.z];
+					}
+				}
+			}
+			break;
+		}
+		case 4: {
+			// Queued writes go in first, then the planes that come into view are cleared
+			glm::ivec3 cells(random(17) - 8, random(17) - 8, random(17) - 8);
+			if (random(10) == 0) {
+				cells[random(3)] += random(2) == 0 ? dim : -dim;
+			}
+
+			map.scroll(cells);
+			for (const std::pair<size_t, unsigned char>& write : queued) {
+				reference[write.first] = write.second;
+			}
+			queued.clear();
+
+			glm::ivec3 oldOrigin = origin;
+			origin += cells;
+			wrap = ((wrap + cells) % dim + dim) % dim;
+			for (int x = 0; x < dim; x++) {
+				for (int y = 0; y < dim; y++) {
+					for (int z = 0; z < dim; z++) {
+						glm::ivec3 world = origin + glm::ivec3(x, y, z);
+						if (glm::any(glm::lessThan(world, oldOrigin)) || glm::any(glm::greaterThanEqual(world, oldOrigin + dim))) {
+							reference[stored(glm::ivec3(x, y, z))] = 0;
+						}
+					}
+				}
+			}
+			break;
+		}
+		case 5:
+			map.resolveQueues();
+			for (const std::pair<size_t, unsigned char>& write : queued) {
+				reference[write.first] = write.second;
+			}
+			queued.clear();
+			break;
+		case 6:
+			// Copying the bricks changed since the last copy, like an upload does
+			version = map.copyChangedBricks(version, bricks, brickCells);
+			for (size_t b = 0; b < bricks.size(); b++) {
+				glm::ivec3 start = bricks[b] * DensityMap::brickSize;
+				glm::ivec3 end = glm::min(start + DensityMap::brickSize, glm::ivec3(dim));
+				for (int x = start.x; x < end.x; x++) {
+					for (int y = start.y; y < end.y; y++) {
+						for (int z = start.z; z < end.z; z++) {
+							size_t offset = ((size_t(x - start.x) * DensityMap::brickSize + y - start.y) * DensityMap::brickSize) + z - start.z;
+							bricksCopied[(size_t(x) * dim + y) * dim + z] = brickCells[b * DensityMap::brickSize * DensityMap::brickSize * DensityMap::brickSize + offset];
+						}
+					}
+				}
+			}
+			bricks.clear();
+			check(step, bricksCopied);
+			break;
+		case 7: {
+			std::vector<unsigned char> read(reference.size());
+			for (int x = 0; x < dim; x++) {
+				for (int y = 0; y < dim; y++) {
+					for (int z = 0; z < dim; z++) {
+						read[stored(glm::ivec3(x, y, z))] = map.readCell(x, y, z);
+					}
+				}
+			}
+			check(step, read);
+
+			map.copyCells(0, dim, copied.data());
+			check(step, copied);
+			break;
+		}
+		}
+	}
+
+	std::cout << "fade: " << numSteps << " steps, " << numChecked << " cells checked, " << numOff << " off";
+	if (firstOffStep >= 0) {
+		std::cout << " (first at step " << firstOffStep << ")";
+	}
+	std::cout << std::endl;
+
+	return numOff == 0;
+}
+
+// Hammers one cell with Compound samples, thousands more than its count holds in one batch,
+// through integrateLines() and the queues, and returns false if the mean comes out wrong
+bool verifyCompound() {
+	const int dim = 32;
+	const glm::vec3 point(0.5f);
+
+	bool ok = true;
+	for (int numLines : { 3000, 5000, 20000 }) {
+		// Constant samples must give back the value, alternating ones their mean
+		const unsigned char constant[1] = { 10 };
+		const unsigned char alternating[2] = { 10, 200 };
+
+		std::vector<DensityMap::ScanlineView> lines(numLines);
+		for (int i = 0; i < numLines; i++) {
+			lines[i] = { point, point, constant, 1, DensityMap::WriteMode::Compound };
+		}
+
+		DensityMap direct(dim, true);
+		direct.integrateLines(lines.data(), numLines);
+
+		for (int i = 0; i < numLines; i++) {
+			lines[i].samples = alternating + (i & 1);
+		}
+
+		DensityMap mixed(dim, true);
+		mixed.integrateLines(lines.data(), numLines);
+
+		DensityMap queued(dim, true);
+		for (int i = 0; i < numLines; i++) {
+			queued.writeLine(point, point, constant, 1, DensityMap::WriteMode::Compound);
+		}
+		queued.resolveQueues();
+
+		glm::ivec3 cell(point * float(dim - 1));
+		int directValue = direct.readCell(cell.x, cell.y, cell.z);
+		int mixedValue = mixed.readCell(cell.x, cell.y, cell.z);
+		int queuedValue = queued.readCell(cell.x, cell.y, cell.z);
+
+		std::cout << "compound: " << numLines << " samples in one cell, " << directValue << " direct, " << queuedValue
+			<< " queued (10 expected), " << mixedValue << " alternating (105 expected)" << std::endl;
+
+		ok = ok && directValue == 10 && queuedValue == 10 && std::abs(mixedValue - 105) <= 1;
+	}
+
+	return ok;
+}
+
+Options parseOptions(int argc, char** argv) {
+	Options options;
+
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+
+		if (arg == "--dims" && i + 1 < argc) {
+			options.dims.clear();
+
+			std::stringstream list(argv[++i]);
+			std::string dim;
+			while (std::getline(list, dim, ',')) {
+				options.dims.push_back(std::atoi(dim.c_str()));
+			}
+		}
+		else if (arg == "--output" && i + 1 < argc) {
+			options.output = argv[++i];
+		}
+		else if (arg == "--max-clear-dim" && i + 1 < argc) {
+			options.maxClearDim = std::atoi(argv[++i]);
+		}
+		else if (arg == "--replay" && i + 1 < argc) {
+			options.replay = argv[++i];
+		}
+		else if (arg == "--quick") {
+			options.quick = true;
+		}
+		else if (arg == "--verify") {
+			options.verify = true;
+		}
+		else {
+			std::cerr << "Usage: " << argv[0] << " [--dims 64,128,256,512] [--output results.json] [--max-clear-dim 512] [--quick] [--replay session.journal] [--verify]" << std::endl;
+			std::exit(1);
+		}
+	}
+
+	return options;
+}
+
+int main(int argc, char** argv) {
+	Options options = parseOptions(argc, argv);
+
+	if (options.verify) {
+		bool blendOk = verifyBlend();
+		bool fadeOk = verifyFade();
+		bool compoundOk = verifyCompound();
+		return blendOk && fadeOk && compoundOk ? 0 : 1;
+	}
+
+	// Same seed every run so every build sees the same lines
+	std::mt19937 rng(12345);
+
+	int scale = options.quick ? 10 : 1;
+	std::vector<int> lineLengths = { 64, 256, 1024 };
+	std::vector<DensityMap::WriteMode> modes = { DensityMap::WriteMode::Avg, DensityMap::WriteMode::Max, DensityMap::WriteMode::Splat, DensityMap::WriteMode::Compound };
+
+	std::vector<Result> results;
+
+	// A recorded session replaces the synthetic benchmarks
+	if (!options.replay.empty()) {
+		for (int dim : options.dims) {
+			results.push_back(benchReplay(dim, options.replay));
+		}
+	}
+
+	for (int dim : options.replay.empty() ? options.dims : std::vector<int>()) {
+		std::cerr << "dim " << dim << "..." << std::endl;
+
+		DensityMap map(dim, true);
+
+		for (int samplesPerLine : lineLengths) {
+			for (DensityMap::WriteMode mode : modes) {
+				results.push_back(benchWriteLine(map, dim, samplesPerLine, mode, 20000 / scale, rng));
+				results.push_back(benchResolveQueues(map, dim, samplesPerLine, mode, 256, 50 / scale, rng));
+			}
+
+			results.push_back(benchReadLine(map, dim, samplesPerLine, 2000 / scale, rng));
+
+#ifdef DENSITYMAP_HAS_SHARED_MEMORY
+			results.push_back(benchSharedMemory(dim, samplesPerLine, 20000 / scale, rng));
+#endif
+
+#ifdef DENSITYMAP_HAS_INGEST_SERVER
+			results.push_back(benchIngestServer(dim, samplesPerLine, 300 / scale, rng));
+#endif
+		}
+
+		results.push_back(benchSnapshot("saveSnapshot", dim, options.quick ? 2 : 10));
+		results.push_back(benchSnapshot("loadSnapshot", dim, options.quick ? 2 : 10));
+		results.push_back(benchCheckpoint(dim, options.quick ? 2 : 10));
+		results.push_back(benchSequence(dim, 30, options.quick ? 30 : 120));
+		results.push_back(benchScroll(dim, options.quick ? 30 : 300));
+		results.push_back(benchFade(dim, 256, 240 / scale, rng));
+		results.push_back(benchHoleFilling(dim, 2, 240 / scale));
+		results.push_back(benchBurst(dim, 256, 20000 / scale, 0, rng));
+		results.push_back(benchBurst(dim, 256, 20000 / scale, 4000, rng));
+		results.push_back(benchCellWrites(dim, 100000, 100 / scale, rng));
+		results.push_back(benchWriteBlock(dim, options.quick ? 5 : 50, rng));
+
+		results.push_back(benchClippedLines(dim, 2000, options.quick ? 5 : 50));
+
+		for (WorkloadGenerator::Sweep sweep : { WorkloadGenerator::Sweep::SectorFan, WorkloadGenerator::Sweep::LinearTranslation, WorkloadGenerator::Sweep::FreehandRotation }) {
+			results.push_back(benchWorkload(dim, sweep, 240 / scale));
+		}
+
+		if (dim <= options.maxClearDim) {
+			results.push_back(benchClear(map, dim, options.quick ? 1 : 5));
+		}
+	}
+
+	if (options.output.empty()) {
+		writeJson(std::cout, results);
+	}
+	else {
+		std::ofstream file(options.output);
+		writeJson(file, results);
+	}
+
+	return 0;
+}
@@ -0,0 +1,138 @@
+#include "brickCodec.h"
+
+#include <cstring>
+
+namespace {
+	void writeVarint(size_t value, std::vector<unsigned char>& out) {
+		while (value >= 0x80) {
+			out.push_back(static_cast<unsigned char>(value | 0x80));
+			value >>= 7;
+		}
+
+		out.push_back(static_cast<unsigned char>(value));
+	}
+
+	bool readVarint(const unsigned char*& in, const unsigned char* end, size_t& value) {
+		value = 0;
+
+		for (int shift = 0; shift < 64; shift += 7) {
+			if (in == end) {
+				return false;
+			}
+
+			unsigned char byte = *in++;
+			value |= static_cast<size_t>(byte & 0x7F) << shift;
+
+			if ((byte & 0x80) == 0) {
+				return true;
+			}
+		}
+
+		return false;
+	}
+}
+
+void BrickCodec::encode(const unsigned char* data, size_t size, std::vector<unsigned char>& out) {
+	size_t i = 0;
+	size_t literalStart = 0;
+
+	while (i < size) {
+		// Length of the run starting at i
+		size_t run = 1;
+		while (i + run < size && data[i + run] == data[i]) {
+			run++;
+		}
+
+		if (run < minRun) {
+			i += run;
+			continue;
+		}
+
+		// Literals before the run, in pieces of at most maxLiteral
+		while (literalStart < i) {
+			size_t length = i - literalStart < maxLiteral ? i - literalStart : maxLiteral;
+			out.push_back(static_cast<unsigned char>(length - 1));
+			out.insert(out.end(), data + literalStart, data + literalStart + length);
+			literalStart += length;
+		}
+
+		size_t extra = run - minRun;
+		if (extra < 0x7F) {
+			out.push_back(static_cast<unsigned char>(0x80 | extra));
+		}
+		else {
+			out.push_back(0xFF);
+			writeVarint(extra - 0x7F, out);
+		}
+		out.push_back(data[i]);
+
+		i += run;
+		literalStart = i;
+	}
+
+	while (literalStart < size) {
+		size_t length = size - literalStart < maxLiteral ? size - literalStart : maxLiteral;
+		out.push_back(static_cast<unsigned char>(length - 1));
+		out.insert(out.end(), data + literalStart, data + literalStart + length);
+		literalStart += length;
+	}
+}
+
+bool BrickCodec::decode(const unsigned char* encoded, size_t encodedSize, unsigned char* out, size_t size) {
+	const unsigned char* in = encoded;
+	const unsigned char* end = encoded + encodedSize;
+	size_t written = 0;
+
+	while (in != end) {
+		unsigned char control = *in++;
+
+		if (control < 0x80) {
+			size_t length = control + 1;
+
+			if (static_cast<size_t>(end - in) < length || size - written < length) {
+				return false;
+			}
+
+			std::memcpy(out + written, in, length);
+			in += length;
+			written += length;
+		}
+		else {
+			size_t length = (control & 0x7F) + minRun;
+
+			if ((control & 0x7F) == 0x7F) {
+				size_t extra;
+				if (!readVarint(in, end, extra)) {
+					return false;
+				}
+
+				length += extra;
+			}
+
+			if (in == end || size - written < length) {
+				return false;
+			}
+
+			std::memset(out + written, *in++, length);
+			written += length;
+		}
+	}
+
+	return written == size;
+}
+
+bool BrickCodec::isUniform(const unsigned char* data, size_t size, unsigned char& value) {
+	if (size == 0) {
+		return false;
+	}
+
+	value = data[0];
+
+	for (size_t i = 1; i < size; i++) {
+		if (data[i] != value) {
+			return false;
+		}
+	}
+
+	return true;
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+// Run-length codec for bricks of 8-bit cells
+// Volumes are mostly empty or smooth, so long runs of one value are common
+// and are stored in a couple of bytes, while noisy data costs at most 1/128 extra
+//
+// The encoded data is a list of tokens, each starting with a control byte c:
+//   c < 0x80:  c + 1 literal bytes follow
+//   c >= 0x80: the next byte is repeated (c & 0x7F) + minRun times, and if
+//              (c & 0x7F) is 0x7F a varint with the extra length follows the control byte
+class BrickCodec {
+public:
+	// Appends the encoded form of size bytes to out
+	static void encode(const unsigned char* data, size_t size, std::vector<unsigned char>& out);
+
+	// Decodes exactly size bytes into out
+	// Returns false if the encoded data is broken or has the wrong length
+	static bool decode(const unsigned char* encoded, size_t encodedSize, unsigned char* out, size_t size);
+
+	// Returns true if all size bytes are the same (and writes that value to value)
+	static bool isUniform(const unsigned char* data, size_t size, unsigned char& value);
+
+private:
+	static const size_t minRun = 3;
+	static const size_t maxLiteral = 128;
+};
@@ -0,0 +1,517 @@
+#include "checkpoint.h"
+#include "brickCodec.h"
+#include "threadPool.h"
+#include "trace.h"
+#include "volumeSnapshot.h"
+
+#include <algorithm>
+#include <cstring>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#include <fcntl.h>
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+using namespace CheckpointFormat;
+
+namespace {
+	const size_t cellsPerBrick = DensityMap::brickSize * DensityMap::brickSize * DensityMap::brickSize;
+
+	// FNV-1a hash of a checkpoint's payload
+	uint64_t checksum(const unsigned char* data, size_t size) {
+		uint64_t hash = 14695981039346656037ULL;
+
+		for (size_t i = 0; i < size; i++) {
+			hash ^= data[i];
+			hash *= 1099511628211ULL;
+		}
+
+		return hash;
+	}
+
+	// Makes sure everything written to a file has reached the disk
+	bool flushToDisk(FILE* file) {
+		if (std::fflush(file) != 0) {
+			return false;
+		}
+
+#ifdef _WIN32
+		return _commit(_fileno(file)) == 0;
+#else
+		return fsync(fileno(file)) == 0;
+#endif
+	}
+
+	// Moves a file over another in one step, so a crash leaves one of them in place
+	// (rename() only replaces files like that on POSIX)
+	bool replaceFile(const std::string& from, const std::string& to) {
+#ifdef _WIN32
+		return MoveFileExA(from.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+		return std::rename(from.c_str(), to.c_str()) == 0;
+#endif
+	}
+
+	// Cuts a file back to size bytes
+	bool truncateFile(const std::string& path, unsigned long long size) {
+#ifdef _WIN32
+		int fd = _open(path.c_str(), _O_WRONLY | _O_BINARY);
+		if (fd < 0) {
+			return false;
+		}
+
+		bool ok = _chsize_s(fd, static_cast<long long>(size)) == 0;
+		return _close(fd) == 0 && ok;
+#else
+		return truncate(path.c_str(), static_cast<off_t>(size)) == 0;
+#endif
+	}
+
+	bool readFileHeader(FILE* file, FileHeader& header) {
+		return std::fread(&header, sizeof(header), 1, file) == 1 &&
+			std::memcmp(header.magic, fileMagic, sizeof(fileMagic)) == 0 && header.version == version;
+	}
+}
+
+Checkpointer::Checkpointer(DensityMap& map, const std::string& path, double interval, unsigned long long compactSize)
+	: map(map), path(path), interval(interval), compactSize(compactSize) {
+
+	file = nullptr;
+	fileSize = 0;
+	generation = 0;
+	checkpointedVersion = 0;
+	checkpointedOrigin = glm::ivec3(0);
+	stats = Stats();
+	stopping = false;
+
+	// Carrying on from the generation already on disk, so the old delta file
+	// never ends up next to a base it doesn't belong to
+	FILE* previous = std::fopen(path.c_str(), "rb");
+	if (previous != nullptr) {
+		FileHeader header;
+		if (readFileHeader(previous, header)) {
+			generation = header.generation + 1;
+		}
+
+		std::fclose(previous);
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(fileMutex);
+		if (!startGeneration(generation)) {
+			return;
+		}
+	}
+
+	if (interval > 0) {
+		thread = std::thread(&Checkpointer::run, this);
+	}
+}
+
+Checkpointer::~Checkpointer() {
+	stop();
+
+	if (file != nullptr) {
+		std::fclose(file);
+	}
+}
+
+bool Checkpointer::isOpen() {
+	std::lock_guard<std::mutex> lock(fileMutex);
+	return file != nullptr;
+}
+
+bool Checkpointer::checkpoint() {
+	std::lock_guard<std::mutex> lock(fileMutex);
+
+	if (file == nullptr) {
+		return false;
+	}
+
+	// A torn checkpoint would hide every one appended after it from recover(), so the file
+	// is cut back to the last whole one (or replaced by a new generation if that fails)
+	// The bricks that didn't make it are still newer than checkpointedVersion, so the next one has them
+	if (!appendCheckpoint(file, fileSize)) {
+		std::fclose(file);
+		file = nullptr;
+
+		if (truncateFile(path, fileSize)) {
+			file = std::fopen(path.c_str(), "ab");
+		}
+
+		if (file == nullptr) {
+			startGeneration(generation + 1);
+		}
+
+		return false;
+	}
+
+	if (compactSize > 0 && fileSize >= compactSize) {
+		return startGeneration(generation + 1);
+	}
+
+	return true;
+}
+
+void Checkpointer::stop() {
+	{
+		std::lock_guard<std::mutex> lock(stateMutex);
+		stopping = true;
+	}
+
+	wakeUp.notify_all();
+
+	if (thread.joinable()) {
+		thread.join();
+	}
+
+	checkpoint();
+}
+
+Checkpointer::Stats Checkpointer::getStats() {
+	std::lock_guard<std::mutex> lock(statsMutex);
+	return stats;
+}
+
+void Checkpointer::run() {
+	Trace::setThreadName("checkpoint");
+
+	std::unique_lock<std::mutex> lock(stateMutex);
+
+	while (!wakeUp.wait_for(lock, interval, [this]() { return stopping; })) {
+		lock.unlock();
+		checkpoint();
+		lock.lock();
+	}
+}
+
+bool Checkpointer::startGeneration(unsigned long long newGeneration) {
+	TRACE_SCOPE("checkpointBase");
+
+	int dim = map.getDim();
+
+	// The base is copied one slab at a time, so the map is never locked for long
+	// Slabs copied later may hold newer cells, but every brick changed after the
+	// first slab was copied is also in the first checkpoint below, which brings them all up to date
+	std::vector<unsigned char> slab;
+	unsigned long long baseVersion = 0;
+	bool firstSlab = true;
+
+	bool saved = VolumeSnapshot::save(basePath(path, newGeneration), dim, DensityMap::brickSize, [&](int x0, int x1) {
+		slab.resize(size_t(x1 - x0) * dim * dim);
+		unsigned long long version = map.copyCells(x0, x1, slab.data());
+
+		if (firstSlab) {
+			baseVersion = version;
+			firstSlab = false;
+		}
+
+		return static_cast<const unsigned char*>(slab.data());
+	});
+
+	if (!saved) {
+		return false;
+	}
+
+	// The new delta file is complete (with its first checkpoint) before it replaces the old one
+	std::string temporaryPath = path + ".tmp";
+	FILE* newFile = std::fopen(temporaryPath.c_str(), "wb");
+	if (newFile == nullptr) {
+		return false;
+	}
+
+	FileHeader header;
+	std::memcpy(header.magic, fileMagic, sizeof(fileMagic));
+	header.version = version;
+	header.dim = dim;
+	header.brickSize = DensityMap::brickSize;
+	header.generation = newGeneration;
+
+	unsigned long long oldVersion = checkpointedVersion;
+	glm::ivec3 oldOrigin = checkpointedOrigin;
+	checkpointedVersion = baseVersion;
+
+	// The first checkpoint is always written, as the base doesn't say where the window was
+	unsigned long long newSize = sizeof(header);
+	bool ok = std::fwrite(&header, sizeof(header), 1, newFile) == 1 && appendCheckpoint(newFile, newSize, true) && flushToDisk(newFile);
+	ok = std::fclose(newFile) == 0 && ok;
+
+	if (ok && file != nullptr) {
+		std::fclose(file);
+		file = nullptr;
+	}
+
+	// The old delta file stays until the new one takes its place
+	if (ok) {
+		ok = replaceFile(temporaryPath, path);
+	}
+
+	if (!ok) {
+		std::remove(temporaryPath.c_str());
+		std::remove(basePath(path, newGeneration).c_str());
+		checkpointedVersion = oldVersion;
+		checkpointedOrigin = oldOrigin;
+		return false;
+	}
+
+	file = std::fopen(path.c_str(), "ab");
+	if (file == nullptr) {
+		return false;
+	}
+
+	if (newGeneration > 0) {
+		std::remove(basePath(path, newGeneration - 1).c_str());
+	}
+
+	generation = newGeneration;
+	fileSize = newSize;
+
+	std::lock_guard<std::mutex> lock(statsMutex);
+	stats.generation = generation;
+	stats.deltaBytes = fileSize;
+
+	return true;
+}
+
+bool Checkpointer::appendCheckpoint(FILE* target, unsigned long long& targetSize, bool always) {
+	TRACE_SCOPE("checkpoint");
+
+	Clock::time_point start = Clock::now();
+
+	// The only part that holds the map's lock
+	bricks.clear();
+	glm::ivec3 origin;
+	unsigned long long version = map.copyChangedBricks(checkpointedVersion, bricks, brickCells, &origin);
+
+	double copySeconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+	int numBricks = static_cast<int>(bricks.size());
+	std::vector<BrickEntry> entries(numBricks);
+	std::vector<std::vector<unsigned char>> compressed(numBricks);
+
+	ThreadPool::global().parallelFor(0, numBricks, [&](int b) {
+		const unsigned char* cells = brickCells.data() + b * cellsPerBrick;
+		BrickEntry& entry = entries[b];
+
+		entry.x = bricks[b].x;
+		entry.y = bricks[b].y;
+		entry.z = bricks[b].z;
+		entry.reserved = 0;
+
+		unsigned char value;
+		if (BrickCodec::isUniform(cells, cellsPerBrick, value)) {
+			entry.uniform = 1;
+			entry.value = value;
+			entry.size = 0;
+		}
+		else {
+			entry.uniform = 0;
+			entry.value = 0;
+			BrickCodec::encode(cells, cellsPerBrick, compressed[b]);
+			entry.size = static_cast<uint32_t>(compressed[b].size());
+		}
+	});
+
+	bool ok = true;
+	unsigned long long bytes = 0;
+
+	bool written = numBricks > 0 || origin != checkpointedOrigin || always;
+
+	if (written) {
+		payload.assign(reinterpret_cast<const unsigned char*>(entries.data()),
+			reinterpret_cast<const unsigned char*>(entries.data() + numBricks));
+
+		for (const std::vector<unsigned char>& data : compressed) {
+			payload.insert(payload.end(), data.begin(), data.end());
+		}
+
+		CheckpointHeader header;
+		std::memcpy(header.magic, checkpointMagic, sizeof(checkpointMagic));
+		header.numBricks = numBricks;
+		header.payloadSize = payload.size();
+		header.volumeVersion = version;
+		header.originCell[0] = origin.x;
+		header.originCell[1] = origin.y;
+		header.originCell[2] = origin.z;
+		header.reserved = 0;
+
+		CommitRecord commit;
+		std::memcpy(commit.magic, commitMagic, sizeof(commitMagic));
+		commit.numBricks = numBricks;
+		commit.checksum = checksum(payload.data(), payload.size());
+
+		ok = std::fwrite(&header, sizeof(header), 1, target) == 1 &&
+			std::fwrite(payload.data(), 1, payload.size(), target) == payload.size() &&
+			std::fwrite(&commit, sizeof(commit), 1, target) == 1 &&
+			flushToDisk(target);
+
+		bytes = sizeof(header) + payload.size() + sizeof(commit);
+	}
+
+	if (!ok) {
+		return false;
+	}
+
+	checkpointedVersion = version;
+	checkpointedOrigin = origin;
+	targetSize += bytes;
+
+	std::lock_guard<std::mutex> lock(statsMutex);
+	stats.checkpoints += written ? 1 : 0;
+	stats.bricks += numBricks;
+	stats.bytes += bytes;
+	stats.deltaBytes = targetSize;
+	stats.lastSeconds = std::chrono::duration<double>(Clock::now() - start).count();
+	stats.lastCopySeconds = copySeconds;
+
+	return true;
+}
+
+bool Checkpointer::recover(DensityMap& map, const std::string& path, unsigned long long* numCheckpoints) {
+	TRACE_SCOPE("recoverCheckpoint");
+
+	if (numCheckpoints != nullptr) {
+		*numCheckpoints = 0;
+	}
+
+	FILE* file = std::fopen(path.c_str(), "rb");
+	if (file == nullptr) {
+		return false;
+	}
+
+	FileHeader header;
+	if (!readFileHeader(file, header) || header.dim != static_cast<uint32_t>(map.getDim()) ||
+		header.brickSize != static_cast<uint32_t>(DensityMap::brickSize)) {
+		std::fclose(file);
+		return false;
+	}
+
+	// The delta file is read whole (it is never much bigger than compactSize)
+	std::vector<unsigned char> data;
+	unsigned char chunk[1 << 16];
+	size_t numRead;
+	while ((numRead = std::fread(chunk, 1, sizeof(chunk), file)) > 0) {
+		data.insert(data.end(), chunk, chunk + numRead);
+	}
+
+	std::fclose(file);
+
+	// The base holds the cells as they were stored, which is where a window at 0 loads them
+	map.restoreOrigin(glm::ivec3(0));
+
+	if (!map.loadSnapshot(basePath(path, header.generation))) {
+		return false;
+	}
+
+	// Finding the last committed copy of every brick
+	long long int bricksPerSide = (header.dim + DensityMap::brickSize - 1) / DensityMap::brickSize;
+
+	struct BrickSource {
+		BrickEntry entry;
+		size_t offset;
+	};
+
+	std::vector<int> latest(bricksPerSide * bricksPerSide * bricksPerSide, -1);
+	std::vector<BrickSource> sources;
+	unsigned long long committed = 0;
+	glm::ivec3 origin(0);
+
+	size_t position = 0;
+	while (data.size() - position >= sizeof(CheckpointHeader) + sizeof(CommitRecord)) {
+		CheckpointHeader checkpointHeader;
+		std::memcpy(&checkpointHeader, data.data() + position, sizeof(checkpointHeader));
+
+		size_t payloadStart = position + sizeof(checkpointHeader);
+		size_t space = data.size() - payloadStart - sizeof(CommitRecord);
+
+		if (std::memcmp(checkpointHeader.magic, checkpointMagic, sizeof(checkpointMagic)) != 0 || checkpointHeader.payloadSize > space ||
+			checkpointHeader.payloadSize < uint64_t(checkpointHeader.numBricks) * sizeof(BrickEntry)) {
+			break;
+		}
+
+		size_t payloadSize = static_cast<size_t>(checkpointHeader.payloadSize);
+		const unsigned char* payload = data.data() + payloadStart;
+
+		CommitRecord commit;
+		std::memcpy(&commit, payload + payloadSize, sizeof(commit));
+
+		if (std::memcmp(commit.magic, commitMagic, sizeof(commitMagic)) != 0 || commit.numBricks != checkpointHeader.numBricks ||
+			commit.checksum != checksum(payload, payloadSize)) {
+			break;
+		}
+
+		size_t brickData = size_t(checkpointHeader.numBricks) * sizeof(BrickEntry);
+		bool valid = true;
+
+		for (uint32_t b = 0; b < checkpointHeader.numBricks && valid; b++) {
+			BrickSource source;
+			std::memcpy(&source.entry, payload + b * sizeof(BrickEntry), sizeof(BrickEntry));
+			source.offset = payloadStart + brickData;
+
+			const BrickEntry& entry = source.entry;
+			valid = entry.x < bricksPerSide && entry.y < bricksPerSide && entry.z < bricksPerSide && entry.size <= payloadSize - brickData;
+
+			if (valid) {
+				latest[(entry.x * bricksPerSide + entry.y) * bricksPerSide + entry.z] = static_cast<int>(sources.size());
+				sources.push_back(source);
+				brickData += entry.size;
+			}
+		}
+
+		if (!valid) {
+			break;
+		}
+
+		committed++;
+		origin = glm::ivec3(checkpointHeader.originCell[0], checkpointHeader.originCell[1], checkpointHeader.originCell[2]);
+		position = payloadStart + payloadSize + sizeof(CommitRecord);
+	}
+
+	// Decompressing every brick once, in parallel
+	std::vector<glm::ivec3> positions;
+	std::vector<const BrickSource*> toDecode;
+
+	for (size_t i = 0; i < latest.size(); i++) {
+		if (latest[i] >= 0) {
+			const BrickSource& source = sources[latest[i]];
+			positions.push_back(glm::ivec3(source.entry.x, source.entry.y, source.entry.z));
+			toDecode.push_back(&source);
+		}
+	}
+
+	std::vector<unsigned char> values(toDecode.size() * cellsPerBrick);
+	std::vector<char> failed(toDecode.size(), 0);
+
+	ThreadPool::global().parallelFor(0, static_cast<int>(toDecode.size()), [&](int i) {
+		const BrickSource& source = *toDecode[i];
+		unsigned char* out = values.data() + i * cellsPerBrick;
+
+		if (source.entry.uniform) {
+			std::memset(out, source.entry.value, cellsPerBrick);
+		}
+		else if (!BrickCodec::decode(data.data() + source.offset, source.entry.size, out, cellsPerBrick)) {
+			failed[i] = 1;
+		}
+	});
+
+	if (std::find(failed.begin(), failed.end(), 1) != failed.end()) {
+		return false;
+	}
+
+	map.writeBricks(positions.data(), static_cast<int>(positions.size()), values.data());
+	map.restoreOrigin(origin);
+
+	if (numCheckpoints != nullptr) {
+		*numCheckpoints = committed;
+	}
+
+	return true;
+}
+
+std::string Checkpointer::basePath(const std::string& path, unsigned long long generation) {
+	return path + "." + std::to_string(generation) + ".base";
+}
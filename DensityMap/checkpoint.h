@@ -0,0 +1,169 @@
+#pragma once
+
+#include <glm/glm.hpp>
+
+#include "densityMap.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Crash-safe checkpoints of a DensityMap that only write what changed
+//
+// A checkpoint at path is made of two files:
+//   path.<generation>.base  a VolumeSnapshot of the whole volume
+//   path                    an append-only list of the bricks changed since then
+// The delta file starts with a FileHeader naming the generation of its base and
+// is followed by checkpoints, each one a CheckpointHeader, the payload and a CommitRecord:
+//   Payload: numBricks BrickEntry structs, then the compressed bricks (BrickCodec) in the same order
+// Bricks are saved as the map stores them, and every checkpoint records where the window was,
+// so recover() puts the window back over them (see DensityMap::restoreOrigin())
+// A checkpoint only counts once its CommitRecord is on disk with a matching checksum,
+// so a crash in the middle of writing one loses that checkpoint and nothing else
+// Numbers are stored in the byte order of the machine that wrote them
+namespace CheckpointFormat {
+	struct FileHeader {
+		char magic[4];
+		uint32_t version;
+		uint32_t dim;
+		uint32_t brickSize;
+		uint64_t generation;
+	};
+
+	struct CheckpointHeader {
+		char magic[4];
+		uint32_t numBricks;
+		uint64_t payloadSize;
+
+		// Version of the volume the bricks were copied from
+		uint64_t volumeVersion;
+
+		// World position of the window's corner in cells when they were copied
+		int32_t originCell[3];
+		uint32_t reserved;
+	};
+
+	struct BrickEntry {
+		uint32_t x, y, z;
+
+		// Compressed size (0 for uniform bricks, which are only value)
+		uint32_t size;
+		uint8_t uniform;
+		uint8_t value;
+		uint16_t reserved;
+	};
+
+	struct CommitRecord {
+		char magic[4];
+		uint32_t numBricks;
+
+		// FNV-1a hash of the payload
+		uint64_t checksum;
+	};
+
+	static const char fileMagic[4] = { 'D', 'M', 'C', 'K' };
+	static const char checkpointMagic[4] = { 'C', 'K', 'P', 'T' };
+	static const char commitMagic[4] = { 'D', 'O', 'N', 'E' };
+	static const uint32_t version = 2;
+}
+
+// Writes checkpoints of a map from a background thread
+// Each checkpoint copies the bricks changed since the last one while holding the map's
+// write lock (a memcpy per brick), then compresses and appends them without any lock,
+// so its cost follows the amount of change and ingestion only waits for the copy
+// Once the delta file grows past compactSize, a new base is written and the deltas start over
+class Checkpointer {
+public:
+	struct Stats {
+		unsigned long long checkpoints;
+		unsigned long long bricks;
+		unsigned long long bytes;
+
+		// Size of the current delta file and generation of its base
+		unsigned long long deltaBytes;
+		unsigned long long generation;
+
+		// How long the last checkpoint took and how much of that the map was locked
+		double lastSeconds;
+		double lastCopySeconds;
+	};
+
+	// Constructor (map must outlive the checkpointer)
+	// Writes a new base straight away, then a checkpoint every interval seconds
+	// (an interval of 0 only writes checkpoints when checkpoint() is called)
+	Checkpointer(DensityMap& map, const std::string& path, double interval = 10, unsigned long long compactSize = 256ULL << 20);
+
+	// Destructor (stops the thread and writes a last checkpoint)
+	~Checkpointer();
+
+	Checkpointer(const Checkpointer&) = delete;
+	Checkpointer& operator=(const Checkpointer&) = delete;
+
+	// Returns false if the base or the delta file couldn't be written
+	bool isOpen();
+
+	// Writes a checkpoint now (from the calling thread)
+	bool checkpoint();
+
+	// Stops the background thread and writes a last checkpoint
+	void stop();
+
+	Stats getStats();
+
+	// Loads the base of a checkpoint into map and applies every committed delta
+	// Each brick is only decompressed once, from the last checkpoint that has it
+	// The map must have the dim of the map that was checkpointed
+	static bool recover(DensityMap& map, const std::string& path, unsigned long long* numCheckpoints = nullptr);
+
+private:
+	typedef std::chrono::steady_clock Clock;
+
+	DensityMap& map;
+	std::string path;
+	std::chrono::duration<double> interval;
+	unsigned long long compactSize;
+
+	// Only one checkpoint is written at a time
+	std::mutex fileMutex;
+	FILE* file;
+	unsigned long long fileSize;
+	unsigned long long generation;
+
+	// Bricks changed after this version go into the next checkpoint
+	unsigned long long checkpointedVersion;
+
+	// Where the window was in the last checkpoint (the next one is written if it moved, even with no bricks)
+	glm::ivec3 checkpointedOrigin;
+
+	// Reused between checkpoints
+	std::vector<glm::ivec3> bricks;
+	std::vector<unsigned char> brickCells;
+	std::vector<unsigned char> payload;
+
+	std::mutex statsMutex;
+	Stats stats;
+
+	std::mutex stateMutex;
+	std::condition_variable wakeUp;
+	bool stopping;
+	std::thread thread;
+
+	// Body of the background thread
+	void run();
+
+	// Writes a base of a new generation and a delta file that starts from it
+	// (fileMutex must be locked)
+	bool startGeneration(unsigned long long newGeneration);
+
+	// Copies the changed bricks and appends them to target, adding the bytes written
+	// to targetSize (fileMutex must be locked)
+	// Nothing is appended if no bricks changed and the window didn't move, unless always is true
+	bool appendCheckpoint(FILE* target, unsigned long long& targetSize, bool always = false);
+
+	static std::string basePath(const std::string& path, unsigned long long generation);
+};
@@ -1,19 +1,179 @@
 #include "densityMap.h"
+#include "trace.h"
+#include "journal.h"
+#include "volumeSnapshot.h"
+#include "volumeKernels.h"
+#include "threadPool.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+// FNV-1a hash of some bytes, used to notice when drawing parameters change
+static unsigned long long hashBytes(unsigned long long hash, const void* data, size_t size) {
+	const unsigned char* bytes = static_cast<const unsigned char*>(data);
+
+	for (size_t i = 0; i < size; i++) {
+		hash ^= bytes[i];
+		hash *= 1099511628211ULL;
+	}
+
+	return hash;
+}
+
+// Liang-Barsky clipping of the samples start + i * step (i on [0, numVals)) to the box [0, size)^3,
+// widened by margin on each axis for positions that are off by up to that much
+// Writes the range of samples that can be inside the box to first and last (inclusive,
+// rounded outwards, so the samples at either end still have to be checked) and returns
+// false if the line misses the box
+static bool clipSamples(glm::vec3 start, glm::vec3 step, int numVals, float size, int& first, int& last, glm::vec3 margin = glm::vec3(0)) {
+	float tMin = 0;
+	float tMax = static_cast<float>(numVals - 1);
+
+	for (int axis = 0; axis < 3; axis++) {
+		if (step[axis] == 0) {
+			if (start[axis] < -margin[axis] || start[axis] >= size + margin[axis]) {
+				return false;
+			}
+
+			continue;
+		}
+
+		float t0 = (-margin[axis] - start[axis]) / step[axis];
+		float t1 = (size + margin[axis] - start[axis]) / step[axis];
+		if (t0 > t1) {
+			std::swap(t0, t1);
+		}
+
+		tMin = std::max(tMin, t0);
+		tMax = std::min(tMax, t1);
+	}
+
+	if (numVals <= 0 || !(tMin <= tMax)) {
+		return false;
+	}
+
+	first = static_cast<int>(std::floor(tMin));
+	last = std::min(static_cast<int>(std::ceil(tMax)), numVals - 1);
+
+	return true;
+}
 
-DensityMap::DensityMap(long long int dim) {
+// Zeroes the planes [first, first + count) along axis of a dim^3 array (x-major)
+template<typename T>
+static void zeroPlanes(T* values, long long int dim, int axis, int first, int count) {
+	long long int start = first;
+
+	switch (axis) {
+	case 0:
+		std::fill(values + start * dim * dim, values + (start + count) * dim * dim, T(0));
+		break;
+	case 1:
+		for (long long int x = 0; x < dim; x++) {
+			std::fill(values + (x * dim + start) * dim, values + (x * dim + start + count) * dim, T(0));
+		}
+		break;
+	default:
+		for (long long int x = 0; x < dim; x++) {
+			for (long long int y = 0; y < dim; y++) {
+				T* row = values + (x * dim + y) * dim + start;
+				for (int z = 0; z < count; z++) {
+					row[z] = 0;
+				}
+			}
+		}
+		break;
+	}
+}
+
+DensityMap::DensityMap(long long int dim, bool headless) {
 	this->dim = dim;
+	this->headless = headless;
+
+	bricksPerSide = (dim + brickSize - 1) / brickSize;
+	originCell = glm::ivec3(0);
+	wrap = glm::ivec3(0);
+	volumeVersion = 0;
+	brickVersions.assign(bricksPerSide * bricksPerSide * bricksPerSide, 0);
+	filteredVersion = 0;
+	decayTick = 0;
+	decayStamps.assign(bricksPerSide * bricksPerSide * bricksPerSide, 0);
+	decayLive.assign(bricksPerSide * bricksPerSide * bricksPerSide, 0);
+	persistence = 1;
+	zeroDecayTicks = 0;
+	splatTilesPerSide = (dim + splatTileSize - 1) / splatTileSize;
+	splatTilesPerRow = (dim + splatRowSize - 1) / splatRowSize;
+	splatTileIndex.assign(splatTilesPerSide * splatTilesPerSide * splatTilesPerRow, -1);
+	numSplatTiles = 0;
 
 	threshold = 0;
 	brightness = 0;
 	contrast = 1;
 	updateCoefficient = 1;
 
+	// Initializing the array and filling it with zeroes
+	cells = new unsigned char[dim * dim * dim]();
+
+	columnVersions.assign(bricksPerSide * bricksPerSide, 0);
+	uploadedVersions.assign(bricksPerSide * bricksPerSide, 0);
+	nextUploadColumn = 0;
+	staleColumns.assign(bricksPerSide * bricksPerSide, 0);
+
+	batchedCellWrites = 0;
+	pendingClear = -1;
+	linesQueued = 0;
+	linesResolved = 0;
+	cellWriteMark = 0;
+	clearMark = 0;
+
+	// draw() resolves everything until setResolveBudget()
+	resolveBudgetMicroseconds = 0;
+	resolveBudgetVoxels = 0;
+
+	// Hole filling is off until setHoleFilling()
+	holeFillBudget = 0;
+	displayVersion = 0;
+	holeFillVersion = 0;
+
+	// The frame cache is created the first time it is needed
+	frameCaching = false;
+	cacheValid = false;
+	cacheFBO = 0;
+	cacheTexture = 0;
+	cacheWidth = 0;
+	cacheHeight = 0;
+	cachedVolumeVersion = 0;
+	cachedParameterHash = 0;
+	skippedFrames = 0;
+
+	frameUBO = 0;
+	frameUploaded = false;
+
+	journal = nullptr;
+
+	// Without a graphics card there is nothing else to set up
+	if (headless) {
+		return;
+	}
+
+	// Uniform block shared by both shaders (filled by draw() once per frame)
+	std::string frameBlock =
+		"layout(std140) uniform FrameParameters {	\n"
+		"	mat4 cellTransform;						\n"
+		"	mat4 lineTransform;						\n"
+		"	int dim;								\n"
+		"	float threshold;						\n"
+		"	float brightness;						\n"
+		"	float contrast;							\n"
+		"	ivec3 wrap;								\n"
+		"};											\n";
+
 	std::string vCells =
 		"// VERTEX SHADER						\n"
 		"										\n"
 		"#version 330 core						\n"
 		"										\n"
-		"uniform int dim;						\n"
+		+ frameBlock +
 		"										\n"
 		"void main() {							\n"
 		"	int x = gl_VertexID / (dim * dim);	\n"
@@ -32,8 +192,7 @@ DensityMap::DensityMap(long long int dim) {
 		"																\n"
 		"in float fShade;												\n"
 		"																\n"
-		"uniform float brightness;										\n"
-		"uniform float contrast;										\n"
+		+ frameBlock +
 		"																\n"
 		"void main() {													\n"
 		"	float shade = contrast * (fShade - 0.5) + 0.5 + brightness;	\n"
@@ -52,21 +211,17 @@ DensityMap::DensityMap(long long int dim) {
 		"																		\n"
 		"out float fShade;														\n"
 		"																		\n"
-		"uniform mat4 projection;												\n"
-		"uniform mat4 view;														\n"
-		"uniform mat4 model;													\n"
-		"																		\n"
-		"uniform int dim;														\n"
-		"uniform float threshold;												\n"
+		+ frameBlock +
 		"																		\n"
 		"uniform samplerBuffer densities;										\n"
 		"																		\n"
 		"vec4 transform(float x, float y, float z) {							\n"
-		"	return projection * view * model * vec4(x, y, z, 1.0);				\n"
+		"	return cellTransform * vec4(x, y, z, 1.0);							\n"
 		"}																		\n"
 		"																		\n"
 		"float getDensity(int x, int y, int z) {								\n"
-		"	return texelFetch(densities, x * dim * dim + y * dim + z).x;		\n"
+		"	ivec3 p = (ivec3(x, y, z) + wrap) % dim;							\n"
+		"	return texelFetch(densities, p.x * dim * dim + p.y * dim + p.z).x;	\n"
 		"}																		\n"
 		"																		\n"
 		"void genSquare(int x, int y, int z, int a, int b, int c) {				\n"
@@ -121,12 +276,10 @@ DensityMap::DensityMap(long long int dim) {
 		"																\n"
 		"layout(location = 0) in vec3 aPos;								\n"
 		"																\n"
-		"uniform mat4 projection;										\n"
-		"uniform mat4 view;												\n"
-		"uniform mat4 model;											\n"
+		+ frameBlock +
 		"																\n"
 		"void main() {													\n"
-		"	gl_Position = projection * view * model * vec4(aPos, 1.0);	\n"
+		"	gl_Position = lineTransform * vec4(aPos, 1.0);				\n"
 		"}																\n";
 
 	std::string fLines =
@@ -143,16 +296,18 @@ DensityMap::DensityMap(long long int dim) {
 	cellShader = Shader(vCells.c_str(), fCells.c_str(), gCells.c_str(), false);
 	lineShader = Shader(vLines.c_str(), fLines.c_str(), false);
 
-	unsigned char* tempCells = new unsigned char[dim * dim * dim];
+	cellShader.bindUniformBlock("FrameParameters", frameBinding);
+	lineShader.bindUniformBlock("FrameParameters", frameBinding);
 
-	// Initializing the array and filling it with zeroes
-	for (int i = 0; i < dim; i++) {
-		for (int j = 0; j < dim; j++) {
-			for (int k = 0; k < dim; k++) {
-				tempCells[i * dim * dim + j * dim + k] = 0;
-			}
-		}
-	}
+	// The densities are always on texture unit 0
+	cellShader.use();
+	cellShader.setInt(cellShader.getUniformLocation("densities"), 0);
+
+	glGenBuffers(1, &frameUBO);
+	glBindBuffer(GL_UNIFORM_BUFFER, frameUBO);
+	glBufferData(GL_UNIFORM_BUFFER, sizeof(FrameParameters), NULL, GL_DYNAMIC_DRAW);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	frameUploaded = false;
 
 	// Allows blending (translucent drawing)
 	glEnable(GL_BLEND);
@@ -168,7 +323,7 @@ DensityMap::DensityMap(long long int dim) {
 	glBindVertexArray(cellVAO);
 
 	glBindBuffer(GL_TEXTURE_BUFFER, cellDensityTBO);
-	glBufferData(GL_TEXTURE_BUFFER, dim * dim * dim * sizeof(unsigned char), tempCells, GL_STATIC_DRAW);
+	glBufferData(GL_TEXTURE_BUFFER, dim * dim * dim * sizeof(unsigned char), cells, GL_DYNAMIC_DRAW);
 
 	// Associates the texture buffer with the array we just made
 
@@ -178,10 +333,11 @@ DensityMap::DensityMap(long long int dim) {
 	glBindTexture(GL_TEXTURE_BUFFER, cellDensityBufferTexture);
 	glTexBuffer(GL_TEXTURE_BUFFER, GL_R8, cellDensityTBO);
 
-	delete[] tempCells;
+	// Changes are streamed to the texture buffer through the upload ring
+	// A quarter of the volume per frame is plenty for live imaging
+	long long int segmentSize = std::min(dim * dim * dim, std::max(dim * dim * dim / 4, 4LL << 20));
+	uploadRing.reset(new UploadRing(segmentSize));
 
-	glBindBuffer(GL_TEXTURE_BUFFER, cellDensityTBO);
-	cells = (unsigned char*)glMapBuffer(GL_TEXTURE_BUFFER, GL_READ_WRITE);
 
 	// ------------------
 	// Array containing the coordinates of the vertices
@@ -221,85 +377,396 @@ DensityMap::DensityMap(long long int dim) {
 	glEnableVertexAttribArray(0);
 }
 
+DensityMap::~DensityMap() {
+	delete[] cells;
+
+	if (headless) {
+		return;
+	}
+
+	uploadRing.reset();
+
+	glDeleteBuffers(1, &cellDensityTBO);
+	glDeleteTextures(1, &cellDensityBufferTexture);
+	glDeleteVertexArrays(1, &cellVAO);
+
+	glDeleteBuffers(1, &lineVBO);
+	glDeleteVertexArrays(1, &lineVAO);
+
+	glDeleteBuffers(1, &frameUBO);
+
+	if (cacheFBO != 0) {
+		glDeleteFramebuffers(1, &cacheFBO);
+		glDeleteTextures(1, &cacheTexture);
+	}
+
+	glDeleteProgram(cellShader.ID);
+	glDeleteProgram(lineShader.ID);
+}
+
 void DensityMap::clear(unsigned char value) {
 	// Fills the whole array with value
 	// Defaults to zero
 
-	std::lock_guard<std::mutex> writeLock(writeMutex);
+	std::unique_lock<std::mutex> writeLock = lockWrite();
 
-	for (int i = 0; i < dim; i++) {
-		for (int j = 0; j < dim; j++) {
-			for (int k = 0; k < dim; k++) {
-				cellWriteQueue.push(CellWrite(i, j, k, value));
-			}
-		}
+	if (journal) {
+		journal->recordClear(value);
+	}
+
+	// Writes queued before the clear would be overwritten anyway
+	dropQueuedWrites();
+
+	// Cell writes made after it go in on top, as the table is empty
+	pendingClear = value;
+	clearMark = linesQueued;
+	clearQueued = MetricsCounters::Clock::now();
+
+	metrics.addCells(dim * dim * dim);
+	updateBacklog();
+}
+
+void DensityMap::dropQueuedWrites() {
+	// Samples compounded so far are forgotten as well
+	std::fill(compoundCells.begin(), compoundCells.end(), 0);
+	std::fill(compoundBricks.begin(), compoundBricks.end(), 0);
+	std::fill(compoundRows.begin(), compoundRows.end(), 0);
+
+	std::queue<LineWrite>().swap(lineWriteQueue);
+	linesResolved = linesQueued;
+
+	for (int slot : cellWriteSlots) {
+		cellWriteKeys[slot] = -1;
 	}
+
+	cellWriteSlots.clear();
+	cellWriteBatches.clear();
+	batchedCellWrites = 0;
+	pendingClear = -1;
+
+	metrics.setLineQueueDepth(0);
+	metrics.setCellQueueDepth(0);
+	updateBacklog();
 }
 
 void DensityMap::resolveQueues() {
-	// Keeps the queues thread-safe
-	std::lock_guard<std::mutex> writeLock(writeMutex);
+	resolveQueues(0, 0);
+}
+
+bool DensityMap::resolveQueues(int maxMicroseconds, unsigned long long maxVoxels) {
+	TRACE_SCOPE("resolveQueues");
+
+	// The queues only need writeMutex, but the cells are written while draw() may be reading them
+	// (under readMutex only) when this is called from another thread
+	std::lock(readMutex, writeMutex);
+	std::lock_guard<std::mutex> readLock(readMutex, std::adopt_lock);
+	std::lock_guard<std::mutex> writeLock(writeMutex, std::adopt_lock);
+
+	MetricsCounters::Clock::time_point start = MetricsCounters::Clock::now();
+	MetricsCounters::Clock::time_point deadline = start + std::chrono::microseconds(maxMicroseconds);
+	unsigned long long voxelsTouched = 0;
+
+	// Everything written below belongs to a new version of the volume
+	if (!queuesEmpty()) {
+		volumeVersion++;
+	}
+
+	// Lines in the order they were queued until the budget runs out (the first one always goes)
+	// Splats and means are normalized once at the end, so the cell writes made on the way
+	// settle the cells they overwrite (see applyDueCellWrites())
+	for (int l = 0; ; l++) {
+		// Cell writes go in once the lines queued before them are written
+		if (cellWritesDue()) {
+			voxelsTouched += applyDueCellWrites();
+		}
+
+		if (lineWriteQueue.empty() || (l > 0 && ((maxVoxels > 0 && voxelsTouched >= maxVoxels)
+			|| (maxMicroseconds > 0 && MetricsCounters::Clock::now() >= deadline)))) {
+			break;
+		}
 
-	int lineWriteQueueSize = lineWriteQueue.size();
-	for (int l = 0; l < lineWriteQueueSize; l++) {
 		// Getting the line from the front of the queue
-		LineWrite line = lineWriteQueue.front();
+		const LineWrite& line = lineWriteQueue.front();
+		voxelsTouched += integrateLine(line.p1, line.p2, line.vals.data(), line.vals.size(), line.writeMode);
 		lineWriteQueue.pop();
+		linesResolved++;
+	}
+
+	normalizeSplats();
+	normalizeCompound();
+
+	bool resolved = queuesEmpty();
+	if (!resolved) {
+		metrics.addCarriedOverResolve();
+	}
+
+	metrics.setLineQueueDepth(lineWriteQueue.size());
+	metrics.setCellQueueDepth(cellWriteSlots.size() + batchedCellWrites);
+	updateBacklog();
+	metrics.addVoxelsTouched(voxelsTouched);
+	metrics.addResolve(MetricsCounters::Clock::now() - start);
+
+	// The thread lock automatically releases in its destructor
+	return resolved;
+}
+
+void DensityMap::setResolveBudget(int maxMicroseconds, unsigned long long maxVoxels) {
+	resolveBudgetMicroseconds = std::max(maxMicroseconds, 0);
+	resolveBudgetVoxels = maxVoxels;
+}
+
+int DensityMap::getResolveBudgetMicroseconds() {
+	return resolveBudgetMicroseconds;
+}
+
+unsigned long long DensityMap::getResolveBudgetVoxels() {
+	return resolveBudgetVoxels;
+}
+
+void DensityMap::markCellWrites() {
+	// The writes in the table go in before the lines queued since, so the new ones can't join them
+	if (!cellWriteSlots.empty() && cellWriteMark != linesQueued) {
+		sealCellWrites();
+	}
+
+	if (cellWriteSlots.empty()) {
+		cellWriteMark = linesQueued;
+		cellWritesQueued = MetricsCounters::Clock::now();
+
+		if (queuesEmpty()) {
+			metrics.setBacklogStart(cellWritesQueued);
+		}
+	}
+}
+
+void DensityMap::sealCellWrites() {
+	cellWriteBatches.emplace_back();
+	CellWriteBatch& batch = cellWriteBatches.back();
+	batch.mark = cellWriteMark;
+	batch.queued = cellWritesQueued;
+	batch.indices.reserve(cellWriteSlots.size());
+	batch.values.reserve(cellWriteSlots.size());
+
+	for (int slot : cellWriteSlots) {
+		batch.indices.push_back(cellWriteKeys[slot]);
+		batch.values.push_back(cellWriteValues[slot]);
+		cellWriteKeys[slot] = -1;
+	}
+
+	batchedCellWrites += cellWriteSlots.size();
+	cellWriteSlots.clear();
+}
+
+void DensityMap::updateBacklog() {
+	// Everything waiting was made in order, so the oldest write is the first of each kind
+	bool waiting = false;
+	MetricsCounters::Clock::time_point oldest;
+
+	auto consider = [&](MetricsCounters::Clock::time_point queued) {
+		oldest = waiting && oldest < queued ? oldest : queued;
+		waiting = true;
+	};
+
+	if (!lineWriteQueue.empty()) {
+		consider(lineWriteQueue.front().queued);
+	}
+	if (pendingClear >= 0) {
+		consider(clearQueued);
+	}
+	if (!cellWriteBatches.empty()) {
+		consider(cellWriteBatches.front().queued);
+	}
+	if (!cellWriteSlots.empty()) {
+		consider(cellWritesQueued);
+	}
+
+	if (waiting) {
+		metrics.setBacklogStart(oldest);
+	}
+	else {
+		metrics.clearBacklog();
+	}
+}
+
+unsigned long long DensityMap::integrateLine(glm::vec3 p1, glm::vec3 p2, const unsigned char* vals, int numVals, WriteMode writeMode) {
+	if (writeMode == WriteMode::Splat) {
+		return splatLine(p1, p2, vals, numVals);
+	}
+	if (writeMode == WriteMode::Compound) {
+		return compoundLine(p1, p2, vals, numVals);
+	}
+
+	unsigned long long voxelsTouched = 0;
+
+	// x, y, and z coordinates of the current data point
+	// Moves along the line defined by p1 and p2
+	float x = p1.x;
+	float y = p1.y;
+	float z = p1.z;
+
+	// Direction of the line defined by p1 and p2
+	float dx = (p2.x - p1.x) / numVals;
+	float dy = (p2.y - p1.y) / numVals;
+	float dz = (p2.z - p1.z) / numVals;
+
+	// Multiple values can fall in the same box, so we
+	// take their average and them combine it with
+	// the current value in the box
+	int newValue = 0;
+	int numNewValues = 0;
+
+	// Corner of the window and where it is stored
+	// (copied, since the compiler can't tell that writing the cells doesn't change them)
+	const glm::vec3 origin = glm::vec3(originCell);
+	const glm::ivec3 offset = wrap;
+	const int size = static_cast<int>(dim);
+	const float scale = static_cast<float>(dim - 1);
+
+	// Only the samples that can land inside the window are walked
+	// The walk adds the step to x, y and z each sample, so they drift from p1 + i * step by a
+	// rounding error per sample, and the window is widened by a bound on that (in cells)
+	glm::vec3 extent = glm::max(glm::abs(p1), glm::abs(p2));
+	glm::vec3 drift = (extent * (static_cast<float>(numVals) * scale) + glm::abs(origin)) * (1.0f / (1 << 21));
+
+	int first;
+	int last;
+	if (!clipSamples(p1 * scale - origin, glm::vec3(dx, dy, dz) * scale, numVals, static_cast<float>(size), first, last, drift)) {
+		return 0;
+	}
+
+	// Previous ix, iy, and iz values
+	int px = -1;
+	int py = -1;
+	int pz = -1;
+
+	// The samples before first are outside, but the walk has to pick up where walking them would
+	// have left it: the position is stepped there the same way (so cells split at the same places),
+	// and the samples of the cell it is in are carried over, as they go into the next cell written
+	// The last samplesKept positions are kept to find that cell; longer runs walk the whole line
+	if (first > 0) {
+		const int samplesKept = 64;
+		glm::vec3 kept[samplesKept];
+
+		for (int i = 0; i < first; i++) {
+			kept[i & (samplesKept - 1)] = glm::vec3(x, y, z);
+			x += dx;
+			y += dy;
+			z += dz;
+		}
+
+		auto cellOf = [&](int i) {
+			const glm::vec3& p = kept[i & (samplesKept - 1)];
+			float cx = p.x * scale - origin.x;
+			float cy = p.y * scale - origin.y;
+			float cz = p.z * scale - origin.z;
+			return glm::ivec3(static_cast<int>(cx), static_cast<int>(cy), static_cast<int>(cz));
+		};
+
+		// The run of samples in the same cell as the one before first
+		glm::ivec3 previous = cellOf(first - 1);
+		int runStart = first - 1;
+		while (runStart > 0 && runStart > first - samplesKept && cellOf(runStart - 1) == previous) {
+			runStart--;
+		}
 
-		glm::vec3 p1 = line.p1;
-		glm::vec3 p2 = line.p2;
-		std::vector<unsigned char> vals = line.vals;
-		WriteMode writeMode = line.writeMode;
-
-		int numVals = vals.size();
-
-		// x, y, and z coordinates of the current data point
-		// Moves along the line defined by p1 and p2
-		float x = p1.x;
-		float y = p1.y;
-		float z = p1.z;
-
-		// Direction of the line defined by p1 and p2
-		float dx = (p2.x - p1.x) / numVals;
-		float dy = (p2.y - p1.y) / numVals;
-		float dz = (p2.z - p1.z) / numVals;
-
-		// Multiple values can fall in the same box, so we
-		// take their average and them combine it with
-		// the current value in the box
-		int newValue = 0;
-		int numNewValues = 0;
-
-		// Previous ix, iy, and iz values
-		int px = -1;
-		int py = -1;
-		int pz = -1;
-
-		for (int i = 0; i < numVals; i++) {
-			// Cell indices determined by x, y, and z
-			int ix = x * (dim - 1);
-			int iy = y * (dim - 1);
-			int iz = z * (dim - 1);
-
-			// Get the next value from the vals array
-			switch (writeMode) {
-			case WriteMode::Avg:
-				newValue += vals[i];
-				numNewValues++;
-				break;
-			case WriteMode::Max:
-				if (vals[i] > newValue) {
-					newValue = vals[i];
+		if (runStart > 0 && runStart == first - samplesKept) {
+			first = 0;
+			x = p1.x;
+			y = p1.y;
+			z = p1.z;
+		}
+		else {
+			px = previous.x;
+			py = previous.y;
+			pz = previous.z;
+
+			// The first sample of a run is written with the cell before it (the walk starts in cell -1)
+			if (runStart > 0 || previous != glm::ivec3(-1)) {
+				runStart++;
+			}
+
+			for (int i = runStart; i < first; i++) {
+				switch (writeMode) {
+				case WriteMode::Avg:
+				default:
+					newValue += vals[i];
+					numNewValues++;
+					break;
+				case WriteMode::Max:
+					if (vals[i] > newValue) {
+						newValue = vals[i];
+					}
+					break;
 				}
-				break;
 			}
+		}
+	}
+
+	// The cells written are gathered and blended a chunk at a time
+	// (a line never comes back to a cell it left, so a chunk has no cell twice)
+	const int weight = blendWeight(updateCoefficient);
+	const int chunkSize = 64;
+	long long int chunkCells[chunkSize];
+	unsigned char chunkValues[chunkSize];
+	unsigned char chunkCurrent[chunkSize];
+	int chunkLength = 0;
+
+	auto blendChunk = [&]() {
+		for (int c = 0; c < chunkLength; c++) {
+			chunkCurrent[c] = cells[chunkCells[c]];
+		}
+
+		blendCells(chunkCurrent, chunkValues, chunkCurrent, weight, chunkLength);
+
+		for (int c = 0; c < chunkLength; c++) {
+			cells[chunkCells[c]] = chunkCurrent[c];
+		}
+
+		chunkLength = 0;
+	};
+
+	for (int i = first; i <= last; i++) {
+		// Cell indices determined by x, y, and z (relative to the window)
+		float cx = x * scale - origin.x;
+		float cy = y * scale - origin.y;
+		float cz = z * scale - origin.z;
+		int ix = cx;
+		int iy = cy;
+		int iz = cz;
+
+		// Get the next value from the vals array
+		// (splats and compounded samples never get here)
+		switch (writeMode) {
+		case WriteMode::Avg:
+		default:
+			newValue += vals[i];
+			numNewValues++;
+			break;
+		case WriteMode::Max:
+			if (vals[i] > newValue) {
+				newValue = vals[i];
+			}
+			break;
+		}
+
+		if (ix != px || iy != py || iz != pz) {
+			// Samples outside the window are dropped
+			// (truncating rounds (-1, 0) up to 0, so the signs are checked as well)
+			if (cx >= 0 && cy >= 0 && cz >= 0 && ix < size && iy < size && iz < size) {
+				// Where the cell is stored
+				int sx = ix + offset.x;
+				int sy = iy + offset.y;
+				int sz = iz + offset.z;
+				sx -= sx >= size ? size : 0;
+				sy -= sy >= size ? size : 0;
+				sz -= sz >= size ? size : 0;
 
-			if (ix != px || iy != py || iz != pz) {
 				unsigned char value;
 
-				// Write the new value to the array
+				// Queue the new value for the array
 				switch (writeMode) {
 				case WriteMode::Avg:
+				default:
 					value = static_cast<unsigned char>(newValue / numNewValues);
 					break;
 				case WriteMode::Max:
@@ -307,194 +774,1909 @@ void DensityMap::resolveQueues() {
 					break;
 				}
 
-				unsigned char currentValue = cells[ix * dim * dim + iy * dim + iz];
-				if (currentValue == 0) {
-					cells[ix * dim * dim + iy * dim + iz] = value;
-				}
-				else {
-					cells[ix * dim * dim + iy * dim + iz] = updateCoefficient * value + (1 - updateCoefficient) * currentValue;
+				catchUpCell(sx, sy, sz);
+
+				chunkCells[chunkLength] = sx * dim * dim + sy * dim + sz;
+				chunkValues[chunkLength] = value;
+				if (++chunkLength == chunkSize) {
+					blendChunk();
 				}
 
-				// Reset these values (since we are in a new cell now)
-				newValue = 0;
-				numNewValues = 0;
+				markCellChanged(sx, sy, sz);
+				voxelsTouched++;
 			}
 
-			// Move x, y, and z along the line
-			x += dx;
-			y += dy;
-			z += dz;
-
-			// Update the previous ix, iy, and iz
-			px = ix;
-			py = iy;
-			pz = iz;
+			// Reset these values (since we are in a new cell now)
+			newValue = 0;
+			numNewValues = 0;
 		}
-	}
 
-	int cellWriteQueueSize = cellWriteQueue.size();
-	for (int c = 0; c < cellWriteQueueSize; c++) {
-		// Getting the cell from the front of the queue
-		CellWrite cell = cellWriteQueue.front();
-		cellWriteQueue.pop();
+		// Move x, y, and z along the line
+		x += dx;
+		y += dy;
+		z += dz;
 
-		cells[cell.x * dim * dim + cell.y * dim + cell.z] = cell.value;
+		// Update the previous ix, iy, and iz
+		px = ix;
+		py = iy;
+		pz = iz;
 	}
 
-	// The thread lock automatically releases in its destructor
-}
+	blendChunk();
 
-// Returns dim
-int DensityMap::getDim() {
-	return dim;
+	return voxelsTouched;
 }
 
-void DensityMap::draw(glm::mat4 projection, glm::mat4 view, glm::mat4 model) {
-	// Special scope for the read lock guard
-	{
-		std::lock_guard<std::mutex> readLock(readMutex);
+unsigned long long DensityMap::splatLine(glm::vec3 p1, glm::vec3 p2, const unsigned char* vals, int numVals) {
+	unsigned long long voxelsTouched = 0;
 
-		glBindBuffer(GL_TEXTURE_BUFFER, cellDensityTBO);
-		glUnmapBuffer(GL_TEXTURE_BUFFER);
+	// Lines before this one are done with their tiles, so a big batch is normalized in parts here
+	if (numSplatTiles >= maxSplatTiles) {
+		normalizeSplats();
+	}
+
+	// Same as integrateLine()
+	const glm::vec3 origin = glm::vec3(originCell);
+	const glm::ivec3 offset = wrap;
+	const int size = static_cast<int>(dim);
+	const float scale = static_cast<float>(dim - 1);
+
+	// First sample and the step between samples, in cells of the window
+	glm::vec3 start = p1 * scale - origin;
+	glm::vec3 step = (p2 - p1) / static_cast<float>(numVals) * scale;
+
+	// A sample reaches the cells on both sides of it, so the samples on (-1, size) count
+	int first;
+	int last;
+	if (!clipSamples(start + 1.0f, step, numVals, static_cast<float>(size + 1), first, last)) {
+		return 0;
+	}
+
+	const int mask = splatTileSize - 1;
+	const int rowMask = splatRowSize - 1;
+
+	// Positions are split into cells and fractions for a chunk of samples at a time
+	const int chunkSize = 64;
+	float x[chunkSize];
+	float y[chunkSize];
+	float z[chunkSize];
+	int cx[chunkSize];
+	int cy[chunkSize];
+	int cz[chunkSize];
+	float fx[chunkSize];
+	float fy[chunkSize];
+	float fz[chunkSize];
+
+	// Lines cross many cells of a tile in a row, so it is only looked up when they move to another
+	int lastTile = -1;
+	SplatTile* tile = nullptr;
+
+	for (int begin = first; begin <= last; begin += chunkSize) {
+		int n = std::min(chunkSize, last + 1 - begin);
+
+		for (int i = 0; i < n; i++) {
+			x[i] = start.x + (begin + i) * step.x;
+			y[i] = start.y + (begin + i) * step.y;
+			z[i] = start.z + (begin + i) * step.z;
+		}
+
+		floorFractions(x, cx, fx, n);
+		floorFractions(y, cy, fy, n);
+		floorFractions(z, cz, fz, n);
 
-		// Needed to standardize the size of the grid
-		glm::mat4 _model = glm::scale<float>(glm::mat4(1.0), glm::vec3(10.0 / (dim - 1), 10.0 / (dim - 1), 10.0 / (dim - 1)));
-		_model = glm::translate<float>(_model, glm::vec3(-(dim - 1) / 2.0, -(dim - 1) / 2.0, -(dim - 1) / 2.0));
+		// Neighbouring samples usually share a cell, so they are splatted together
+		for (int i = 0; i < n;) {
+			int end = i + 1;
+			while (end < n && cx[end] == cx[i] && cy[end] == cy[i] && cz[end] == cz[i]) {
+				end++;
+			}
 
-		// Drawing the volume map
-		cellShader.use();
-		cellShader.setMat4("projection", projection);
-		cellShader.setMat4("view", view);
-		cellShader.setMat4("model", model * _model);
-		cellShader.setInt("dim", dim);
-		cellShader.setInt("densities", 0);
-		cellShader.setFloat("threshold", static_cast<float>(threshold) / 255);
-		cellShader.setFloat("brightness", brightness);
-		cellShader.setFloat("contrast", contrast);
+			int ix = cx[i];
+			int iy = cy[i];
+			int iz = cz[i];
+
+			// Where the first corner is stored
+			int sx = ix + offset.x;
+			int sy = iy + offset.y;
+			int sz = iz + offset.z;
+			sx -= sx >= size ? size : 0;
+			sy -= sy >= size ? size : 0;
+			sz -= sz >= size ? size : 0;
+
+			// Usually all 8 corners are inside the window, next to each other in the array and in the same tile
+			if (ix >= 0 && iy >= 0 && iz >= 0 && ix + 1 < size && iy + 1 < size && iz + 1 < size &&
+				sx + 1 < size && sy + 1 < size && sz + 1 < size && (sx & mask) != mask && (sy & mask) != mask && (sz & rowMask) != rowMask) {
+				int tileIndex = static_cast<int>(((sx >> splatTileShift) * splatTilesPerSide + (sy >> splatTileShift)) * splatTilesPerRow + (sz >> splatRowShift));
+				if (tileIndex != lastTile) {
+					tile = &getSplatTile(sx, sy, sz);
+					lastTile = tileIndex;
+				}
 
-		glActiveTexture(GL_TEXTURE0);
-		glBindTexture(GL_TEXTURE_BUFFER, cellDensityBufferTexture);
-		glTexBuffer(GL_TEXTURE_BUFFER, GL_R8, cellDensityTBO);
+				int row = (sx & mask) * splatTileSize + (sy & mask);
+				int cell = row * splatRowSize + (sz & rowMask);
 
-		glBindVertexArray(cellVAO);
-		glDrawArrays(GL_POINTS, 0, dim * dim * dim);
+				addTrilinear(fx, fy, fz, vals + begin, i, end, tile->weights + cell, tile->sums + cell, splatRowSize, splatTileSize * splatRowSize);
 
-		// Drawing the white lines
-		lineShader.use();
-		lineShader.setMat4("projection", projection);
-		lineShader.setMat4("view", view);
-		lineShader.setMat4("model", model);
+				// Rows (x, y), (x, y + 1), (x + 1, y) and (x + 1, y + 1)
+				tile->rows |= (3ULL | 3ULL << splatTileSize) << row;
+				voxelsTouched += 8;
+			}
+			else {
+				float weights[8] = {};
+				float sums[8] = {};
+				addTrilinear(fx, fy, fz, vals + begin, i, end, weights, sums, 2, 4);
 
-		glBindVertexArray(lineVAO);
-		glDrawArrays(GL_LINES, 0, 24);
+				voxelsTouched += addSplats(ix, iy, iz, weights, sums);
+			}
 
-		cells = (unsigned char*)glMapBuffer(GL_TEXTURE_BUFFER, GL_WRITE_ONLY);
+			i = end;
+		}
 	}
 
-	resolveQueues();
+	return voxelsTouched;
 }
 
-void DensityMap::writeLine(glm::vec3 p1, glm::vec3 p2, std::vector<unsigned char> vals, WriteMode writeMode) {
-	std::lock_guard<std::mutex> writeLock(writeMutex);
-	lineWriteQueue.push(LineWrite(p1, p2, vals, writeMode));
-}
+unsigned long long DensityMap::addSplats(int x, int y, int z, const float* weights, const float* sums) {
+	const int size = static_cast<int>(dim);
+	const int mask = splatTileSize - 1;
+	const int rowMask = splatRowSize - 1;
 
-void DensityMap::writeCell(unsigned int x, unsigned int y, unsigned int z, unsigned char value) {
-	std::lock_guard<std::mutex> writeLock(writeMutex);
-	cellWriteQueue.push(CellWrite(x, y, z, value));
-}
+	unsigned long long added = 0;
 
-void DensityMap::setThreshold(unsigned char value) {
-	threshold = value;
-}
+	for (int corner = 0; corner < 8; corner++) {
+		int wx = x + (corner >> 2);
+		int wy = y + ((corner >> 1) & 1);
+		int wz = z + (corner & 1);
+		if (wx < 0 || wy < 0 || wz < 0 || wx >= size || wy >= size || wz >= size) {
+			continue;
+		}
 
-unsigned char DensityMap::getThreshold() {
-	return threshold;
-}
+		// Where the cell is stored
+		wx += wrap.x;
+		wy += wrap.y;
+		wz += wrap.z;
+		wx -= wx >= size ? size : 0;
+		wy -= wy >= size ? size : 0;
+		wz -= wz >= size ? size : 0;
+
+		SplatTile& tile = getSplatTile(wx, wy, wz);
+		int row = (wx & mask) * splatTileSize + (wy & mask);
+		int cell = row * splatRowSize + (wz & rowMask);
+
+		tile.weights[cell] += weights[corner];
+		tile.sums[cell] += sums[corner];
+		tile.rows |= 1ULL << row;
+		added++;
+	}
 
-void DensityMap::setBrightness(float value) {
-	brightness = value;
+	return added;
 }
 
-float DensityMap::getBrightness() {
-	return brightness;
-}
+DensityMap::SplatTile& DensityMap::addSplatTile(int tile) {
+	if (numSplatTiles == static_cast<int>(splatTiles.size())) {
+		splatTiles.emplace_back(new SplatTile());
+	}
 
-void DensityMap::setContrast(float value) {
-	contrast = value;
-}
+	splatTileIndex[tile] = numSplatTiles;
+	splattedTiles.push_back(tile);
 
-float DensityMap::getContrast() {
-	return contrast;
+	return *splatTiles[numSplatTiles++];
 }
 
-void DensityMap::setUpdateCoefficient(float value) {
-	updateCoefficient = value;
-}
+void DensityMap::normalizeSplats() {
+	if (numSplatTiles == 0) {
+		return;
+	}
 
-float DensityMap::getUpdateCoefficient() {
-	return updateCoefficient;
-}
+	TRACE_SCOPE("normalizeSplats");
 
-unsigned char DensityMap::readCell(int x, int y, int z) {
-	std::lock_guard<std::mutex> readLock(readMutex);
-	return getCell(x, y, z);
-}
+	const int numRows = splatTileSize * splatTileSize;
 
-unsigned char DensityMap::readCellInterpolated(float x, float y, float z) {
-	std::lock_guard<std::mutex> readLock(readMutex);
+	// First cell of a tile
+	auto tileStart = [this](int tile) {
+		return glm::ivec3(tile / (splatTilesPerSide * splatTilesPerRow) * splatTileSize,
+			(tile / splatTilesPerRow) % splatTilesPerSide * splatTileSize, tile % splatTilesPerRow * splatRowSize);
+	};
 
-	// Trilinear interpolation algorithm
-	// Denormalized coordinates
-	glm::ivec3 dn = { x * dim, y * dim, z * dim };
-	float xd = x * dim - float(dn.x);
-	float yd = y * dim - float(dn.y);
-	float zd = z * dim - float(dn.z);
+	// Tiles of the same brick may be blended at the same time, so the bricks are brought up to date first
+	for (int tile : splattedTiles) {
+		glm::ivec3 start = tileStart(tile);
+		catchUpCell(start.x, start.y, start.z);
+	}
 
-	float c000 = getCell(dn.x, dn.y, dn.z);
-	float c001 = getCell(dn.x, dn.y, dn.z + 1);
-	float c010 = getCell(dn.x, dn.y + 1, dn.z);
-	float c011 = getCell(dn.x, dn.y + 1, dn.z + 1);
-	float c100 = getCell(dn.x + 1, dn.y, dn.z);
-	float c101 = getCell(dn.x + 1, dn.y, dn.z + 1);
-	float c110 = getCell(dn.x + 1, dn.y + 1, dn.z);
-	float c111 = getCell(dn.x + 1, dn.y + 1, dn.z + 1);
+	// Each row with splats is divided, blended and zeroed in one pass
+	// Tiles are small, so a task takes a group of them
+	const int tilesPerTask = 64;
+	int numTasks = (numSplatTiles + tilesPerTask - 1) / tilesPerTask;
+	int weight = blendWeight(updateCoefficient);
 
-	float c00 = c000 * (1 - xd) + c100 * xd;
-	float c01 = c001 * (1 - xd) + c101 * xd;
-	float c10 = c010 * (1 - xd) + c110 * xd;
-	float c11 = c011 * (1 - xd) + c111 * xd;
+	auto normalizeTiles = [&](int task) {
+		int end = std::min(numSplatTiles, (task + 1) * tilesPerTask);
 
-	float c0 = c00 * (1 - yd) + c10 * yd;
-	float c1 = c01 * (1 - yd) + c11 * yd;
+		for (int i = task * tilesPerTask; i < end; i++) {
+			int tile = splattedTiles[i];
+			SplatTile& splats = *splatTiles[i];
 
-	float c = c0 * (1 - zd) + c1 * zd;
+			glm::ivec3 start = tileStart(tile);
+			int length = static_cast<int>(std::min<long long int>(splatRowSize, dim - start.z));
 
-	return c;
-}
+			for (int row = 0; row < numRows; row++) {
+				if ((splats.rows >> row & 1) == 0) {
+					continue;
+				}
 
-void DensityMap::readLine(glm::vec3 p1, glm::vec3 p2, int numVals, unsigned char* vals) {
-	// x, y, and z coordinates of the current data point
-	// Moves along the line defined by p1 and p2
-	float x = p1.x;
-	float y = p1.y;
-	float z = p1.z;
+				long long int x = start.x + row / splatTileSize;
+				long long int y = start.y + row % splatTileSize;
+				float* weights = splats.weights + row * splatRowSize;
+				float* sums = splats.sums + row * splatRowSize;
 
-	// Direction of the line defined by p1 and p2
-	float dx = (p2.x - p1.x) / numVals;
-	float dy = (p2.y - p1.y) / numVals;
-	float dz = (p2.z - p1.z) / numVals;
+				blendSplats(cells + (x * dim + y) * dim + start.z, weights, sums, weight, length);
+			}
 
-	for (int i = 0; i < numVals; i++) {
-		vals[i] = readCellInterpolated(x, y, z);
+			splats.rows = 0;
+		}
+	};
 
-		// Move x, y, and z along the line
-		x += dx;
-		y += dy;
-		z += dz;
+	if (numTasks == 1) {
+		normalizeTiles(0);
+	}
+	else {
+		ThreadPool::global().parallelFor(0, numTasks, normalizeTiles);
 	}
-}
+
+	for (int tile : splattedTiles) {
+		splatTileIndex[tile] = -1;
+
+		glm::ivec3 start = tileStart(tile);
+		markCellChanged(start.x, start.y, start.z);
+	}
+
+	splattedTiles.clear();
+	numSplatTiles = 0;
+}
+
+unsigned long long DensityMap::compoundLine(glm::vec3 p1, glm::vec3 p2, const unsigned char* vals, int numVals) {
+	if (compoundCells.empty()) {
+		compoundCells.assign(dim * dim * dim, 0);
+		compoundBricks.assign(bricksPerSide * bricksPerSide * bricksPerSide, 0);
+		compoundRows.assign(dim * dim * bricksPerSide, 0);
+	}
+
+	// Same as integrateLine()
+	const glm::vec3 origin = glm::vec3(originCell);
+	const glm::ivec3 offset = wrap;
+	const int size = static_cast<int>(dim);
+	const float scale = static_cast<float>(dim - 1);
+
+	glm::vec3 start = p1 * scale - origin;
+	glm::vec3 step = (p2 - p1) / static_cast<float>(numVals) * scale;
+
+	int first;
+	int last;
+	if (!clipSamples(start, step, numVals, static_cast<float>(size), first, last)) {
+		return 0;
+	}
+
+	unsigned int* sums = compoundCells.data();
+	unsigned char* bricks = compoundBricks.data();
+	unsigned char* rows = compoundRows.data();
+	unsigned long long voxelsTouched = 0;
+
+	// Every sample is added on its own, so there is nothing to compare or blend
+	for (int i = first; i <= last; i++) {
+		float cx = start.x + i * step.x;
+		float cy = start.y + i * step.y;
+		float cz = start.z + i * step.z;
+		int ix = cx;
+		int iy = cy;
+		int iz = cz;
+
+		if (cx >= 0 && cy >= 0 && cz >= 0 && ix < size && iy < size && iz < size) {
+			int sx = ix + offset.x;
+			int sy = iy + offset.y;
+			int sz = iz + offset.z;
+			sx -= sx >= size ? size : 0;
+			sy -= sy >= size ? size : 0;
+			sz -= sz >= size ? size : 0;
+
+			unsigned int& sum = sums[(sx * dim + sy) * dim + sz];
+
+			// A full count would carry into the sum (only cells hit thousands of times in one batch get here)
+			if ((sum & compoundCountMask) == compoundCountMask) {
+				sum = (sum >> (compoundCountBits + 1)) << compoundCountBits | compoundCountMask >> 1;
+			}
+
+			sum += static_cast<unsigned int>(vals[i]) << compoundCountBits | 1;
+			bricks[((sx >> brickShift) * bricksPerSide + (sy >> brickShift)) * bricksPerSide + (sz >> brickShift)] = 1;
+			rows[(sx * dim + sy) * bricksPerSide + (sz >> brickShift)] = 1;
+			voxelsTouched++;
+		}
+	}
+
+	return voxelsTouched;
+}
+
+void DensityMap::normalizeCompound() {
+	if (compoundBricks.empty()) {
+		return;
+	}
+
+	TRACE_SCOPE("normalizeCompound");
+
+	std::vector<int> bricks;
+	for (size_t b = 0; b < compoundBricks.size(); b++) {
+		if (compoundBricks[b]) {
+			bricks.push_back(static_cast<int>(b));
+			compoundBricks[b] = 0;
+		}
+	}
+
+	auto normalizeBrick = [&](int i) {
+		int b = bricks[i];
+		glm::ivec3 start = glm::ivec3(b / (bricksPerSide * bricksPerSide), (b / bricksPerSide) % bricksPerSide, b % bricksPerSide) * brickSize;
+		glm::ivec3 end = glm::min(start + brickSize, glm::ivec3(dim));
+
+		if (decayStamps[b] != decayTick) {
+			catchUpBrick(b);
+		}
+
+		for (long long int x = start.x; x < end.x; x++) {
+			for (long long int y = start.y; y < end.y; y++) {
+				unsigned char& hasSamples = compoundRows[(x * dim + y) * bricksPerSide + (start.z >> brickShift)];
+				if (!hasSamples) {
+					continue;
+				}
+
+				long long int row = (x * dim + y) * dim + start.z;
+				compoundMeans(compoundCells.data() + row, cells + row, compoundCountBits, end.z - start.z);
+				hasSamples = 0;
+			}
+		}
+	};
+
+	if (bricks.size() == 1) {
+		normalizeBrick(0);
+	}
+	else {
+		ThreadPool::global().parallelFor(0, static_cast<int>(bricks.size()), normalizeBrick);
+	}
+
+	for (int b : bricks) {
+		brickVersions[b] = volumeVersion;
+		decayLive[b] = 1;
+	}
+}
+
+void DensityMap::resetCompounding() {
+	std::unique_lock<std::mutex> writeLock = lockWrite();
+
+	std::vector<unsigned int>().swap(compoundCells);
+	std::vector<unsigned char>().swap(compoundBricks);
+	std::vector<unsigned char>().swap(compoundRows);
+}
+
+// Returns dim
+int DensityMap::getDim() {
+	return dim;
+}
+
+void DensityMap::draw(glm::mat4 projection, glm::mat4 view, glm::mat4 model) {
+	TRACE_SCOPE("draw");
+
+	// Headless maps only apply the writes (and fill the holes they leave)
+	if (headless) {
+		resolveQueues(resolveBudgetMicroseconds, resolveBudgetVoxels);
+
+		if (holeFiller) {
+			std::unique_lock<std::mutex> readLock = lockRead();
+			fillPendingBricks(holeFillBudget);
+		}
+
+		return;
+	}
+
+	// Special scope for the read lock guard
+	{
+		std::unique_lock<std::mutex> readLock = lockRead();
+
+		// Filling the holes in what changed last frame (ingestion only needs the write lock, so it goes on)
+		if (holeFiller) {
+			fillPendingBricks(holeFillBudget);
+		}
+
+		// Copying whatever changed last frame to the graphics card
+		uploadChanges();
+		metrics.addFrame(uploadRing->getBytesUploaded());
+
+		TRACE_SCOPE("render");
+
+		if (frameCaching) {
+			drawCached(projection, view, model);
+		}
+		else {
+			render(projection, view, model);
+		}
+	}
+
+	resolveQueues(resolveBudgetMicroseconds, resolveBudgetVoxels);
+}
+
+void DensityMap::render(glm::mat4 projection, glm::mat4 view, glm::mat4 model) {
+	// Needed to standardize the size of the grid
+	glm::mat4 _model = glm::scale<float>(glm::mat4(1.0), glm::vec3(10.0 / (dim - 1), 10.0 / (dim - 1), 10.0 / (dim - 1)));
+	_model = glm::translate<float>(_model, glm::vec3(-(dim - 1) / 2.0, -(dim - 1) / 2.0, -(dim - 1) / 2.0));
+
+	// Everything both shaders need goes into one uniform buffer
+	FrameParameters frame;
+	frame.cellTransform = projection * view * model * _model;
+	frame.lineTransform = projection * view * model;
+	frame.dim = dim;
+	frame.threshold = static_cast<float>(threshold) / 255;
+	frame.brightness = brightness;
+	frame.contrast = contrast;
+	frame.wrap = wrap;
+	frame.padding = 0;
+
+	glBindBuffer(GL_UNIFORM_BUFFER, frameUBO);
+	if (!frameUploaded || std::memcmp(&frame, &uploadedFrame, sizeof(frame)) != 0) {
+		glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(frame), &frame);
+		uploadedFrame = frame;
+		frameUploaded = true;
+	}
+
+	glBindBufferBase(GL_UNIFORM_BUFFER, frameBinding, frameUBO);
+
+	// Drawing the volume map
+	cellShader.use();
+
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_BUFFER, cellDensityBufferTexture);
+	glTexBuffer(GL_TEXTURE_BUFFER, GL_R8, cellDensityTBO);
+
+	glBindVertexArray(cellVAO);
+	glDrawArrays(GL_POINTS, 0, dim * dim * dim);
+
+	// Drawing the white lines
+	lineShader.use();
+
+	glBindVertexArray(lineVAO);
+	glDrawArrays(GL_LINES, 0, 24);
+}
+
+void DensityMap::drawCached(glm::mat4 projection, glm::mat4 view, glm::mat4 model) {
+	GLint viewport[4];
+	glGetIntegerv(GL_VIEWPORT, viewport);
+
+	GLint target;
+	glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &target);
+
+	GLfloat clearColor[4];
+	glGetFloatv(GL_COLOR_CLEAR_VALUE, clearColor);
+
+	// Everything that affects the picture apart from the cells
+	unsigned long long hash = 14695981039346656037ULL;
+	hash = hashBytes(hash, &projection[0][0], sizeof(projection));
+	hash = hashBytes(hash, &view[0][0], sizeof(view));
+	hash = hashBytes(hash, &model[0][0], sizeof(model));
+	hash = hashBytes(hash, &threshold, sizeof(threshold));
+	hash = hashBytes(hash, &brightness, sizeof(brightness));
+	hash = hashBytes(hash, &contrast, sizeof(contrast));
+	hash = hashBytes(hash, viewport, sizeof(viewport));
+	hash = hashBytes(hash, clearColor, sizeof(clearColor));
+	hash = hashBytes(hash, &target, sizeof(target));
+
+	// Cells that were still waiting to be uploaded count as a change too
+	bool changed = !cacheValid || volumeVersion != cachedVolumeVersion || hash != cachedParameterHash || uploadRing->getBytesUploaded() > 0;
+
+	if (changed) {
+		int width = viewport[2];
+		int height = viewport[3];
+
+		if (cacheFBO == 0 || width != cacheWidth || height != cacheHeight) {
+			createFrameCache(width, height);
+		}
+
+		// Drawing the frame into the cache the same way it would be drawn on the screen
+		glBindFramebuffer(GL_DRAW_FRAMEBUFFER, cacheFBO);
+		glViewport(0, 0, width, height);
+		glClear(GL_COLOR_BUFFER_BIT);
+
+		render(projection, view, model);
+
+		glBindFramebuffer(GL_DRAW_FRAMEBUFFER, target);
+		glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+
+		cacheValid = true;
+		cachedVolumeVersion = volumeVersion;
+		cachedParameterHash = hash;
+	}
+	else {
+		skippedFrames++;
+	}
+
+	// Copying the cached frame to the screen
+	GLint readTarget;
+	glGetIntegerv(GL_READ_FRAMEBUFFER_BINDING, &readTarget);
+
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, cacheFBO);
+	glBlitFramebuffer(0, 0, cacheWidth, cacheHeight, viewport[0], viewport[1], viewport[0] + cacheWidth, viewport[1] + cacheHeight, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, readTarget);
+}
+
+void DensityMap::createFrameCache(int width, int height) {
+	if (cacheFBO == 0) {
+		glGenFramebuffers(1, &cacheFBO);
+		glGenTextures(1, &cacheTexture);
+	}
+
+	glBindTexture(GL_TEXTURE_2D, cacheTexture);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	GLint target;
+	glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &target);
+
+	glBindFramebuffer(GL_DRAW_FRAMEBUFFER, cacheFBO);
+	glFramebufferTexture2D(GL_DRAW_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, cacheTexture, 0);
+	glBindFramebuffer(GL_DRAW_FRAMEBUFFER, target);
+
+	cacheWidth = width;
+	cacheHeight = height;
+	cacheValid = false;
+}
+
+void DensityMap::uploadChanges() {
+	TRACE_SCOPE("upload");
+
+	int numColumns = bricksPerSide * bricksPerSide;
+
+	// With hole filling on, the display volume is drawn instead of the cells
+	const std::vector<unsigned long long>& versions = holeFiller ? displayVersions : brickVersions;
+	unsigned long long currentVersion = holeFiller ? displayVersion : volumeVersion;
+
+	// Finding the newest version of each column of bricks
+	for (int c = 0; c < numColumns; c++) {
+		unsigned long long newest = 0;
+
+		for (int k = 0; k < bricksPerSide; k++) {
+			newest = std::max(newest, versions[c * bricksPerSide + k]);
+		}
+
+		columnVersions[c] = newest;
+	}
+
+	auto needsUpload = [this](int c) {
+		return columnVersions[c] > uploadedVersions[c] || staleColumns[c];
+	};
+
+	uploadRing->beginFrame();
+
+	// Neighbouring columns that changed are uploaded together, one x plane at a time
+	// (a column covers brickSize x planes and brickSize full rows of each plane)
+	int n = 0;
+	while (n < numColumns) {
+		int column = (nextUploadColumn + n) % numColumns;
+
+		if (!needsUpload(column)) {
+			n++;
+			continue;
+		}
+
+		int bx = column / bricksPerSide;
+		int firstBy = column % bricksPerSide;
+
+		int lastBy = firstBy + 1;
+		while (lastBy < bricksPerSide && n + lastBy - firstBy < numColumns && needsUpload(bx * bricksPerSide + lastBy)) {
+			lastBy++;
+		}
+
+		long long int x0 = bx * brickSize;
+		long long int x1 = std::min<long long int>(x0 + brickSize, dim);
+		long long int y0 = firstBy * brickSize;
+
+		// Only as many columns as fit in what is left of this frame's upload
+		while (lastBy > firstBy && (x1 - x0) * (std::min<long long int>(lastBy * brickSize, dim) - y0) * dim > uploadRing->getSpaceLeft()) {
+			lastBy--;
+		}
+
+		if (lastBy == firstBy) {
+			break;
+		}
+
+		long long int y1 = std::min<long long int>(lastBy * brickSize, dim);
+
+		// Bricks that missed fades are uploaded faded, leaving the cells as they are
+		// (the display volume is faded when it is filled)
+		bool faded = false;
+		for (int b = (bx * bricksPerSide + firstBy) * bricksPerSide; b < (bx * bricksPerSide + lastBy) * bricksPerSide && !faded && !holeFiller; b++) {
+			faded = decayStamps[b] != decayTick;
+		}
+
+		for (long long int x = x0; x < x1; x++) {
+			long long int offset = (x * dim + y0) * dim;
+
+			if (faded) {
+				decayScratch.resize((y1 - y0) * dim);
+				for (long long int y = y0; y < y1; y++) {
+					copyFadedCells(x, y, 0, static_cast<int>(dim), decayScratch.data() + (y - y0) * dim);
+				}
+
+				uploadRing->upload(decayScratch.data(), (y1 - y0) * dim, cellDensityTBO, offset);
+			}
+			else {
+				uploadRing->upload((holeFiller ? displayCells.data() : cells) + offset, (y1 - y0) * dim, cellDensityTBO, offset);
+			}
+		}
+
+		for (int by = firstBy; by < lastBy; by++) {
+			uploadedVersions[bx * bricksPerSide + by] = currentVersion;
+			staleColumns[bx * bricksPerSide + by] = 0;
+		}
+
+		n += lastBy - firstBy;
+	}
+
+	// Whatever didn't fit is uploaded first next frame
+	nextUploadColumn = (nextUploadColumn + n) % numColumns;
+
+	uploadRing->endFrame();
+}
+
+void DensityMap::writeLine(glm::vec3 p1, glm::vec3 p2, std::vector<unsigned char> vals, WriteMode writeMode) {
+	writeLine(p1, p2, vals.data(), vals.size(), writeMode);
+}
+
+void DensityMap::writeLine(glm::vec3 p1, glm::vec3 p2, const unsigned char* vals, int numVals, WriteMode writeMode) {
+	TRACE_SCOPE("writeLine");
+
+	std::unique_lock<std::mutex> writeLock = lockWrite();
+
+	MetricsCounters::Clock::time_point now = MetricsCounters::Clock::now();
+	if (queuesEmpty()) {
+		metrics.setBacklogStart(now);
+	}
+
+	lineWriteQueue.push(LineWrite(p1, p2, vals, numVals, writeMode, now));
+	linesQueued++;
+
+	if (journal) {
+		journal->recordLine(p1, p2, vals, numVals, writeMode);
+	}
+
+	metrics.addLines(1, numVals);
+	metrics.setLineQueueDepth(lineWriteQueue.size());
+}
+
+void DensityMap::writeCell(unsigned int x, unsigned int y, unsigned int z, unsigned char value) {
+	std::unique_lock<std::mutex> writeLock = lockWrite();
+	markCellWrites();
+
+	// The table holds where the cell is stored, so a scroll before the writes
+	// are resolved doesn't move them
+	queueCellWrite(((x + wrap.x) % dim * dim + (y + wrap.y) % dim) * dim + (z + wrap.z) % dim, value);
+
+	if (journal) {
+		journal->recordCell(x, y, z, value);
+	}
+
+	metrics.addCells(1);
+	metrics.setCellQueueDepth(cellWriteSlots.size() + batchedCellWrites);
+}
+
+void DensityMap::writeCells(const CellValue* writes, int numWrites) {
+	if (numWrites <= 0) {
+		return;
+	}
+
+	std::unique_lock<std::mutex> writeLock = lockWrite();
+	markCellWrites();
+
+	for (int i = 0; i < numWrites; i++) {
+		const CellValue& write = writes[i];
+		queueCellWrite(((write.x + wrap.x) % dim * dim + (write.y + wrap.y) % dim) * dim + (write.z + wrap.z) % dim, write.value);
+
+		if (journal) {
+			journal->recordCell(write.x, write.y, write.z, write.value);
+		}
+	}
+
+	metrics.addCells(numWrites);
+	metrics.setCellQueueDepth(cellWriteSlots.size() + batchedCellWrites);
+}
+
+void DensityMap::writeBlock(glm::ivec3 start, glm::ivec3 size, const unsigned char* values) {
+	TRACE_SCOPE("writeBlock");
+
+	// The part of the block inside the window
+	glm::ivec3 first = glm::max(start, glm::ivec3(0));
+	glm::ivec3 last = glm::min(start + size, glm::ivec3(dim));
+
+	if (glm::any(glm::lessThanEqual(last, first))) {
+		return;
+	}
+
+	// The cells change while draw() might be reading them
+	std::lock(readMutex, writeMutex);
+	std::lock_guard<std::mutex> readLock(readMutex, std::adopt_lock);
+	std::lock_guard<std::mutex> writeLock(writeMutex, std::adopt_lock);
+
+	if (journal) {
+		journal->recordBlock(start, size, values);
+	}
+
+	volumeVersion++;
+	storeWindowCells(first, last, start, size, values);
+
+	glm::ivec3 written = last - first;
+	metrics.addCells(static_cast<unsigned long long>(written.x) * written.y * written.z);
+	metrics.addVoxelsTouched(static_cast<unsigned long long>(written.x) * written.y * written.z);
+}
+
+void DensityMap::storeWindowCells(glm::ivec3 first, glm::ivec3 last, glm::ivec3 start, glm::ivec3 size, const unsigned char* values) {
+	for (long long int x = first.x; x < last.x; x++) {
+		long long int sx = (x + wrap.x) % dim;
+
+		for (long long int y = first.y; y < last.y; y++) {
+			long long int sy = (y + wrap.y) % dim;
+			const unsigned char* row = values + ((x - start.x) * size.y + (y - start.y)) * size.z;
+
+			// One piece per brick the row goes through (where it is stored, the row may wrap around)
+			for (int z = first.z; z < last.z;) {
+				int sz = static_cast<int>((z + wrap.z) % dim);
+				int count = std::min<int>(last.z - z, std::min<int>(static_cast<int>(dim) - sz, brickSize - (sz & (brickSize - 1))));
+
+				catchUpCell(static_cast<int>(sx), static_cast<int>(sy), sz);
+				std::memcpy(cells + (sx * dim + sy) * dim + sz, row + (z - start.z), count);
+				markCellChanged(static_cast<int>(sx), static_cast<int>(sy), sz);
+
+				z += count;
+			}
+		}
+	}
+}
+
+void DensityMap::growCellWrites() {
+	std::vector<long long int> keys(std::max<size_t>(cellWriteKeys.size() * 2, 1024), -1);
+	std::vector<unsigned char> values(keys.size());
+	size_t mask = keys.size() - 1;
+
+	for (int& slot : cellWriteSlots) {
+		long long int index = cellWriteKeys[slot];
+		size_t newSlot = static_cast<size_t>((static_cast<unsigned long long>(index) * 0x9E3779B97F4A7C15ULL) >> 32) & mask;
+
+		while (keys[newSlot] != -1) {
+			newSlot = (newSlot + 1) & mask;
+		}
+
+		keys[newSlot] = index;
+		values[newSlot] = cellWriteValues[slot];
+		slot = static_cast<int>(newSlot);
+	}
+
+	cellWriteKeys.swap(keys);
+	cellWriteValues.swap(values);
+}
+
+unsigned long long DensityMap::applyDueCellWrites() {
+	unsigned long long written = 0;
+
+	// A clear drops everything queued before it, so it always goes first
+	if (pendingClear >= 0 && linesResolved >= clearMark) {
+		std::memset(cells, pendingClear, dim * dim * dim);
+
+		// Every cell is new, so there are no fades to catch up on
+		std::fill(decayStamps.begin(), decayStamps.end(), decayTick);
+		std::fill(decayLive.begin(), decayLive.end(), 1);
+		std::fill(brickVersions.begin(), brickVersions.end(), volumeVersion);
+
+		written += dim * dim * dim;
+		pendingClear = -1;
+
+		// Splats and means of the lines before it would have been cleared too
+		dropSplats();
+		std::fill(compoundBricks.begin(), compoundBricks.end(), 0);
+		std::fill(compoundRows.begin(), compoundRows.end(), 0);
+	}
+
+	auto writeCell = [this](long long int index, unsigned char value) {
+		int x = static_cast<int>(index / (dim * dim));
+		int y = static_cast<int>(index / dim % dim);
+		int z = static_cast<int>(index % dim);
+
+		catchUpCell(x, y, z);
+		settleCell(x, y, z);
+		cells[index] = value;
+		markCellChanged(x, y, z);
+	};
+
+	while (!cellWriteBatches.empty() && linesResolved >= cellWriteBatches.front().mark) {
+		const CellWriteBatch& batch = cellWriteBatches.front();
+
+		for (size_t i = 0; i < batch.indices.size(); i++) {
+			writeCell(batch.indices[i], batch.values[i]);
+		}
+
+		written += batch.indices.size();
+		batchedCellWrites -= batch.indices.size();
+		cellWriteBatches.pop_front();
+	}
+
+	if (!cellWriteSlots.empty() && linesResolved >= cellWriteMark) {
+		for (int slot : cellWriteSlots) {
+			writeCell(cellWriteKeys[slot], cellWriteValues[slot]);
+			cellWriteKeys[slot] = -1;
+		}
+
+		written += cellWriteSlots.size();
+		cellWriteSlots.clear();
+	}
+
+	return written;
+}
+
+void DensityMap::settleCell(int x, int y, int z) {
+	const int mask = splatTileSize - 1;
+	const int rowMask = splatRowSize - 1;
+
+	// Splats that would have been blended in before the write are overwritten anyway
+	if (numSplatTiles > 0) {
+		int index = splatTileIndex[((x >> splatTileShift) * splatTilesPerSide + (y >> splatTileShift)) * splatTilesPerRow + (z >> splatRowShift)];
+		if (index >= 0) {
+			int cell = ((x & mask) * splatTileSize + (y & mask)) * splatRowSize + (z & rowMask);
+			splatTiles[index]->weights[cell] = 0;
+			splatTiles[index]->sums[cell] = 0;
+		}
+	}
+
+	// The other cells of its compound row get their means now, as the row loses its flag
+	if (!compoundRows.empty()) {
+		unsigned char& hasSamples = compoundRows[((long long int)x * dim + y) * bricksPerSide + (z >> brickShift)];
+		if (hasSamples) {
+			int start = z & ~(brickSize - 1);
+			long long int row = ((long long int)x * dim + y) * dim + start;
+			compoundMeans(compoundCells.data() + row, cells + row, compoundCountBits, std::min<int>(brickSize, static_cast<int>(dim) - start));
+			hasSamples = 0;
+		}
+	}
+}
+
+void DensityMap::dropSplats() {
+	for (int i = 0; i < numSplatTiles; i++) {
+		SplatTile& splats = *splatTiles[i];
+		std::memset(splats.weights, 0, sizeof(splats.weights));
+		std::memset(splats.sums, 0, sizeof(splats.sums));
+		splats.rows = 0;
+
+		splatTileIndex[splattedTiles[i]] = -1;
+	}
+
+	splattedTiles.clear();
+	numSplatTiles = 0;
+}
+
+void DensityMap::integrateLines(const ScanlineView* lines, int numLines) {
+	TRACE_SCOPE("integrateLines");
+
+	if (numLines <= 0) {
+		return;
+	}
+
+	// The cells change while draw() might be reading them
+	std::lock(readMutex, writeMutex);
+	std::lock_guard<std::mutex> readLock(readMutex, std::adopt_lock);
+	std::lock_guard<std::mutex> writeLock(writeMutex, std::adopt_lock);
+
+	volumeVersion++;
+
+	unsigned long long voxelsTouched = 0;
+	unsigned long long numSamples = 0;
+
+	for (int l = 0; l < numLines; l++) {
+		const ScanlineView& line = lines[l];
+
+		if (journal) {
+			journal->recordLine(line.p1, line.p2, line.samples, line.numSamples, line.writeMode);
+		}
+
+		voxelsTouched += integrateLine(line.p1, line.p2, line.samples, line.numSamples, line.writeMode);
+		numSamples += line.numSamples;
+	}
+
+	normalizeSplats();
+	normalizeCompound();
+
+	metrics.addLines(numLines, numSamples);
+	metrics.addVoxelsTouched(voxelsTouched);
+}
+
+void DensityMap::setJournal(JournalRecorder* journal) {
+	std::unique_lock<std::mutex> writeLock = lockWrite();
+	this->journal = journal;
+
+	// Cell and block writes are relative to the window, so a replay has to start where it was
+	if (journal) {
+		journal->recordOrigin(originCell);
+	}
+}
+
+Metrics DensityMap::getMetrics() {
+	return metrics.snapshot();
+}
+
+std::unique_lock<std::mutex> DensityMap::lockWrite() {
+	// The clock is only read when the lock is actually contended
+	std::unique_lock<std::mutex> lock(writeMutex, std::try_to_lock);
+
+	if (!lock.owns_lock()) {
+		MetricsCounters::Clock::time_point start = MetricsCounters::Clock::now();
+		lock.lock();
+		metrics.addWriteLockWait(MetricsCounters::Clock::now() - start);
+	}
+
+	return lock;
+}
+
+std::unique_lock<std::mutex> DensityMap::lockRead() {
+	std::unique_lock<std::mutex> lock(readMutex, std::try_to_lock);
+
+	if (!lock.owns_lock()) {
+		MetricsCounters::Clock::time_point start = MetricsCounters::Clock::now();
+		lock.lock();
+		metrics.addReadLockWait(MetricsCounters::Clock::now() - start);
+	}
+
+	return lock;
+}
+
+void DensityMap::setFrameCaching(bool enabled) {
+	frameCaching = enabled;
+	cacheValid = false;
+}
+
+bool DensityMap::getFrameCaching() {
+	return frameCaching;
+}
+
+unsigned long long DensityMap::getSkippedFrames() {
+	return skippedFrames;
+}
+
+void DensityMap::setThreshold(unsigned char value) {
+	threshold = value;
+}
+
+unsigned char DensityMap::getThreshold() {
+	return threshold;
+}
+
+void DensityMap::setBrightness(float value) {
+	brightness = value;
+}
+
+float DensityMap::getBrightness() {
+	return brightness;
+}
+
+void DensityMap::setContrast(float value) {
+	contrast = value;
+}
+
+float DensityMap::getContrast() {
+	return contrast;
+}
+
+void DensityMap::setUpdateCoefficient(float value) {
+	updateCoefficient = value;
+}
+
+float DensityMap::getUpdateCoefficient() {
+	return updateCoefficient;
+}
+
+void DensityMap::setPersistence(float value) {
+	std::lock(readMutex, writeMutex);
+	std::lock_guard<std::mutex> readLock(readMutex, std::adopt_lock);
+	std::lock_guard<std::mutex> writeLock(writeMutex, std::adopt_lock);
+
+	// The fades so far are applied with the old table
+	catchUpAllBricks();
+
+	persistence = value;
+	int weight = blendWeight(value);
+
+	decayTable.clear();
+	zeroDecayTicks = 0;
+	if (weight == 256) {
+		return;
+	}
+
+	// Row k is row k - 1 faded once more, so k fades give the same as k eager ones
+	decayTable.resize((maxDecayTicks + 1) * 256);
+	for (int v = 0; v < 256; v++) {
+		decayTable[v] = static_cast<unsigned char>(v);
+	}
+
+	for (int k = 1; k <= maxDecayTicks; k++) {
+		for (int v = 0; v < 256; v++) {
+			decayTable[k * 256 + v] = static_cast<unsigned char>((decayTable[(k - 1) * 256 + v] * weight) >> 8);
+		}
+
+		if (zeroDecayTicks == 0 && decayTable[k * 256 + 255] == 0) {
+			zeroDecayTicks = k;
+		}
+	}
+}
+
+float DensityMap::getPersistence() {
+	return persistence;
+}
+
+void DensityMap::fade(int ticks) {
+	if (ticks <= 0) {
+		return;
+	}
+
+	std::lock(readMutex, writeMutex);
+	std::lock_guard<std::mutex> readLock(readMutex, std::adopt_lock);
+	std::lock_guard<std::mutex> writeLock(writeMutex, std::adopt_lock);
+
+	if (decayTable.empty()) {
+		return;
+	}
+
+	volumeVersion++;
+	decayTick += ticks;
+
+	// Bricks that may still have something to fade have changed, the rest are 0 already
+	for (size_t b = 0; b < decayLive.size(); b++) {
+		if (decayLive[b]) {
+			brickVersions[b] = volumeVersion;
+			decayLive[b] = decayTick - decayStamps[b] < static_cast<unsigned long long>(zeroDecayTicks);
+		}
+	}
+}
+
+void DensityMap::catchUpBrick(int brick) {
+	const unsigned char* faded = getDecayRow(brick);
+	decayStamps[brick] = decayTick;
+
+	if (faded == nullptr) {
+		return;
+	}
+
+	glm::ivec3 start = glm::ivec3(brick / (bricksPerSide * bricksPerSide), (brick / bricksPerSide) % bricksPerSide, brick % bricksPerSide) * brickSize;
+	glm::ivec3 end = glm::min(start + brickSize, glm::ivec3(dim));
+
+	for (long long int x = start.x; x < end.x; x++) {
+		for (long long int y = start.y; y < end.y; y++) {
+			unsigned char* row = cells + (x * dim + y) * dim;
+			for (int z = start.z; z < end.z; z++) {
+				row[z] = faded[row[z]];
+			}
+		}
+	}
+}
+
+void DensityMap::catchUpAllBricks() {
+	for (int b = 0; b < static_cast<int>(decayStamps.size()); b++) {
+		if (decayStamps[b] != decayTick) {
+			catchUpBrick(b);
+		}
+	}
+}
+
+void DensityMap::copyFadedCells(long long int x, long long int y, int z, int count, unsigned char* out) {
+	const unsigned char* row = cells + (x * dim + y) * dim;
+	int brickRow = ((x >> brickShift) * bricksPerSide + (y >> brickShift)) * bricksPerSide;
+
+	// One piece per brick
+	for (int end = z + count; z < end;) {
+		int pieceEnd = std::min(end, ((z >> brickShift) + 1) << brickShift);
+		const unsigned char* faded = getDecayRow(brickRow + (z >> brickShift));
+
+		if (faded == nullptr) {
+			std::memcpy(out, row + z, pieceEnd - z);
+			out += pieceEnd - z;
+		}
+		else {
+			for (int i = z; i < pieceEnd; i++) {
+				*out++ = faded[row[i]];
+			}
+		}
+
+		z = pieceEnd;
+	}
+}
+
+void DensityMap::setHoleFilling(int radius, int bricksPerFrame) {
+	std::lock(readMutex, writeMutex);
+	std::lock_guard<std::mutex> readLock(readMutex, std::adopt_lock);
+	std::lock_guard<std::mutex> writeLock(writeMutex, std::adopt_lock);
+
+	holeFillBudget = std::max(bricksPerFrame, 1);
+	int numBricks = static_cast<int>(brickVersions.size());
+
+	if (radius <= 0) {
+		holeFiller.reset();
+		std::vector<unsigned char>().swap(displayCells);
+		displayVersions.clear();
+		holeFillQueue.clear();
+		holeFillQueued.clear();
+	}
+	else {
+		holeFiller.reset(new HoleFiller(radius));
+
+		// Until their turn comes, bricks show their cells as they are
+		displayCells.resize(dim * dim * dim);
+		for (long long int x = 0; x < dim; x++) {
+			for (long long int y = 0; y < dim; y++) {
+				copyFadedCells(x, y, 0, static_cast<int>(dim), displayCells.data() + (x * dim + y) * dim);
+			}
+		}
+
+		displayVersions.assign(numBricks, 0);
+		holeFillQueued.assign(numBricks, 1);
+		holeFillQueue.clear();
+		for (int b = 0; b < numBricks; b++) {
+			holeFillQueue.push_back(b);
+		}
+
+		holeFillVersion = volumeVersion;
+	}
+
+	// The graphics card has the other volume, so everything is uploaded again
+	std::fill(uploadedVersions.begin(), uploadedVersions.end(), 0);
+	std::fill(staleColumns.begin(), staleColumns.end(), 1);
+}
+
+int DensityMap::getHoleFillRadius() {
+	return holeFiller ? holeFiller->getRadius() : 0;
+}
+
+int DensityMap::fillHoles(int maxBricks) {
+	std::lock(readMutex, writeMutex);
+	std::lock_guard<std::mutex> readLock(readMutex, std::adopt_lock);
+	std::lock_guard<std::mutex> writeLock(writeMutex, std::adopt_lock);
+
+	return holeFiller ? fillPendingBricks(maxBricks) : 0;
+}
+
+unsigned char DensityMap::readDisplayCell(int x, int y, int z) {
+	std::unique_lock<std::mutex> readLock = lockRead();
+
+	if (!holeFiller || x < 0 || y < 0 || z < 0 || x >= dim || y >= dim || z >= dim) {
+		return getCell(x, y, z);
+	}
+
+	long long int sx = (x + wrap.x) % dim;
+	long long int sy = (y + wrap.y) % dim;
+	long long int sz = (z + wrap.z) % dim;
+
+	return displayCells[(sx * dim + sy) * dim + sz];
+}
+
+int DensityMap::fillPendingBricks(int maxBricks) {
+	TRACE_SCOPE("fillHoles");
+
+	// A brick is filled from its neighbours too, so they are refilled with it
+	if (volumeVersion != holeFillVersion) {
+		for (glm::ivec3 brick : getChangedBricks(holeFillVersion)) {
+			for (int dx = -1; dx <= 1; dx++) {
+				for (int dy = -1; dy <= 1; dy++) {
+					for (int dz = -1; dz <= 1; dz++) {
+						// Bricks on either side of the array are neighbours in a scrolled window
+						glm::ivec3 neighbour = (brick + glm::ivec3(dx, dy, dz) + glm::ivec3(bricksPerSide)) % glm::ivec3(bricksPerSide);
+						int b = (neighbour.x * bricksPerSide + neighbour.y) * bricksPerSide + neighbour.z;
+
+						if (!holeFillQueued[b]) {
+							holeFillQueued[b] = 1;
+							holeFillQueue.push_back(b);
+						}
+					}
+				}
+			}
+		}
+
+		holeFillVersion = volumeVersion;
+	}
+
+	int count = std::min(maxBricks, static_cast<int>(holeFillQueue.size()));
+	if (count <= 0) {
+		return static_cast<int>(holeFillQueue.size());
+	}
+
+	std::vector<int> bricks(holeFillQueue.begin(), holeFillQueue.begin() + count);
+	holeFillQueue.erase(holeFillQueue.begin(), holeFillQueue.begin() + count);
+
+	// Bricks only write their own cells of the display volume
+	ThreadPool::global().parallelFor(0, count, [&](int i) {
+		fillBrick(bricks[i]);
+	});
+
+	displayVersion++;
+	for (int b : bricks) {
+		displayVersions[b] = displayVersion;
+		holeFillQueued[b] = 0;
+	}
+
+	return static_cast<int>(holeFillQueue.size());
+}
+
+void DensityMap::fillBrick(int brick) {
+	// Scratch space for each thread so bricks never allocate
+	static thread_local std::vector<unsigned char> block;
+	static thread_local std::vector<unsigned char> filled;
+	static thread_local std::vector<int> runs[3];
+	static thread_local std::vector<int> stored[3];
+
+	int r = holeFiller->getRadius();
+
+	glm::ivec3 start = glm::ivec3(brick / (bricksPerSide * bricksPerSide), (brick / bricksPerSide) % bricksPerSide, brick % bricksPerSide) * brickSize;
+	glm::ivec3 size = glm::min(start + brickSize, glm::ivec3(dim)) - start;
+	glm::ivec3 n = size + 2 * r;
+
+	// Where each slice of the block is stored, and which stretch of the window it is in
+	// (cells next to each other in the array are only neighbours if they are next to each other in the window)
+	for (int axis = 0; axis < 3; axis++) {
+		runs[axis].resize(n[axis]);
+		stored[axis].resize(n[axis]);
+
+		for (int i = 0; i < n[axis]; i++) {
+			long long int position = start[axis] - r + i;
+			long long int window = position - wrap[axis];
+
+			stored[axis][i] = static_cast<int>((position % dim + dim) % dim);
+			runs[axis][i] = static_cast<int>(window >= 0 ? window / dim : (window - dim + 1) / dim);
+		}
+	}
+
+	// The block with the fades its bricks missed, one stretch of neighbouring cells of the array at a time
+	block.resize(size_t(n.x) * n.y * n.z);
+	for (int x = 0; x < n.x; x++) {
+		for (int y = 0; y < n.y; y++) {
+			unsigned char* blockRow = block.data() + (x * n.y + y) * n.z;
+
+			for (int z = 0; z < n.z;) {
+				int end = z + 1;
+				while (end < n.z && stored[2][end] == stored[2][end - 1] + 1) {
+					end++;
+				}
+
+				copyFadedCells(stored[0][x], stored[1][y], stored[2][z], end - z, blockRow + z);
+				z = end;
+			}
+		}
+	}
+
+	filled.resize(size_t(size.x) * size.y * size.z);
+	const int* const blockRuns[3] = { runs[0].data(), runs[1].data(), runs[2].data() };
+	holeFiller->fillBlock(block.data(), size, blockRuns, filled.data());
+
+	for (long long int x = 0; x < size.x; x++) {
+		for (long long int y = 0; y < size.y; y++) {
+			std::memcpy(displayCells.data() + ((start.x + x) * dim + start.y + y) * dim + start.z,
+				filled.data() + (x * size.y + y) * size.z, size.z);
+		}
+	}
+}
+
+void DensityMap::filter(const VolumeFilter& filter, bool onlyDirty) {
+	TRACE_SCOPE("filter");
+
+	// The cells are both read and written, so nothing else may touch them
+	std::lock(readMutex, writeMutex);
+	std::lock_guard<std::mutex> readLock(readMutex, std::adopt_lock);
+	std::lock_guard<std::mutex> writeLock(writeMutex, std::adopt_lock);
+
+	catchUpAllBricks();
+
+	// Bricks of the window to filter
+	std::vector<glm::ivec3> bricks;
+
+	if (onlyDirty) {
+		// The filter reads the cells around a brick, so the bricks within its reach of a
+		// changed brick are refiltered with it (like fillPendingBricks() does for holes)
+		int reach = std::max(1, (filter.getRadius() + brickSize - 1) / brickSize);
+		std::vector<char> covered(bricksPerSide * bricksPerSide * bricksPerSide, 0);
+		std::vector<char> reached[3];
+		std::vector<int> reachedBricks[3];
+
+		for (glm::ivec3 brick : getChangedBricks(filteredVersion)) {
+			for (int axis = 0; axis < 3; axis++) {
+				reached[axis].assign(bricksPerSide, 0);
+				reachedBricks[axis].clear();
+
+				// The stored cells start at window position first and may wrap around to 0
+				int first = static_cast<int>((brick[axis] * brickSize - wrap[axis] + dim) % dim);
+				int count = std::min<int>(brickSize, static_cast<int>(dim) - brick[axis] * brickSize);
+				int firstRun = std::min<int>(count, static_cast<int>(dim) - first);
+
+				glm::ivec2 runs[2] = { glm::ivec2(first, first + firstRun - 1), glm::ivec2(0, count - firstRun - 1) };
+				for (int r = 0; r < (count > firstRun ? 2 : 1); r++) {
+					int low = std::max((runs[r].x >> brickShift) - reach, 0);
+					int high = std::min<int>((runs[r].y >> brickShift) + reach, static_cast<int>(bricksPerSide) - 1);
+					std::fill(reached[axis].begin() + low, reached[axis].begin() + high + 1, 1);
+				}
+
+				for (int b = 0; b < bricksPerSide; b++) {
+					if (reached[axis][b]) {
+						reachedBricks[axis].push_back(b);
+					}
+				}
+			}
+
+			for (int i : reachedBricks[0]) {
+				for (int j : reachedBricks[1]) {
+					for (int k : reachedBricks[2]) {
+						covered[(i * bricksPerSide + j) * bricksPerSide + k] = 1;
+					}
+				}
+			}
+		}
+
+		for (int b = 0; b < static_cast<int>(covered.size()); b++) {
+			if (covered[b]) {
+				bricks.push_back(glm::ivec3(b / (bricksPerSide * bricksPerSide), (b / bricksPerSide) % bricksPerSide, b % bricksPerSide));
+			}
+		}
+	}
+	else {
+		for (int i = 0; i < bricksPerSide; i++) {
+			for (int j = 0; j < bricksPerSide; j++) {
+				for (int k = 0; k < bricksPerSide; k++) {
+					bricks.push_back(glm::ivec3(i, j, k));
+				}
+			}
+		}
+	}
+
+	// The filtered bricks have changed, but they don't need filtering again
+	volumeVersion++;
+
+	if (wrap == glm::ivec3(0)) {
+		if (onlyDirty) {
+			filter.applyToBricks(cells, dim, brickSize, bricks);
+		}
+		else {
+			filter.apply(cells, dim, brickSize);
+		}
+
+		for (glm::ivec3 brick : bricks) {
+			int b = (brick.x * bricksPerSide + brick.y) * bricksPerSide + brick.z;
+			brickVersions[b] = volumeVersion;
+			decayLive[b] = 1;
+		}
+	}
+	else {
+		// The window is filtered in an unwrapped copy and the filtered bricks are stored back
+		std::vector<unsigned char> unwrapped;
+		getWindowCells(unwrapped);
+
+		if (onlyDirty) {
+			filter.applyToBricks(unwrapped.data(), dim, brickSize, bricks);
+		}
+		else {
+			filter.apply(unwrapped.data(), dim, brickSize);
+		}
+
+		for (glm::ivec3 brick : bricks) {
+			glm::ivec3 first = brick * brickSize;
+			glm::ivec3 last = glm::min(first + brickSize, glm::ivec3(dim));
+			storeWindowCells(first, last, glm::ivec3(0), glm::ivec3(dim), unwrapped.data());
+		}
+	}
+
+	filteredVersion = volumeVersion;
+}
+
+bool DensityMap::resample(DensityMap& target, VolumeResampler::Type type, glm::vec3 regionMin, glm::vec3 regionMax) {
+	// Checked before the target's queued writes are dropped, so a bad call leaves it as it was
+	if (&target == this || !VolumeResampler::isValidRegion(regionMin, regionMax)) {
+		return false;
+	}
+
+	// This map is only read and the target is only written
+	// All four are locked at once, so resampling two maps into each other at the same time can't deadlock
+	std::lock(readMutex, writeMutex, target.readMutex, target.writeMutex);
+	std::lock_guard<std::mutex> readLock(readMutex, std::adopt_lock);
+	std::lock_guard<std::mutex> writeLock(writeMutex, std::adopt_lock);
+	std::lock_guard<std::mutex> targetReadLock(target.readMutex, std::adopt_lock);
+	std::lock_guard<std::mutex> targetWriteLock(target.writeMutex, std::adopt_lock);
+
+	catchUpAllBricks();
+
+	// Whatever was queued for the target would go on top of cells it no longer has
+	target.dropQueuedWrites();
+
+	std::vector<unsigned char> unwrapped;
+	const unsigned char* window = getWindowCells(unwrapped);
+
+	if (target.wrap == glm::ivec3(0)) {
+		VolumeResampler(type).apply(window, dim, target.cells, target.dim, regionMin, regionMax);
+	}
+	else {
+		// The target's window starts at wrap in its array, so each row is split where it wraps around
+		long long int size = target.dim;
+		std::vector<unsigned char> resampled(size * size * size);
+		VolumeResampler(type).apply(window, dim, resampled.data(), target.dim, regionMin, regionMax);
+
+		glm::ivec3 offset = target.wrap;
+		for (long long int x = 0; x < size; x++) {
+			for (long long int y = 0; y < size; y++) {
+				const unsigned char* row = resampled.data() + (x * size + y) * size;
+				unsigned char* stored = target.cells + (((x + offset.x) % size) * size + (y + offset.y) % size) * size;
+
+				std::memcpy(stored + offset.z, row, size - offset.z);
+				std::memcpy(stored, row + size - offset.z, offset.z);
+			}
+		}
+	}
+
+	// Every cell of the target has changed (and has no fades to catch up on)
+	target.volumeVersion++;
+	std::fill(target.brickVersions.begin(), target.brickVersions.end(), target.volumeVersion);
+	std::fill(target.decayStamps.begin(), target.decayStamps.end(), target.decayTick);
+	std::fill(target.decayLive.begin(), target.decayLive.end(), 1);
+
+	return true;
+}
+
+bool DensityMap::resample(unsigned char* values, int newDim, VolumeResampler::Type type, glm::vec3 regionMin, glm::vec3 regionMax) {
+	if (newDim <= 0 || !VolumeResampler::isValidRegion(regionMin, regionMax)) {
+		return false;
+	}
+
+	std::lock(readMutex, writeMutex);
+	std::lock_guard<std::mutex> readLock(readMutex, std::adopt_lock);
+	std::lock_guard<std::mutex> writeLock(writeMutex, std::adopt_lock);
+
+	catchUpAllBricks();
+
+	std::vector<unsigned char> unwrapped;
+	return VolumeResampler(type).apply(getWindowCells(unwrapped), dim, values, newDim, regionMin, regionMax);
+}
+
+bool DensityMap::saveSnapshot(const std::string& path) {
+	TRACE_SCOPE("saveSnapshot");
+
+	// The cells only change with writeMutex locked
+	std::unique_lock<std::mutex> writeLock = lockWrite();
+
+	if (wrap == glm::ivec3(0) &&
+		std::find_if(decayStamps.begin(), decayStamps.end(), [this](unsigned long long stamp) { return stamp != decayTick; }) == decayStamps.end()) {
+		return VolumeSnapshot::save(path, cells, dim, brickSize);
+	}
+
+	// The window is unwrapped a slab at a time, and bricks that missed fades are faded on the way
+	std::vector<unsigned char> slab;
+
+	return VolumeSnapshot::save(path, static_cast<int>(dim), brickSize, [this, &slab](int x0, int x1) {
+		slab.resize((x1 - x0) * dim * dim);
+
+		for (long long int x = x0; x < x1; x++) {
+			long long int sx = (x + wrap.x) % dim;
+
+			for (long long int y = 0; y < dim; y++) {
+				long long int sy = (y + wrap.y) % dim;
+				unsigned char* out = slab.data() + ((x - x0) * dim + y) * dim;
+
+				copyFadedCells(sx, sy, wrap.z, static_cast<int>(dim) - wrap.z, out);
+				copyFadedCells(sx, sy, 0, wrap.z, out + dim - wrap.z);
+			}
+		}
+
+		return static_cast<const unsigned char*>(slab.data());
+	});
+}
+
+bool DensityMap::loadSnapshot(const std::string& path, glm::vec3 regionMin, glm::vec3 regionMax) {
+	TRACE_SCOPE("loadSnapshot");
+
+	std::lock(readMutex, writeMutex);
+	std::lock_guard<std::mutex> readLock(readMutex, std::adopt_lock);
+	std::lock_guard<std::mutex> writeLock(writeMutex, std::adopt_lock);
+
+	glm::ivec3 cellMin = glm::ivec3(glm::floor(regionMin * float(dim)));
+	glm::ivec3 cellMax = glm::ivec3(glm::ceil(regionMax * float(dim)));
+
+	// The region may cover bricks in part
+	catchUpAllBricks();
+
+	volumeVersion++;
+
+	if (wrap == glm::ivec3(0)) {
+		std::vector<glm::ivec3> bricks;
+		bool loaded = VolumeSnapshot::load(path, cells, dim, brickSize, cellMin, cellMax, &bricks);
+
+		for (glm::ivec3 brick : bricks) {
+			int b = (brick.x * bricksPerSide + brick.y) * bricksPerSide + brick.z;
+			brickVersions[b] = volumeVersion;
+			decayLive[b] = 1;
+		}
+
+		return loaded;
+	}
+
+	// The snapshot is in window order, so it is loaded into an unwrapped copy and the region is stored back
+	std::vector<unsigned char> unwrapped;
+	getWindowCells(unwrapped);
+
+	bool loaded = VolumeSnapshot::load(path, unwrapped.data(), dim, brickSize, cellMin, cellMax);
+
+	glm::ivec3 first = glm::max(cellMin, glm::ivec3(0));
+	glm::ivec3 last = glm::min(cellMax, glm::ivec3(dim));
+	if (glm::all(glm::lessThan(first, last))) {
+		storeWindowCells(first, last, glm::ivec3(0), glm::ivec3(dim), unwrapped.data());
+	}
+
+	return loaded;
+}
+
+unsigned long long DensityMap::copyCells(int x0, int x1, unsigned char* out) {
+	std::unique_lock<std::mutex> writeLock = lockWrite();
+
+	// Bricks that missed fades are faded on the way (the cells are only read here)
+	for (long long int x = x0; x < x1; x++) {
+		for (long long int y = 0; y < dim; y++) {
+			copyFadedCells(x, y, 0, static_cast<int>(dim), out + ((x - x0) * dim + y) * dim);
+		}
+	}
+
+	return volumeVersion;
+}
+
+unsigned long long DensityMap::copyChangedBricks(unsigned long long sinceVersion, std::vector<glm::ivec3>& bricks, std::vector<unsigned char>& out,
+	glm::ivec3* originCell) {
+	std::unique_lock<std::mutex> writeLock = lockWrite();
+
+	if (originCell != nullptr) {
+		*originCell = this->originCell;
+	}
+
+	size_t first = bricks.size();
+	std::vector<glm::ivec3> changed = getChangedBricks(sinceVersion);
+	bricks.insert(bricks.end(), changed.begin(), changed.end());
+
+	size_t brickCells = brickSize * brickSize * brickSize;
+	out.assign((bricks.size() - first) * brickCells, 0);
+
+	for (size_t b = first; b < bricks.size(); b++) {
+		glm::ivec3 start = bricks[b] * brickSize;
+		glm::ivec3 end = glm::min(start + brickSize, glm::ivec3(dim));
+		unsigned char* brick = out.data() + (b - first) * brickCells;
+
+		for (int x = start.x; x < end.x; x++) {
+			for (int y = start.y; y < end.y; y++) {
+				copyFadedCells(x, y, start.z, end.z - start.z, brick + ((x - start.x) * brickSize + (y - start.y)) * brickSize);
+			}
+		}
+	}
+
+	return volumeVersion;
+}
+
+unsigned long long DensityMap::writeBricks(const glm::ivec3* bricks, int numBricks, const unsigned char* values) {
+	std::lock(readMutex, writeMutex);
+	std::lock_guard<std::mutex> readLock(readMutex, std::adopt_lock);
+	std::lock_guard<std::mutex> writeLock(writeMutex, std::adopt_lock);
+
+	volumeVersion++;
+
+	size_t brickCells = brickSize * brickSize * brickSize;
+
+	for (int b = 0; b < numBricks; b++) {
+		glm::ivec3 start = bricks[b] * brickSize;
+		if (glm::any(glm::lessThan(start, glm::ivec3(0))) || glm::any(glm::greaterThanEqual(start, glm::ivec3(dim)))) {
+			continue;
+		}
+
+		glm::ivec3 end = glm::min(start + brickSize, glm::ivec3(dim));
+		const unsigned char* brick = values + b * brickCells;
+
+		for (int x = start.x; x < end.x; x++) {
+			for (int y = start.y; y < end.y; y++) {
+				std::memcpy(cells + x * dim * dim + y * dim + start.z,
+					brick + ((x - start.x) * brickSize + (y - start.y)) * brickSize, end.z - start.z);
+			}
+		}
+
+		// Every cell of the brick is new, so it has no fades to catch up on
+		decayStamps[(bricks[b].x * bricksPerSide + bricks[b].y) * bricksPerSide + bricks[b].z] = decayTick;
+		markCellChanged(start.x, start.y, start.z);
+	}
+
+	return volumeVersion;
+}
+
+std::vector<glm::ivec3> DensityMap::getChangedBricks(unsigned long long sinceVersion) {
+	std::vector<glm::ivec3> bricks;
+
+	for (int i = 0; i < bricksPerSide; i++) {
+		for (int j = 0; j < bricksPerSide; j++) {
+			for (int k = 0; k < bricksPerSide; k++) {
+				if (brickVersions[(i * bricksPerSide + j) * bricksPerSide + k] > sinceVersion) {
+					bricks.push_back(glm::ivec3(i, j, k));
+				}
+			}
+		}
+	}
+
+	return bricks;
+}
+
+unsigned char DensityMap::readCell(int x, int y, int z) {
+	std::unique_lock<std::mutex> readLock = lockRead();
+	return getCell(x, y, z);
+}
+
+unsigned char DensityMap::readCellInterpolated(float x, float y, float z) {
+	std::unique_lock<std::mutex> readLock = lockRead();
+
+	// Trilinear interpolation algorithm
+	// Denormalized coordinates
+	// (moved to the window's corner)
+	glm::vec3 position = glm::vec3(x, y, z) * float(dim) - glm::vec3(originCell);
+	glm::ivec3 dn = glm::ivec3(glm::floor(position));
+	float xd = position.x - float(dn.x);
+	float yd = position.y - float(dn.y);
+	float zd = position.z - float(dn.z);
+
+	float c000 = getCell(dn.x, dn.y, dn.z);
+	float c001 = getCell(dn.x, dn.y, dn.z + 1);
+	float c010 = getCell(dn.x, dn.y + 1, dn.z);
+	float c011 = getCell(dn.x, dn.y + 1, dn.z + 1);
+	float c100 = getCell(dn.x + 1, dn.y, dn.z);
+	float c101 = getCell(dn.x + 1, dn.y, dn.z + 1);
+	float c110 = getCell(dn.x + 1, dn.y + 1, dn.z);
+	float c111 = getCell(dn.x + 1, dn.y + 1, dn.z + 1);
+
+	float c00 = c000 * (1 - xd) + c100 * xd;
+	float c01 = c001 * (1 - xd) + c101 * xd;
+	float c10 = c010 * (1 - xd) + c110 * xd;
+	float c11 = c011 * (1 - xd) + c111 * xd;
+
+	float c0 = c00 * (1 - yd) + c10 * yd;
+	float c1 = c01 * (1 - yd) + c11 * yd;
+
+	float c = c0 * (1 - zd) + c1 * zd;
+
+	return c;
+}
+
+void DensityMap::readLine(glm::vec3 p1, glm::vec3 p2, int numVals, unsigned char* vals) {
+	// x, y, and z coordinates of the current data point
+	// Moves along the line defined by p1 and p2
+	float x = p1.x;
+	float y = p1.y;
+	float z = p1.z;
+
+	// Direction of the line defined by p1 and p2
+	float dx = (p2.x - p1.x) / numVals;
+	float dy = (p2.y - p1.y) / numVals;
+	float dz = (p2.z - p1.z) / numVals;
+
+	for (int i = 0; i < numVals; i++) {
+		vals[i] = readCellInterpolated(x, y, z);
+
+		// Move x, y, and z along the line
+		x += dx;
+		y += dy;
+		z += dz;
+	}
+}
 
 unsigned char DensityMap::getCell(int x, int y, int z) {
-	return cells[x * dim * dim + y * dim + z];
+	// Nothing is known outside the window
+	if (x < 0 || y < 0 || z < 0 || x >= dim || y >= dim || z >= dim) {
+		return 0;
+	}
+
+	x += wrap.x;
+	y += wrap.y;
+	z += wrap.z;
+	x -= x >= dim ? dim : 0;
+	y -= y >= dim ? dim : 0;
+	z -= z >= dim ? dim : 0;
+
+	unsigned char value = cells[x * dim * dim + y * dim + z];
+	const unsigned char* faded = getDecayRow(((x >> brickShift) * bricksPerSide + (y >> brickShift)) * bricksPerSide + (z >> brickShift));
+
+	return faded == nullptr ? value : faded[value];
+}
+
+const unsigned char* DensityMap::getWindowCells(std::vector<unsigned char>& scratch) {
+	if (wrap == glm::ivec3(0)) {
+		return cells;
+	}
+
+	scratch.resize(dim * dim * dim);
+
+	for (long long int x = 0; x < dim; x++) {
+		long long int sx = (x + wrap.x) % dim;
+
+		for (long long int y = 0; y < dim; y++) {
+			long long int sy = (y + wrap.y) % dim;
+
+			// Each row is stored in two pieces, split where it wraps around
+			const unsigned char* row = cells + (sx * dim + sy) * dim;
+			unsigned char* out = scratch.data() + (x * dim + y) * dim;
+			std::memcpy(out, row + wrap.z, dim - wrap.z);
+			std::memcpy(out + dim - wrap.z, row, wrap.z);
+		}
+	}
+
+	return scratch.data();
+}
+
+void DensityMap::scroll(glm::ivec3 cells) {
+	TRACE_SCOPE("scroll");
+
+	if (cells == glm::ivec3(0)) {
+		return;
+	}
+
+	std::lock(readMutex, writeMutex);
+	std::lock_guard<std::mutex> readLock(readMutex, std::adopt_lock);
+	std::lock_guard<std::mutex> writeLock(writeMutex, std::adopt_lock);
+
+	if (journal) {
+		journal->recordOrigin(originCell + cells);
+	}
+
+	volumeVersion++;
+
+	// A clear or cell writes with no lines to wait for go in before the window moves
+	// (the rest are made after lines that are still queued, which the move doesn't change)
+	if (cellWritesDue()) {
+		applyDueCellWrites();
+	}
+
+	for (int axis = 0; axis < 3; axis++) {
+		long long int oldOrigin = originCell[axis];
+		long long int newOrigin = oldOrigin + cells[axis];
+
+		// World planes that come into view (they are stored where the planes that left were)
+		long long int first = std::max(newOrigin, oldOrigin + dim);
+		long long int last = newOrigin + dim;
+		if (cells[axis] < 0) {
+			first = newOrigin;
+			last = std::min(oldOrigin, newOrigin + dim);
+		}
+
+		// At most two runs of planes in the array, split where it wraps around
+		if (first < last) {
+			int start = static_cast<int>(((first % dim) + dim) % dim);
+			int count = static_cast<int>(last - first);
+			int firstRun = std::min<int>(count, dim - start);
+
+			clearPlanes(axis, start, firstRun);
+			clearPlanes(axis, 0, count - firstRun);
+		}
+
+		originCell[axis] = static_cast<int>(newOrigin);
+		wrap[axis] = static_cast<int>(((newOrigin % dim) + dim) % dim);
+	}
+
+	metrics.setCellQueueDepth(cellWriteSlots.size() + batchedCellWrites);
+	updateBacklog();
+}
+
+void DensityMap::setOrigin(glm::vec3 origin) {
+	glm::ivec3 target = glm::ivec3(glm::floor(origin * float(dim - 1) + 0.5f));
+	glm::ivec3 current;
+
+	{
+		std::unique_lock<std::mutex> writeLock = lockWrite();
+		current = originCell;
+	}
+
+	scroll(target - current);
+}
+
+glm::vec3 DensityMap::getOrigin() {
+	return glm::vec3(getOriginCell()) / float(dim - 1);
+}
+
+glm::ivec3 DensityMap::getOriginCell() {
+	std::unique_lock<std::mutex> writeLock = lockWrite();
+	return originCell;
+}
+
+unsigned long long DensityMap::restoreOrigin(glm::ivec3 originCell) {
+	std::lock(readMutex, writeMutex);
+	std::lock_guard<std::mutex> readLock(readMutex, std::adopt_lock);
+	std::lock_guard<std::mutex> writeLock(writeMutex, std::adopt_lock);
+
+	// Cell writes with no lines to wait for go in where the window was when they were made (like scroll())
+	if (cellWritesDue()) {
+		applyDueCellWrites();
+	}
+
+	this->originCell = originCell;
+	for (int axis = 0; axis < 3; axis++) {
+		wrap[axis] = static_cast<int>(((originCell[axis] % dim) + dim) % dim);
+	}
+
+	// Nothing moved in the array, but every brick is somewhere else in the window
+	volumeVersion++;
+	std::fill(brickVersions.begin(), brickVersions.end(), volumeVersion);
+
+	metrics.setCellQueueDepth(cellWriteSlots.size() + batchedCellWrites);
+	updateBacklog();
+
+	return volumeVersion;
+}
+
+void DensityMap::clearPlanes(int axis, int first, int count) {
+	if (count <= 0) {
+		return;
+	}
+
+	zeroPlanes(cells, dim, axis, first, count);
+	if (!compoundCells.empty()) {
+		zeroPlanes(compoundCells.data(), dim, axis, first, count);
+	}
+
+	// Queued cell writes are kept where the cell is stored, so the ones in the planes would land in
+	// the world planes that just came into view
+	auto inPlanes = [&](long long int index) {
+		long long int coordinate = axis == 0 ? index / (dim * dim) : (axis == 1 ? index / dim % dim : index % dim);
+		return coordinate >= first && coordinate < first + count;
+	};
+
+	for (CellWriteBatch& batch : cellWriteBatches) {
+		size_t kept = 0;
+		for (size_t i = 0; i < batch.indices.size(); i++) {
+			if (!inPlanes(batch.indices[i])) {
+				batch.indices[kept] = batch.indices[i];
+				batch.values[kept] = batch.values[i];
+				kept++;
+			}
+		}
+
+		batchedCellWrites -= batch.indices.size() - kept;
+		batch.indices.resize(kept);
+		batch.values.resize(kept);
+	}
+
+	cellWriteBatches.erase(std::remove_if(cellWriteBatches.begin(), cellWriteBatches.end(),
+		[](const CellWriteBatch& batch) { return batch.indices.empty(); }), cellWriteBatches.end());
+
+	// Removing keys would break the chains of linear probing, so the table is filled again
+	bool dropped = false;
+	for (int slot : cellWriteSlots) {
+		dropped = dropped || inPlanes(cellWriteKeys[slot]);
+	}
+
+	if (dropped) {
+		std::vector<std::pair<long long int, unsigned char>> kept;
+		for (int slot : cellWriteSlots) {
+			if (!inPlanes(cellWriteKeys[slot])) {
+				kept.emplace_back(cellWriteKeys[slot], cellWriteValues[slot]);
+			}
+
+			cellWriteKeys[slot] = -1;
+		}
+
+		cellWriteSlots.clear();
+		for (const auto& write : kept) {
+			queueCellWrite(write.first, write.second);
+		}
+	}
+
+	// Every brick the planes go through
+	for (int b = first >> brickShift; b <= (first + count - 1) >> brickShift; b++) {
+		for (int i = 0; i < bricksPerSide; i++) {
+			for (int j = 0; j < bricksPerSide; j++) {
+				glm::ivec3 brick;
+				brick[axis] = b;
+				brick[(axis + 1) % 3] = i;
+				brick[(axis + 2) % 3] = j;
+
+				brickVersions[(brick.x * bricksPerSide + brick.y) * bricksPerSide + brick.z] = volumeVersion;
+			}
+		}
+	}
 }
\ No newline at end of file
@@ -5,10 +5,21 @@
 #include <glm/gtc/matrix_transform.hpp>
 
 #include "shader.h"
+#include "volumeFilter.h"
+#include "holeFiller.h"
+#include "volumeResampler.h"
+#include "uploadRing.h"
+#include "metrics.h"
 
+#include <algorithm>
 #include <vector>
+#include <deque>
 #include <queue>
 #include <mutex>
+#include <memory>
+#include <string>
+
+class JournalRecorder;
 
 // Class that stores the density readings
 // and other related info
@@ -17,28 +28,150 @@ public:
 	// Enum for writeLine()
 	enum class WriteMode {
 		Max,
-		Avg
+		Avg,
+
+		// Spreads each sample over the 8 cells around it with trilinear weights
+		// The weighted mean of everything splatted into a cell during one resolveQueues()
+		// or integrateLines() is blended into the cell like an Avg value (a batch whose splats reach
+		// more than 128 tiles of 8x8x16 cells is blended a run of lines at a time)
+		Splat,
+
+		// Adds each sample to a running sum and count for its cell, so the cell shows the mean of
+		// every sample that landed in it so far (updateCoefficient isn't used). The means of the
+		// bricks that got samples are written to the cells once per resolveQueues() or integrateLines()
+		Compound
+	};
+
+	// A line of samples owned by someone else (see integrateLines())
+	struct ScanlineView {
+		glm::vec3 p1;
+		glm::vec3 p2;
+
+		const unsigned char* samples;
+		int numSamples;
+
+		WriteMode writeMode;
+	};
+
+	// A write to one cell (see writeCells()), x, y and z are relative to the window
+	struct CellValue {
+		unsigned int x;
+		unsigned int y;
+		unsigned int z;
+
+		unsigned char value;
 	};
 
 	// Constructor
-	DensityMap(long long int dim);
+	// A headless map never touches OpenGL (for benchmarks and tools without a window)
+	DensityMap(long long int dim, bool headless = false);
+
+	// Destructor (the OpenGL context must still exist)
+	~DensityMap();
 
 	// Overwrites everything with value
+	// Only a flag is queued, and resolveQueues() fills the cells in one go (cell writes queued
+	// after the clear still go on top of it). Lines still queued are dropped, as they'd be overwritten
 	void clear(unsigned char value = 0);
 
 	// Returns dim
 	int getDim();
 
+	// Forgets every sample written with WriteMode::Compound (the cells keep their values)
+	// and frees the sums they were added up in
+	void resetCompounding();
+
 	// Draws to the screen and optionally clears the screen
 	void draw(glm::mat4 projection, glm::mat4 view, glm::mat4 model);
 
+	// Resolves all write requests in the queues
+	// draw() calls this every frame, but headless maps have to call it themselves
+	// Like integrateLines(), it waits for draw() to finish with the cells, so any thread may call it
+	// Cell writes and clear() go in once the lines queued before them are written, so lines queued
+	// after them go on top
+	void resolveQueues();
+
+	// Resolves the queued writes for at most maxMicroseconds, or until maxVoxels cells have been
+	// touched (0 for no limit), and leaves the rest in order for the next call
+	// At least one line is written per call, so the queues drain as long as writes don't arrive
+	// faster than they can be resolved. Calling this until it returns true gives the same cells
+	// as one resolveQueues(), except where Splat or Compound lines (which are blended once per call)
+	// share cells with lines of other modes
+	// Returns true if nothing is left waiting
+	bool resolveQueues(int maxMicroseconds, unsigned long long maxVoxels = 0);
+
+	// Set and get the budget draw() resolves the queues with (0 and 0, the default, resolves
+	// everything), so a burst of writes is spread over a few frames instead of making one long one
+	// getMetrics() shows how long the oldest write left over has been waiting
+	void setResolveBudget(int maxMicroseconds, unsigned long long maxVoxels = 0);
+	int getResolveBudgetMicroseconds();
+	unsigned long long getResolveBudgetVoxels();
+
+	// Set and get whether draw() keeps the last frame in a framebuffer and
+	// only draws again when the cells or drawing parameters have changed
+	// (the cached frame replaces everything in the viewport)
+	void setFrameCaching(bool enabled);
+	bool getFrameCaching();
+
+	// Returns how many times draw() reused the cached frame
+	unsigned long long getSkippedFrames();
+
+	// Records every writeLine(), writeCell(), writeBlock(), clear() and scroll() from now on into a journal
+	// (nullptr stops recording). The journal must outlive the recording
+	void setJournal(JournalRecorder* journal);
+
+	// Returns a copy of the runtime counters (queue depths, ingest rates,
+	// resolveQueues() durations, lock waits and uploads)
+	// The rates are measured since the previous call
+	Metrics getMetrics();
+
 	// Adds a line of data between p1 and p2 to the lineQueue
 	void writeLine(glm::vec3 p1, glm::vec3 p2, std::vector<unsigned char> vals, WriteMode writeMode = WriteMode::Avg);
 
-	// Writes to one cell of the density map
+	// Same as above, but copies numVals values from an array
+	void writeLine(glm::vec3 p1, glm::vec3 p2, const unsigned char* vals, int numVals, WriteMode writeMode = WriteMode::Avg);
+
+	// Writes lines into the cells straight away, reading the samples where they are
+	// (nothing is copied or queued, so the samples only have to live until this returns)
+	// Waits for draw() to finish with the cells, so call it from the thread receiving the data
+	void integrateLines(const ScanlineView* lines, int numLines);
+
+	// Moves the window of the volume by whole cells
+	// The cells are a window onto an unbounded world that wraps around the array, so
+	// scrolling only clears the planes that come into view (the rest of the cells stay where they are)
+	// writeLine() and the reads take world positions, and samples outside the window are dropped
+	void scroll(glm::ivec3 cells);
+
+	// Set and get the world position of the window's corner, in the units of writeLine()
+	// (rounded to whole cells, see scroll())
+	void setOrigin(glm::vec3 origin);
+	glm::vec3 getOrigin();
+
+	// Returns the world position of the window's corner in cells
+	glm::ivec3 getOriginCell();
+
+	// Puts the window's corner at originCell without clearing or moving any cells
+	// A cell is stored at its window position plus originCell (modulo dim), so this lines cells copied
+	// as stored (copyCells(), copyChangedBricks()) back up with the window they were copied from
+	// Every brick counts as changed afterwards. Returns the version of the volume after the move
+	unsigned long long restoreOrigin(glm::ivec3 originCell);
+
+	// Writes to one cell of the density map (x, y and z are relative to the window)
+	// Writes are coalesced until resolveQueues() or the next writeLine(), so only the last value
+	// written to a cell in between is applied
 	void writeCell(unsigned int x, unsigned int y, unsigned int z, unsigned char value);
 
+	// Same as writeCell() for many cells, taking the lock once
+	void writeCells(const CellValue* writes, int numWrites);
+
+	// Overwrites the cells from start to start + size (relative to the window) with values
+	// (size.x * size.y * size.z of them, x-major), a row at a time with memcpy
+	// Cells outside the window are skipped. Like integrateLines(), this writes straight into the
+	// cells and waits for draw() to finish with them, so it lands before anything still queued
+	void writeBlock(glm::ivec3 start, glm::ivec3 size, const unsigned char* values);
+
 	// Gets the value at a specific index in the array and writes it to val
+	// (x, y and z are relative to the window)
 	unsigned char readCell(int x, int y, int z);
 
 	// Returns the value at a specific position in the array (interpolated)
@@ -65,6 +198,78 @@ public:
 	void setUpdateCoefficient(float value);
 	float getUpdateCoefficient();
 
+	// Set and get how much of each cell is left after a fade() (1, the default, turns fading off)
+	// One fade turns a value into (value * w) >> 8, where w is the persistence * 256 rounded
+	void setPersistence(float value);
+	float getPersistence();
+
+	// Fades the whole volume ticks times, so old data dies out (call it once per frame for live data)
+	// Nothing is multiplied here: each brick remembers the last fade its cells have seen, and
+	// the fades it missed are applied from a table when it is next read, uploaded or written
+	// Reads always give what fading every cell eagerly would have given
+	void fade(int ticks = 1);
+
+	// Turns hole filling on (radius above 0) or off (radius 0, the default)
+	// With it on, draw() shows a display volume where the holes between sparse scanlines are
+	// filled from the cells within radius cells (see HoleFiller). The cells aren't changed, so reads
+	// and copies still see what was written. The display volume takes dim^3 more bytes
+	// Bricks are refilled from their cells and a halo around them when they or their neighbours
+	// change, at most bricksPerFrame of them per draw() spread over the thread pool, so a frame
+	// only pays for a bounded amount of filling and big changes show up over a few frames
+	void setHoleFilling(int radius, int bricksPerFrame = 256);
+	int getHoleFillRadius();
+
+	// Refills up to maxBricks of the bricks waiting for it and returns how many are still waiting
+	// (draw() does this by itself, this is for headless tools that want the display volume now)
+	int fillHoles(int maxBricks);
+
+	// Reads a cell of the display volume (the same as readCell() when hole filling is off)
+	unsigned char readDisplayCell(int x, int y, int z);
+
+	// Smooths the volume in place with the given filter (in window order, so nothing is
+	// smoothed across the seam where the window wraps around the array)
+	// If onlyDirty is true, only the bricks written since the last call to filter() and the
+	// bricks around them that the filter reaches (at least their 26 neighbours) are refiltered
+	void filter(const VolumeFilter& filter, bool onlyDirty = false);
+
+	// Fills target's window with the region between regionMin and regionMax (on [0, 1])
+	// of this map, resampled to the target's dim. Writes still queued for the target are dropped
+	// Returns false (and leaves the target alone) if the target is this map or the region isn't finite
+	bool resample(DensityMap& target, VolumeResampler::Type type = VolumeResampler::Type::Trilinear,
+		glm::vec3 regionMin = glm::vec3(0), glm::vec3 regionMax = glm::vec3(1));
+
+	// Same as above, but writes newDim^3 values to an array
+	// Returns false (and writes nothing) if newDim isn't positive or the region isn't finite
+	bool resample(unsigned char* values, int newDim, VolumeResampler::Type type = VolumeResampler::Type::Trilinear,
+		glm::vec3 regionMin = glm::vec3(0), glm::vec3 regionMax = glm::vec3(1));
+
+	// Saves the window to a file of compressed bricks (see volumeSnapshot.h)
+	// The file is in window order, so it loads the same into a map with any origin
+	bool saveSnapshot(const std::string& path);
+
+	// Loads the region between regionMin and regionMax (on [0, 1] of the window) from a snapshot
+	// saved by a map with the same dim (the rest of the cells are left alone)
+	bool loadSnapshot(const std::string& path, glm::vec3 regionMin = glm::vec3(0), glm::vec3 regionMax = glm::vec3(1));
+
+	// Copies the planes [x0, x1) of the cells as they are stored (dim^2 cells each) to out
+	// and returns the version of the volume they were copied from
+	unsigned long long copyCells(int x0, int x1, unsigned char* out);
+
+	// Copies the bricks changed after sinceVersion as they are stored (brickSize^3 cells each, x-major,
+	// 0 outside the volume) to out, adds their positions to bricks and returns the current version
+	// If originCell isn't nullptr, the window's corner at the time of the copy is written to it (see restoreOrigin())
+	// Only the copy happens with the map locked, so it is cheap to call while data is arriving
+	unsigned long long copyChangedBricks(unsigned long long sinceVersion, std::vector<glm::ivec3>& bricks, std::vector<unsigned char>& out,
+		glm::ivec3* originCell = nullptr);
+
+	// Overwrites whole bricks with brickSize^3 cells each, laid out like copyChangedBricks()
+	// Returns the version of the volume they were written in
+	unsigned long long writeBricks(const glm::ivec3* bricks, int numBricks, const unsigned char* values);
+
+	// The volume is split into bricks of brickSize^3 cells to keep track of changes
+	static const int brickShift = 4;
+	static const int brickSize = 1 << brickShift;
+
 private:
 	// Structs for writing data
 	struct LineWrite {
@@ -75,43 +280,156 @@ private:
 
 		WriteMode writeMode;
 
-		LineWrite(glm::vec3 p1, glm::vec3 p2, std::vector<unsigned char> vals, WriteMode writeMode) {
+		// When writeLine() was called, for the age of the backlog
+		MetricsCounters::Clock::time_point queued;
+
+		LineWrite(glm::vec3 p1, glm::vec3 p2, const unsigned char* vals, int numVals, WriteMode writeMode, MetricsCounters::Clock::time_point queued) {
 			this->p1 = p1;
 			this->p2 = p2;
-			this->vals = vals;
+			this->vals.assign(vals, vals + numVals);
 			this->writeMode = writeMode;
+			this->queued = queued;
 		}
 	};
 
-	struct CellWrite {
-		unsigned int x;
-		unsigned int y;
-		unsigned int z;
+	// Queue for storing line write requests
+	std::queue<LineWrite> lineWriteQueue;
 
-		unsigned char value;
+	// Cell writes waiting for resolveQueues(), keyed by where the cell is stored, so a cell
+	// written many times is only written once with its last value
+	// Open addressing with linear probing in a power of 2 slots, at most half of them full
+	// cellWriteSlots lists the slots in use in the order they were filled, so applying and
+	// emptying the table only costs the number of cells written
+	std::vector<long long int> cellWriteKeys;
+	std::vector<unsigned char> cellWriteValues;
+	std::vector<int> cellWriteSlots;
+
+	// Cell writes sealed off from the table because lines were queued after them
+	// Each batch goes in once the lines queued before it are resolved, in the order they were made
+	struct CellWriteBatch {
+		unsigned long long mark;
+		MetricsCounters::Clock::time_point queued;
+
+		std::vector<long long int> indices;
+		std::vector<unsigned char> values;
+	};
+
+	std::deque<CellWriteBatch> cellWriteBatches;
+	unsigned long long batchedCellWrites;
+
+	// Value of a clear() waiting for resolveQueues() (-1 if there is none)
+	int pendingClear;
+
+	// Lines ever queued and resolved. A write marked with the number of lines queued when it was
+	// made goes in once that many lines have been resolved
+	unsigned long long linesQueued;
+	unsigned long long linesResolved;
+	unsigned long long cellWriteMark;
+	unsigned long long clearMark;
+
+	// When the first of the cell writes in the table and the pending clear were made
+	MetricsCounters::Clock::time_point cellWritesQueued;
+	MetricsCounters::Clock::time_point clearQueued;
+
+	// Budget of the resolveQueues() in draw() (0 for no limit)
+	int resolveBudgetMicroseconds;
+	unsigned long long resolveBudgetVoxels;
 
-		CellWrite(unsigned int x, unsigned int y, unsigned int z, unsigned char value) {
-			this->x = x;
-			this->y = y;
-			this->z = z;
-			this->value = value;
+	// True if nothing is waiting for resolveQueues()
+	bool queuesEmpty() const {
+		return lineWriteQueue.empty() && cellWriteSlots.empty() && cellWriteBatches.empty() && pendingClear < 0;
+	}
+
+	// True if the clear or cell writes waiting first have no lines left to wait for
+	bool cellWritesDue() const {
+		return (pendingClear >= 0 && linesResolved >= clearMark)
+			|| (!cellWriteBatches.empty() && linesResolved >= cellWriteBatches.front().mark)
+			|| (!cellWriteSlots.empty() && linesResolved >= cellWriteMark);
+	}
+
+	// Forgets every queued write and compounded sample (for when every cell is overwritten)
+	void dropQueuedWrites();
+
+	// Gets the table ready for cell writes made after the lines queued so far
+	// (sealing off the writes in it if lines were queued since they were made)
+	void markCellWrites();
+
+	// Moves the writes in the table to a new batch and empties it
+	void sealCellWrites();
+
+	// Records when the oldest write still waiting was made in the metrics
+	void updateBacklog();
+
+	// Adds a cell write to the table, replacing any earlier write to the same cell
+	void queueCellWrite(long long int index, unsigned char value) {
+		if ((cellWriteSlots.size() + 1) * 2 > cellWriteKeys.size()) {
+			growCellWrites();
 		}
-	};
 
-	// Queues for storing write requests
-	std::queue<LineWrite> lineWriteQueue;
-	std::queue<CellWrite> cellWriteQueue;
+		size_t mask = cellWriteKeys.size() - 1;
+		size_t slot = static_cast<size_t>((static_cast<unsigned long long>(index) * 0x9E3779B97F4A7C15ULL) >> 32) & mask;
+
+		while (cellWriteKeys[slot] != index && cellWriteKeys[slot] != -1) {
+			slot = (slot + 1) & mask;
+		}
+
+		if (cellWriteKeys[slot] == -1) {
+			cellWriteKeys[slot] = index;
+			cellWriteSlots.push_back(static_cast<int>(slot));
+		}
+
+		cellWriteValues[slot] = value;
+	}
+
+	// Doubles the number of slots of the cell write table
+	void growCellWrites();
+
+	// Writes the clear and cell writes that are due into the cells, in the order they were made,
+	// and returns the number of cells written
+	// Splats and means still pending are normalized after them, so what they overwrite is settled
+	// here instead: the clear drops them all, and a cell write drops the splats of its cell and
+	// writes the means of its compound row
+	unsigned long long applyDueCellWrites();
+
+	// Gets a cell ready to be overwritten while splats and means are pending (see above)
+	void settleCell(int x, int y, int z);
 
 	// Necessary for thread-safety
 	std::mutex writeMutex;
 	std::mutex readMutex;
 
-	// Pointer to the cells on the graphics card
+	// Runtime counters (updated without taking any locks)
+	MetricsCounters metrics;
+
+	// Where writes are recorded (nullptr if they aren't)
+	JournalRecorder* journal;
+
+	// The cells themselves (a copy is kept on the graphics card)
 	unsigned char* cells;
 	
 	// This should never change after initialization
 	long long int dim;
 
+	// True if the map was created without OpenGL
+	bool headless;
+
+	// Number of bricks along each side of the cube
+	long long int bricksPerSide;
+
+	// World position of the window's corner in cells, and where that corner
+	// is stored in the array (originCell modulo dim)
+	glm::ivec3 originCell;
+	glm::ivec3 wrap;
+
+	// Incremented every time the cells change
+	unsigned long long volumeVersion;
+
+	// The value of volumeVersion when each brick was last changed
+	std::vector<unsigned long long> brickVersions;
+
+	// The value of volumeVersion after the last call to filter()
+	unsigned long long filteredVersion;
+
 	// IDs of buffers on the graphics card
 	unsigned int cellVAO;
 	unsigned int cellDensityTBO;
@@ -120,6 +438,54 @@ private:
 	unsigned int lineVAO;
 	unsigned int lineVBO;
 
+	// Layout of the FrameParameters uniform block (std140)
+	struct FrameParameters {
+		glm::mat4 cellTransform;
+		glm::mat4 lineTransform;
+		int dim;
+		float threshold;
+		float brightness;
+		float contrast;
+		glm::ivec3 wrap;
+		int padding;
+	};
+
+	// Uniform buffer holding the FrameParameters block and the binding point it uses
+	static const unsigned int frameBinding = 0;
+	unsigned int frameUBO;
+
+	// Last contents of the uniform buffer, so unchanged frames aren't uploaded again
+	FrameParameters uploadedFrame;
+	bool frameUploaded;
+
+	// Staging buffers used to copy changed cells to the graphics card
+	std::unique_ptr<UploadRing> uploadRing;
+
+	// Bricks are uploaded in columns (all bricks with the same x and y)
+	// These hold the newest version of each column and the version on the graphics card
+	std::vector<unsigned long long> columnVersions;
+	std::vector<unsigned long long> uploadedVersions;
+
+	// Column where the next upload starts, so no column waits forever
+	int nextUploadColumn;
+
+	// 1 for the columns to upload whatever their version (when the volume being drawn changes)
+	std::vector<unsigned char> staleColumns;
+
+	// Framebuffer holding the last frame drawn when frame caching is on
+	bool frameCaching;
+	bool cacheValid;
+	unsigned int cacheFBO;
+	unsigned int cacheTexture;
+	int cacheWidth;
+	int cacheHeight;
+
+	// What the cached frame was drawn from
+	unsigned long long cachedVolumeVersion;
+	unsigned long long cachedParameterHash;
+
+	unsigned long long skippedFrames;
+
 	// Values that determine how the image is drawn
 	unsigned char threshold;
 	float brightness;
@@ -133,9 +499,195 @@ private:
 	Shader cellShader;
 	Shader lineShader;
 
-	// Resolves all write requests in the queues
-	void resolveQueues();
+	// Trilinear splats waiting to be normalized into the cells, kept in tiles of splatTileSize^2
+	// rows of splatRowSize cells along z (x-major like the cells), so a batch only pays for the
+	// tiles and rows it reached. Scanlines mostly run along z, hence the longer rows
+	static const int splatTileShift = 3;
+	static const int splatTileSize = 1 << splatTileShift;
+	static const int splatRowShift = 4;
+	static const int splatRowSize = 1 << splatRowShift;
+
+	// Once this many tiles (8 KB each) have splats, they are normalized before the next line,
+	// so a big batch keeps its tiles in cache instead of going through memory twice
+	static const int maxSplatTiles = 128;
+
+	struct SplatTile {
+		float weights[splatTileSize * splatTileSize * splatRowSize];
+		float sums[splatTileSize * splatTileSize * splatRowSize];
+
+		// Bit x * splatTileSize + y is set if the row of cells (x, y) has splats
+		unsigned long long rows;
+	};
+
+	// splatTiles[splatTileIndex[tile]] holds the splats of a tile (-1 if it has none)
+	// The first numSplatTiles entries are in use for the tiles in splattedTiles, the rest are
+	// empty ones kept for the next batch
+	std::vector<int> splatTileIndex;
+	std::vector<int> splattedTiles;
+	std::vector<std::unique_ptr<SplatTile>> splatTiles;
+	int numSplatTiles;
+
+	// Number of tiles along x and y, and along z
+	long long int splatTilesPerSide;
+	long long int splatTilesPerRow;
+
+	// Number of fades so far (see fade()), and the fade the cells of each brick are up to date with
+	unsigned long long decayTick;
+	std::vector<unsigned long long> decayStamps;
+
+	// 1 for the bricks that may still have cells above 0 after the fades so far
+	// (only they change when the volume fades)
+	std::vector<unsigned char> decayLive;
+
+	float persistence;
+
+	// decayTable[k * 256 + v] is what v becomes after k fades, for k up to maxDecayTicks
+	// (by then every value is 0, since a fade takes at least 1 off). Empty if the persistence is 1
+	static const int maxDecayTicks = 255;
+	std::vector<unsigned char> decayTable;
+
+	// Number of fades that turn every value into 0
+	int zeroDecayTicks;
+
+	// Reused buffer for uploading faded cells
+	std::vector<unsigned char> decayScratch;
 
-	// Gets the value of a specific cell in the array
+	// Fills the display volume when hole filling is on (nullptr when it is off)
+	std::unique_ptr<HoleFiller> holeFiller;
+	int holeFillBudget;
+
+	// What draw() shows when hole filling is on, laid out like the cells
+	std::vector<unsigned char> displayCells;
+
+	// Incremented every time bricks of the display volume are filled, and its value when each brick was
+	unsigned long long displayVersion;
+	std::vector<unsigned long long> displayVersions;
+
+	// Bricks waiting to be filled in the order they changed (each one once) and the
+	// value of volumeVersion when the changed bricks were last added
+	std::deque<int> holeFillQueue;
+	std::vector<unsigned char> holeFillQueued;
+	unsigned long long holeFillVersion;
+
+	// Running sums of WriteMode::Compound, one per cell (empty until the mode is first used)
+	// Each is the sum of the values in the high bits and the number of samples in the low
+	// compoundCountBits, so adding a sample is one addition. A sum can't overflow before its count,
+	// and counts of compoundHalveCount or more are halved with their sums when they are normalized
+	// (keeping the mean). A count that fills compoundCountMask before then is halved as the next
+	// sample is added, so a cell can take any number of samples per batch
+	static const int compoundCountBits = 12;
+	static const unsigned int compoundCountMask = (1u << compoundCountBits) - 1;
+	static const unsigned int compoundHalveCount = 1u << (compoundCountBits - 1);
+	std::vector<unsigned int> compoundCells;
+
+	// 1 for the bricks with samples that haven't been normalized yet, and the same for the
+	// rows of brickSize cells along z inside them (row (x, y, z >> brickShift) is at
+	// (x * dim + y) * bricksPerSide + (z >> brickShift)), so sparse lines don't normalize whole bricks
+	std::vector<unsigned char> compoundBricks;
+	std::vector<unsigned char> compoundRows;
+
+	// Writes one line into the cells and returns the number of cells written
+	unsigned long long integrateLine(glm::vec3 p1, glm::vec3 p2, const unsigned char* vals, int numVals, WriteMode writeMode);
+
+	// Same as above for WriteMode::Splat (the samples only go into the accumulators)
+	unsigned long long splatLine(glm::vec3 p1, glm::vec3 p2, const unsigned char* vals, int numVals);
+
+	// Adds the splats of the 8 cells from (x, y, z) to (x + 1, y + 1, z + 1) (relative to the window)
+	// to their tiles one by one and returns the number of cells inside the window
+	// (for splats that aren't all in one tile, see splatLine())
+	unsigned long long addSplats(int x, int y, int z, const float* weights, const float* sums);
+
+	// Returns the splats of a tile, taking an empty one if it has none
+	SplatTile& getSplatTile(int x, int y, int z) {
+		int tile = ((x >> splatTileShift) * splatTilesPerSide + (y >> splatTileShift)) * splatTilesPerRow + (z >> splatRowShift);
+		int index = splatTileIndex[tile];
+
+		return index >= 0 ? *splatTiles[index] : addSplatTile(tile);
+	}
+
+	SplatTile& addSplatTile(int tile);
+
+	// Blends the mean of every splatted cell into the cells and empties the tiles
+	void normalizeSplats();
+
+	// Empties the tiles without touching the cells
+	void dropSplats();
+
+	// Same as integrateLine() for WriteMode::Compound (the samples only go into the sums)
+	unsigned long long compoundLine(glm::vec3 p1, glm::vec3 p2, const unsigned char* vals, int numVals);
+
+	// Writes the means of the bricks with new samples into the cells
+	void normalizeCompound();
+
+	// Lock writeMutex and readMutex, counting the time spent waiting in the metrics
+	std::unique_lock<std::mutex> lockWrite();
+	std::unique_lock<std::mutex> lockRead();
+
+	// Copies the cells that changed since the last frame to the graphics card
+	void uploadChanges();
+
+	// Draws the cells and the white lines
+	void render(glm::mat4 projection, glm::mat4 view, glm::mat4 model);
+
+	// Draws into the frame cache if anything changed, then copies it to the screen
+	void drawCached(glm::mat4 projection, glm::mat4 view, glm::mat4 model);
+
+	// (Re)creates the frame cache with a given size
+	void createFrameCache(int width, int height);
+
+	// Gets the value of a specific cell in the array (x, y and z are relative to the window,
+	// and cells outside it are 0)
 	unsigned char getCell(int x, int y, int z);
+
+	// Returns the cells in window order: cells itself if the window starts
+	// at the start of the array, otherwise an unwrapped copy in scratch
+	const unsigned char* getWindowCells(std::vector<unsigned char>& scratch);
+
+	// Sets count neighbouring planes of the array (along axis 0, 1 or 2) to zero
+	// and drops the cell writes still queued for them
+	void clearPlanes(int axis, int first, int count);
+
+	// Records that a cell was changed in the current version of the volume
+	void markCellChanged(int x, int y, int z) {
+		int brick = ((x >> brickShift) * bricksPerSide + (y >> brickShift)) * bricksPerSide + (z >> brickShift);
+		brickVersions[brick] = volumeVersion;
+		decayLive[brick] = 1;
+	}
+
+	// Returns the row of decayTable for the fades a brick missed (nullptr if it has seen them all)
+	const unsigned char* getDecayRow(int brick) {
+		unsigned long long missed = decayTick - decayStamps[brick];
+		return missed == 0 ? nullptr : decayTable.data() + std::min<unsigned long long>(missed, maxDecayTicks) * 256;
+	}
+
+	// Applies the fades a brick missed to its cells in place
+	void catchUpBrick(int brick);
+
+	// Same for every brick (when the whole volume is about to be read or written)
+	void catchUpAllBricks();
+
+	// Brings the brick of a cell up to date before the cell is changed (x, y and z are where it is stored)
+	void catchUpCell(int x, int y, int z) {
+		int brick = ((x >> brickShift) * bricksPerSide + (y >> brickShift)) * bricksPerSide + (z >> brickShift);
+		if (decayStamps[brick] != decayTick) {
+			catchUpBrick(brick);
+		}
+	}
+
+	// Copies the cells of the window in [first, last) from values (a block of size cells at start, x-major)
+	// to where they are stored, catching up on fades and marking the bricks changed on the way
+	void storeWindowCells(glm::ivec3 first, glm::ivec3 last, glm::ivec3 start, glm::ivec3 size, const unsigned char* values);
+
+	// Copies count cells along z from where (x, y, z) is stored to out, with the fades their bricks missed
+	void copyFadedCells(long long int x, long long int y, int z, int count, unsigned char* out);
+
+	// Adds the bricks that changed since the last call to holeFillQueue with their neighbours,
+	// fills up to maxBricks of them and returns how many are still waiting
+	int fillPendingBricks(int maxBricks);
+
+	// Fills one brick of the display volume
+	void fillBrick(int brick);
+
+	// Returns the bricks that changed after a given version
+	std::vector<glm::ivec3> getChangedBricks(unsigned long long sinceVersion);
 };
\ No newline at end of file
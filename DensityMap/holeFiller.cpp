@@ -0,0 +1,155 @@
+#include "holeFiller.h"
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+// Cells above 0 are counted in the low countBits of a sum and their values in the rest,
+// so one running sum does for both (a box of (2 * maxRadius + 1)^3 cells fits easily)
+static const int countBits = 20;
+static const unsigned long long countMask = (1ULL << countBits) - 1;
+
+// Scratch space for each thread, so the sums of a block are never allocated
+static thread_local std::vector<unsigned long long> sumsZ;
+static thread_local std::vector<unsigned long long> sumsY;
+static thread_local std::vector<unsigned long long> prefix;
+static thread_local std::vector<unsigned long long> rows;
+static thread_local std::vector<unsigned long long> planes;
+
+HoleFiller::HoleFiller(int radius) {
+	this->radius = radius < 1 ? 1 : (radius > maxRadius ? maxRadius : radius);
+}
+
+int HoleFiller::getRadius() const {
+	return radius;
+}
+
+void HoleFiller::fillBlock(const unsigned char* cells, glm::ivec3 size, const int* const runs[3], unsigned char* out) const {
+	int r = radius;
+	glm::ivec3 n = size + 2 * r;
+
+	// Nothing to fill, or nothing to fill with
+	unsigned char data = 0;
+	for (int i = 0; i < n.x * n.y * n.z; i++) {
+		data |= cells[i];
+	}
+
+	bool holes = false;
+	for (int x = r; x < r + size.x && !holes; x++) {
+		for (int y = r; y < r + size.y && !holes; y++) {
+			holes = std::memchr(cells + (x * n.y + y) * n.z + r, 0, size.z) != nullptr;
+		}
+	}
+
+	if (!holes || data == 0) {
+		for (int x = 0; x < size.x; x++) {
+			for (int y = 0; y < size.y; y++) {
+				std::memcpy(out + (x * size.y + y) * size.z, cells + ((x + r) * n.y + y + r) * n.z + r, size.z);
+			}
+		}
+
+		return;
+	}
+
+	// Slices [first, last] that are summed for each output slice along each axis
+	std::vector<int> first[3], last[3];
+
+	for (int axis = 0; axis < 3; axis++) {
+		const int* run = runs[axis];
+		std::vector<int> runStart(n[axis]), runEnd(n[axis]);
+
+		for (int i = 0; i < n[axis]; i++) {
+			runStart[i] = i > 0 && run[i] == run[i - 1] ? runStart[i - 1] : i;
+		}
+
+		for (int i = n[axis] - 1; i >= 0; i--) {
+			runEnd[i] = i < n[axis] - 1 && run[i] == run[i + 1] ? runEnd[i + 1] : i;
+		}
+
+		for (int o = 0; o < size[axis]; o++) {
+			first[axis].push_back(std::max(o, runStart[o + r]));
+			last[axis].push_back(std::min(o + 2 * r, runEnd[o + r]));
+		}
+	}
+
+	// The scratch buffers are only looked up once, thread_local access isn't free
+	int plane = size.y * size.z;
+	sumsZ.resize(size_t(n.x) * n.y * size.z);
+	sumsY.resize(size_t(n.x) * plane);
+	prefix.resize(n.z + 1);
+	rows.resize(size_t(n.y + 1) * size.z);
+	planes.resize(size_t(n.x + 1) * plane);
+
+	unsigned long long* zSums = sumsZ.data();
+	unsigned long long* ySums = sumsY.data();
+	unsigned long long* zPrefix = prefix.data();
+	unsigned long long* yPrefix = rows.data();
+	unsigned long long* xPrefix = planes.data();
+
+	// Along z, for every row of the block
+	for (int x = 0; x < n.x; x++) {
+		for (int y = 0; y < n.y; y++) {
+			const unsigned char* row = cells + (x * n.y + y) * n.z;
+
+			zPrefix[0] = 0;
+			for (int z = 0; z < n.z; z++) {
+				zPrefix[z + 1] = zPrefix[z] + ((static_cast<unsigned long long>(row[z]) << countBits) | (row[z] != 0));
+			}
+
+			unsigned long long* sums = zSums + (x * n.y + y) * size.z;
+			for (int z = 0; z < size.z; z++) {
+				sums[z] = zPrefix[last[2][z] + 1] - zPrefix[first[2][z]];
+			}
+		}
+	}
+
+	// Along y, a row of size.z sums at a time
+	for (int x = 0; x < n.x; x++) {
+		std::fill(yPrefix, yPrefix + size.z, 0);
+		for (int y = 0; y < n.y; y++) {
+			const unsigned long long* sums = zSums + (x * n.y + y) * size.z;
+			for (int z = 0; z < size.z; z++) {
+				yPrefix[(y + 1) * size.z + z] = yPrefix[y * size.z + z] + sums[z];
+			}
+		}
+
+		for (int y = 0; y < size.y; y++) {
+			unsigned long long* sums = ySums + (x * size.y + y) * size.z;
+			const unsigned long long* lastRow = yPrefix + (last[1][y] + 1) * size.z;
+			const unsigned long long* firstRow = yPrefix + first[1][y] * size.z;
+
+			for (int z = 0; z < size.z; z++) {
+				sums[z] = lastRow[z] - firstRow[z];
+			}
+		}
+	}
+
+	// Along x, a plane of size.y * size.z sums at a time, then the holes are filled with the means
+	std::fill(xPrefix, xPrefix + plane, 0);
+	for (int x = 0; x < n.x; x++) {
+		for (int i = 0; i < plane; i++) {
+			xPrefix[(x + 1) * plane + i] = xPrefix[x * plane + i] + ySums[x * plane + i];
+		}
+	}
+
+	for (int x = 0; x < size.x; x++) {
+		const unsigned long long* lastPlane = xPrefix + (last[0][x] + 1) * plane;
+		const unsigned long long* firstPlane = xPrefix + first[0][x] * plane;
+
+		for (int y = 0; y < size.y; y++) {
+			const unsigned char* row = cells + ((x + r) * n.y + y + r) * n.z + r;
+			unsigned char* outRow = out + (x * size.y + y) * size.z;
+
+			// Without branches, so the divisions go in parallel. A double division is much faster
+			// than an integer one and exact enough to round the same way (the sums are far below 2^52)
+			// Holes with nothing around them have a sum of 0
+			for (int z = 0; z < size.z; z++) {
+				unsigned long long sum = lastPlane[y * size.z + z] - firstPlane[y * size.z + z];
+				int count = static_cast<int>(sum & countMask);
+
+				int mean = static_cast<int>((double(sum >> countBits) + count / 2) / std::max(count, 1));
+				outRow[z] = static_cast<unsigned char>(row[z] != 0 ? row[z] : mean);
+			}
+		}
+	}
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <glm/glm.hpp>
+
+// Fills the holes that sparse sweeps leave between scanlines
+// Every cell that is 0 takes the mean of the cells above 0 within radius cells of it
+// along each axis (a normalized box convolution). Cells above 0 are never changed,
+// and holes with nothing around them stay 0
+// Works on one block of cells at a time, so the caller decides how much to fill and when
+class HoleFiller {
+public:
+	// Largest radius allowed (a brick is refilled when its direct neighbours
+	// change, so the radius can't exceed the brick size)
+	static const int maxRadius = 16;
+
+	// Constructor (the radius is clamped to [1, maxRadius])
+	HoleFiller(int radius);
+
+	// Fills a block of size cells and writes it to out (size cells, x-major)
+	// cells holds the block and radius cells around it on every side (size + 2 * radius cells, x-major)
+	// Along each axis, runs[axis][i] numbers the stretch of neighbouring cells that slice i of cells
+	// is part of. Slices of different stretches (on either side of the edge of the volume or of
+	// the seam of a scrolled window) are never used to fill each other
+	void fillBlock(const unsigned char* cells, glm::ivec3 size, const int* const runs[3], unsigned char* out) const;
+
+	int getRadius() const;
+
+private:
+	int radius;
+};
@@ -0,0 +1,568 @@
+#include "ingestServer.h"
+
+#ifdef DENSITYMAP_HAS_INGEST_SERVER
+
+#include <cerrno>
+#include <cstring>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using IngestProtocol::FrameHeader;
+using SharedMemoryRing::ScanlineRecord;
+
+namespace {
+	const int maxEvents = 64;
+
+	// At most this many idle buffers are kept
+	const size_t maxPooledBuffers = 32;
+
+	uint64_t recordSize(uint32_t numSamples) {
+		return (sizeof(ScanlineRecord) + numSamples + 7) & ~uint64_t(7);
+	}
+}
+
+IngestServer::IngestServer(DensityMap& map) : map(map) {
+	epollFd = epoll_create1(EPOLL_CLOEXEC);
+	stopFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	unixFd = -1;
+	tcpFd = -1;
+	tcpPort = 0;
+
+	running = false;
+
+	numConnections = 0;
+	numFrames = 0;
+	numLines = 0;
+	numBytes = 0;
+	numRejected = 0;
+
+	epoll_event event = {};
+	event.events = EPOLLIN;
+	event.data.fd = stopFd;
+	epoll_ctl(epollFd, EPOLL_CTL_ADD, stopFd, &event);
+}
+
+IngestServer::~IngestServer() {
+	stop();
+
+	for (auto& connection : connections) {
+		::close(connection.first);
+	}
+
+	if (unixFd >= 0) {
+		::close(unixFd);
+		unlink(unixPath.c_str());
+	}
+
+	if (tcpFd >= 0) {
+		::close(tcpFd);
+	}
+
+	::close(stopFd);
+	::close(epollFd);
+}
+
+bool IngestServer::listenUnix(const std::string& path) {
+	sockaddr_un address = {};
+	address.sun_family = AF_UNIX;
+
+	if (unixFd >= 0 || path.size() >= sizeof(address.sun_path)) {
+		return false;
+	}
+
+	std::strcpy(address.sun_path, path.c_str());
+	unlink(path.c_str());
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		return false;
+	}
+
+	if (bind(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || listen(fd, 16) != 0 || !addListener(fd)) {
+		::close(fd);
+		return false;
+	}
+
+	unixFd = fd;
+	unixPath = path;
+
+	return true;
+}
+
+bool IngestServer::listenTcp(int port) {
+	if (tcpFd >= 0) {
+		return false;
+	}
+
+	int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		return false;
+	}
+
+	int reuse = 1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+	// Only local tools may connect
+	sockaddr_in address = {};
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	address.sin_port = htons(port);
+
+	if (bind(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || listen(fd, 16) != 0 || !addListener(fd)) {
+		::close(fd);
+		return false;
+	}
+
+	socklen_t length = sizeof(address);
+	getsockname(fd, reinterpret_cast<sockaddr*>(&address), &length);
+
+	tcpFd = fd;
+	tcpPort = ntohs(address.sin_port);
+
+	return true;
+}
+
+int IngestServer::getTcpPort() {
+	return tcpPort;
+}
+
+bool IngestServer::start() {
+	if (running || epollFd < 0 || stopFd < 0) {
+		return false;
+	}
+
+	running = true;
+	thread = std::thread(&IngestServer::run, this);
+
+	return true;
+}
+
+void IngestServer::stop() {
+	if (!running) {
+		return;
+	}
+
+	running = false;
+
+	uint64_t one = 1;
+	if (write(stopFd, &one, sizeof(one)) < 0) {
+		// The eventfd can't overflow with one write, so this never happens
+	}
+
+	thread.join();
+}
+
+IngestServer::Stats IngestServer::getStats() {
+	Stats stats;
+	stats.connections = numConnections.load(std::memory_order_relaxed);
+	stats.frames = numFrames.load(std::memory_order_relaxed);
+	stats.lines = numLines.load(std::memory_order_relaxed);
+	stats.bytes = numBytes.load(std::memory_order_relaxed);
+	stats.rejectedFrames = numRejected.load(std::memory_order_relaxed);
+
+	return stats;
+}
+
+void IngestServer::run() {
+	epoll_event events[maxEvents];
+
+	while (running) {
+		int numEvents = epoll_wait(epollFd, events, maxEvents, -1);
+
+		if (numEvents < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			break;
+		}
+
+		for (int i = 0; i < numEvents; i++) {
+			int fd = events[i].data.fd;
+
+			// Emptied, so a later start() doesn't wake up for it again and again
+			if (fd == stopFd) {
+				uint64_t count;
+				if (read(stopFd, &count, sizeof(count)) < 0) {
+					// Already empty (it is non-blocking)
+				}
+
+				continue;
+			}
+
+			if (fd == unixFd || fd == tcpFd) {
+				acceptConnections(fd);
+				continue;
+			}
+
+			auto found = connections.find(fd);
+			if (found == connections.end()) {
+				continue;
+			}
+
+			if (!receive(*found->second) || (events[i].events & (EPOLLHUP | EPOLLERR))) {
+				closeConnection(fd);
+			}
+		}
+
+		// Everything that arrived during this wakeup goes into the map at once
+		integrateReadyFrames();
+	}
+}
+
+void IngestServer::acceptConnections(int listenFd) {
+	while (true) {
+		int fd = accept4(listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0) {
+			return;
+		}
+
+		// A large receive buffer lets each read pick up more at once
+		int bufferSize = 4 << 20;
+		setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &bufferSize, sizeof(bufferSize));
+
+		epoll_event event = {};
+		event.events = EPOLLIN | EPOLLRDHUP;
+		event.data.fd = fd;
+
+		if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) != 0) {
+			::close(fd);
+			continue;
+		}
+
+		std::unique_ptr<Connection> connection(new Connection());
+		connection->fd = fd;
+		connection->headerFilled = 0;
+		connection->payloadFilled = 0;
+
+		connections[fd] = std::move(connection);
+		numConnections.fetch_add(1, std::memory_order_relaxed);
+	}
+}
+
+void IngestServer::closeConnection(int fd) {
+	auto found = connections.find(fd);
+
+	if (found != connections.end()) {
+		if (found->second->payload) {
+			returnBuffer(std::move(found->second->payload));
+		}
+
+		connections.erase(found);
+	}
+
+	epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, nullptr);
+	::close(fd);
+}
+
+bool IngestServer::receive(Connection& connection) {
+	while (true) {
+		iovec parts[2];
+		int numParts;
+
+		unsigned char* header = reinterpret_cast<unsigned char*>(&connection.header);
+
+		if (!connection.payload) {
+			parts[0].iov_base = header + connection.headerFilled;
+			parts[0].iov_len = sizeof(FrameHeader) - connection.headerFilled;
+			numParts = 1;
+		}
+		else {
+			// The rest of the payload and the next header in one read
+			parts[0].iov_base = connection.payload->data() + connection.payloadFilled;
+			parts[0].iov_len = connection.header.payloadSize - connection.payloadFilled;
+			parts[1].iov_base = &connection.nextHeader;
+			parts[1].iov_len = sizeof(FrameHeader);
+			numParts = 2;
+		}
+
+		ssize_t received = readv(connection.fd, parts, numParts);
+
+		if (received == 0) {
+			return false;
+		}
+
+		if (received < 0) {
+			return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+		}
+
+		numBytes.fetch_add(received, std::memory_order_relaxed);
+
+		if (!connection.payload) {
+			connection.headerFilled += received;
+
+			if (connection.headerFilled == sizeof(FrameHeader) && !startPayload(connection)) {
+				return false;
+			}
+
+			continue;
+		}
+
+		size_t payloadLeft = connection.header.payloadSize - connection.payloadFilled;
+
+		if (static_cast<size_t>(received) < payloadLeft) {
+			connection.payloadFilled += received;
+			continue;
+		}
+
+		// The frame is complete, and a connection that sent records that don't match its header is closed
+		if (!addLines(*connection.payload, connection.header.numLines)) {
+			numRejected.fetch_add(1, std::memory_order_relaxed);
+			return false;
+		}
+
+		ReadyFrame frame;
+		frame.payload = std::move(connection.payload);
+		frame.numLines = connection.header.numLines;
+		readyFrames.push_back(std::move(frame));
+
+		connection.payloadFilled = 0;
+		connection.header = connection.nextHeader;
+		connection.headerFilled = received - payloadLeft;
+
+		if (connection.headerFilled == sizeof(FrameHeader) && !startPayload(connection)) {
+			return false;
+		}
+	}
+}
+
+bool IngestServer::startPayload(Connection& connection) {
+	const FrameHeader& header = connection.header;
+
+	if (std::memcmp(header.magic, IngestProtocol::magic, sizeof(header.magic)) != 0 || header.payloadSize > IngestProtocol::maxPayloadSize ||
+		header.numLines > header.payloadSize / sizeof(ScanlineRecord)) {
+		numRejected.fetch_add(1, std::memory_order_relaxed);
+		return false;
+	}
+
+	connection.payload = takeBuffer(header.payloadSize);
+	connection.payloadFilled = 0;
+
+	// An empty frame is complete straight away
+	if (header.payloadSize == 0) {
+		returnBuffer(std::move(connection.payload));
+		connection.headerFilled = 0;
+	}
+
+	return true;
+}
+
+bool IngestServer::addLines(const Buffer& payload, uint32_t numLines) {
+	const unsigned char* data = payload.data();
+	size_t size = payload.size();
+	size_t offset = 0;
+
+	size_t firstView = views.size();
+
+	for (uint32_t l = 0; l < numLines; l++) {
+		if (offset + sizeof(ScanlineRecord) > size) {
+			views.resize(firstView);
+			return false;
+		}
+
+		ScanlineRecord record;
+		std::memcpy(&record, data + offset, sizeof(record));
+
+		if (offset + recordSize(record.numSamples) > size || record.writeMode > SharedMemoryRing::maxWriteMode) {
+			views.resize(firstView);
+			return false;
+		}
+
+		DensityMap::ScanlineView view;
+		view.p1 = glm::vec3(record.p1[0], record.p1[1], record.p1[2]);
+		view.p2 = glm::vec3(record.p2[0], record.p2[1], record.p2[2]);
+		view.samples = data + offset + sizeof(ScanlineRecord);
+		view.numSamples = record.numSamples;
+		view.writeMode = static_cast<DensityMap::WriteMode>(record.writeMode);
+		views.push_back(view);
+
+		offset += recordSize(record.numSamples);
+	}
+
+	return true;
+}
+
+void IngestServer::integrateReadyFrames() {
+	if (readyFrames.empty()) {
+		return;
+	}
+
+	for (ReadyFrame& frame : readyFrames) {
+		numFrames.fetch_add(1, std::memory_order_relaxed);
+		numLines.fetch_add(frame.numLines, std::memory_order_relaxed);
+	}
+
+	map.integrateLines(views.data(), views.size());
+
+	for (ReadyFrame& frame : readyFrames) {
+		returnBuffer(std::move(frame.payload));
+	}
+
+	readyFrames.clear();
+	views.clear();
+}
+
+std::unique_ptr<IngestServer::Buffer> IngestServer::takeBuffer(size_t size) {
+	std::unique_ptr<Buffer> buffer;
+
+	if (bufferPool.empty()) {
+		buffer.reset(new Buffer());
+	}
+	else {
+		buffer = std::move(bufferPool.back());
+		bufferPool.pop_back();
+	}
+
+	buffer->resize(size);
+
+	return buffer;
+}
+
+void IngestServer::returnBuffer(std::unique_ptr<Buffer> buffer) {
+	if (bufferPool.size() < maxPooledBuffers) {
+		bufferPool.push_back(std::move(buffer));
+	}
+}
+
+bool IngestServer::addListener(int fd) {
+	epoll_event event = {};
+	event.events = EPOLLIN;
+	event.data.fd = fd;
+
+	return epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) == 0;
+}
+
+IngestClient::IngestClient() {
+	fd = -1;
+	numLines = 0;
+}
+
+IngestClient::~IngestClient() {
+	close();
+}
+
+bool IngestClient::connectUnix(const std::string& path) {
+	sockaddr_un address = {};
+	address.sun_family = AF_UNIX;
+
+	if (path.size() >= sizeof(address.sun_path)) {
+		return false;
+	}
+
+	std::strcpy(address.sun_path, path.c_str());
+
+	close();
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+	if (fd < 0 || connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+		close();
+		return false;
+	}
+
+	return true;
+}
+
+bool IngestClient::connectTcp(int port) {
+	sockaddr_in address = {};
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	address.sin_port = htons(port);
+
+	close();
+	fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+	if (fd < 0 || connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+		close();
+		return false;
+	}
+
+	return true;
+}
+
+void IngestClient::addLine(glm::vec3 p1, glm::vec3 p2, const unsigned char* samples, int numSamples, DensityMap::WriteMode writeMode) {
+	ScanlineRecord record = {};
+	record.numSamples = numSamples;
+	record.writeMode = static_cast<uint8_t>(writeMode);
+	record.p1[0] = p1.x;
+	record.p1[1] = p1.y;
+	record.p1[2] = p1.z;
+	record.p2[0] = p2.x;
+	record.p2[1] = p2.y;
+	record.p2[2] = p2.z;
+
+	size_t offset = payload.size();
+	payload.resize(offset + recordSize(numSamples), 0);
+
+	std::memcpy(payload.data() + offset, &record, sizeof(record));
+	std::memcpy(payload.data() + offset + sizeof(record), samples, numSamples);
+
+	numLines++;
+}
+
+bool IngestClient::send() {
+	if (fd < 0) {
+		return false;
+	}
+
+	FrameHeader header;
+	std::memcpy(header.magic, IngestProtocol::magic, sizeof(header.magic));
+	header.numLines = numLines;
+	header.payloadSize = payload.size();
+
+	size_t total = sizeof(header) + payload.size();
+	size_t sent = 0;
+
+	while (sent < total) {
+		iovec parts[2];
+		int numParts = 0;
+
+		if (sent < sizeof(header)) {
+			parts[numParts].iov_base = reinterpret_cast<unsigned char*>(&header) + sent;
+			parts[numParts].iov_len = sizeof(header) - sent;
+			numParts++;
+		}
+
+		size_t payloadSent = sent > sizeof(header) ? sent - sizeof(header) : 0;
+		parts[numParts].iov_base = payload.data() + payloadSent;
+		parts[numParts].iov_len = payload.size() - payloadSent;
+		numParts++;
+
+		msghdr message = {};
+		message.msg_iov = parts;
+		message.msg_iovlen = numParts;
+
+		// A server that went away makes this fail instead of raising SIGPIPE
+		ssize_t written = sendmsg(fd, &message, MSG_NOSIGNAL);
+
+		if (written < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			return false;
+		}
+
+		sent += written;
+	}
+
+	payload.clear();
+	numLines = 0;
+
+	return true;
+}
+
+void IngestClient::close() {
+	if (fd >= 0) {
+		::close(fd);
+		fd = -1;
+	}
+}
+
+#endif
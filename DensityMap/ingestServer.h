@@ -0,0 +1,176 @@
+#pragma once
+
+#if defined(__linux__)
+#define DENSITYMAP_HAS_INGEST_SERVER
+
+#include <glm/glm.hpp>
+
+#include "densityMap.h"
+#include "sharedMemoryRing.h"
+
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Receives batches of scanlines over a Unix domain socket or TCP on localhost
+// and integrates them into a DensityMap, so several tools can feed one live volume
+//
+// Every batch is a FrameHeader followed by payloadSize bytes of records in the
+// same layout as the shared memory ring (SharedMemoryRing::ScanlineRecord, then
+// the samples, padded to a multiple of 8 bytes)
+// A connection that sends anything malformed (a bad header, or records that run past the
+// payload or have an unknown write mode) is closed, and the frame it was sending is dropped
+namespace IngestProtocol {
+	struct FrameHeader {
+		char magic[4];
+		uint32_t numLines;
+		uint64_t payloadSize;
+	};
+
+	static const char magic[4] = { 'D', 'M', 'S', 'F' };
+
+	// Largest payload accepted in one frame
+	static const uint64_t maxPayloadSize = 64 << 20;
+}
+
+// Runs an epoll loop on its own thread
+class IngestServer {
+public:
+	struct Stats {
+		unsigned long long connections;
+		unsigned long long frames;
+		unsigned long long lines;
+		unsigned long long bytes;
+		unsigned long long rejectedFrames;
+	};
+
+	// Constructor (map must outlive the server)
+	IngestServer(DensityMap& map);
+
+	// Destructor (stops the server and closes every connection)
+	~IngestServer();
+
+	IngestServer(const IngestServer&) = delete;
+	IngestServer& operator=(const IngestServer&) = delete;
+
+	// Listens on a Unix domain socket at path (replacing any old socket file)
+	bool listenUnix(const std::string& path);
+
+	// Listens on TCP port on 127.0.0.1 (0 picks a free port, see getTcpPort())
+	bool listenTcp(int port);
+	int getTcpPort();
+
+	// Starts and stops the thread that receives the data
+	bool start();
+	void stop();
+
+	Stats getStats();
+
+private:
+	// Receive buffer for one frame's payload
+	typedef std::vector<unsigned char> Buffer;
+
+	struct Connection {
+		int fd;
+
+		// Header being read (headerFilled bytes of it so far)
+		IngestProtocol::FrameHeader header;
+		size_t headerFilled;
+
+		// Payload being read
+		std::unique_ptr<Buffer> payload;
+		size_t payloadFilled;
+
+		// Filled by the same read as the end of the payload
+		IngestProtocol::FrameHeader nextHeader;
+	};
+
+	// Complete frames waiting to be integrated (their lines are already in views)
+	struct ReadyFrame {
+		std::unique_ptr<Buffer> payload;
+		uint32_t numLines;
+	};
+
+	DensityMap& map;
+
+	int epollFd;
+	int stopFd;
+	int unixFd;
+	int tcpFd;
+	int tcpPort;
+	std::string unixPath;
+
+	std::thread thread;
+	std::atomic<bool> running;
+
+	std::map<int, std::unique_ptr<Connection>> connections;
+
+	// Buffers that can be used again, so steady streams don't allocate
+	std::vector<std::unique_ptr<Buffer>> bufferPool;
+
+	std::vector<ReadyFrame> readyFrames;
+	std::vector<DensityMap::ScanlineView> views;
+
+	std::atomic<unsigned long long> numConnections;
+	std::atomic<unsigned long long> numFrames;
+	std::atomic<unsigned long long> numLines;
+	std::atomic<unsigned long long> numBytes;
+	std::atomic<unsigned long long> numRejected;
+
+	void run();
+
+	void acceptConnections(int listenFd);
+	void closeConnection(int fd);
+
+	// Reads everything available on a connection (returns false if it was closed)
+	bool receive(Connection& connection);
+
+	// Called once a header is complete (returns false if it is malformed)
+	bool startPayload(Connection& connection);
+
+	// Adds the lines of a complete payload to views
+	// Returns false (adding nothing) if the records don't match the header
+	bool addLines(const Buffer& payload, uint32_t numLines);
+
+	// Writes every ready frame to the map in one integrateLines() call
+	void integrateReadyFrames();
+
+	std::unique_ptr<Buffer> takeBuffer(size_t size);
+	void returnBuffer(std::unique_ptr<Buffer> buffer);
+
+	bool addListener(int fd);
+};
+
+// Sends batches of scanlines to an IngestServer
+class IngestClient {
+public:
+	IngestClient();
+	~IngestClient();
+
+	IngestClient(const IngestClient&) = delete;
+	IngestClient& operator=(const IngestClient&) = delete;
+
+	bool connectUnix(const std::string& path);
+	bool connectTcp(int port);
+
+	// Adds a line to the current batch
+	void addLine(glm::vec3 p1, glm::vec3 p2, const unsigned char* samples, int numSamples, DensityMap::WriteMode writeMode);
+
+	// Sends the current batch (blocks until it is written)
+	// Returns false if the connection is gone (without raising SIGPIPE)
+	bool send();
+
+	void close();
+
+private:
+	int fd;
+
+	std::vector<unsigned char> payload;
+	uint32_t numLines;
+};
+
+#endif
@@ -0,0 +1,415 @@
+#include "journal.h"
+
+#include <cstring>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace {
+	const size_t fileHeaderSize = 8;
+	const size_t linePayloadSize = 6 * sizeof(float);
+	const size_t cellPayloadSize = 3 * sizeof(uint32_t) + 1;
+	const size_t blockPayloadSize = 6 * sizeof(int32_t);
+	const size_t originPayloadSize = 3 * sizeof(int32_t);
+
+	size_t padded(size_t size) {
+		return (size + 7) & ~size_t(7);
+	}
+}
+
+JournalRecorder::JournalRecorder(const std::string& path) {
+	stopping = false;
+	bytesRecorded = 0;
+	start = Clock::now();
+
+	file = std::fopen(path.c_str(), "wb");
+	if (file == nullptr) {
+		return;
+	}
+
+	std::fwrite(Journal::magic, 1, sizeof(Journal::magic), file);
+	std::fwrite(&Journal::version, sizeof(Journal::version), 1, file);
+	bytesRecorded = fileHeaderSize;
+
+	buffer.reserve(2 * flushSize);
+	writing.reserve(2 * flushSize);
+
+	writer = std::thread(&JournalRecorder::writeLoop, this);
+}
+
+JournalRecorder::~JournalRecorder() {
+	close();
+}
+
+bool JournalRecorder::isOpen() {
+	return file != nullptr;
+}
+
+void JournalRecorder::recordLine(glm::vec3 p1, glm::vec3 p2, const unsigned char* samples, int numSamples, DensityMap::WriteMode writeMode) {
+	Journal::RecordHeader header = { Journal::Line, static_cast<uint8_t>(writeMode), 0, static_cast<uint32_t>(numSamples), 0 };
+	float points[6] = { p1.x, p1.y, p1.z, p2.x, p2.y, p2.z };
+
+	std::lock_guard<std::mutex> lock(bufferMutex);
+	header.time = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+	append(header, points, sizeof(points), samples, numSamples);
+}
+
+void JournalRecorder::recordCell(unsigned int x, unsigned int y, unsigned int z, unsigned char value) {
+	Journal::RecordHeader header = { Journal::Cell, 0, 0, 0, 0 };
+
+	unsigned char payload[cellPayloadSize];
+	uint32_t coordinates[3] = { x, y, z };
+	std::memcpy(payload, coordinates, sizeof(coordinates));
+	payload[sizeof(coordinates)] = value;
+
+	std::lock_guard<std::mutex> lock(bufferMutex);
+	header.time = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+	append(header, payload, sizeof(payload), nullptr, 0);
+}
+
+void JournalRecorder::recordClear(unsigned char value) {
+	Journal::RecordHeader header = { Journal::Clear, value, 0, 0, 0 };
+
+	std::lock_guard<std::mutex> lock(bufferMutex);
+	header.time = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+	append(header, nullptr, 0, nullptr, 0);
+}
+
+void JournalRecorder::recordBlock(glm::ivec3 blockStart, glm::ivec3 size, const unsigned char* values) {
+	size_t numValues = size_t(size.x) * size.y * size.z;
+	Journal::RecordHeader header = { Journal::Block, 0, 0, static_cast<uint32_t>(numValues), 0 };
+	int32_t region[6] = { blockStart.x, blockStart.y, blockStart.z, size.x, size.y, size.z };
+
+	std::lock_guard<std::mutex> lock(bufferMutex);
+	header.time = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+	append(header, region, sizeof(region), values, numValues);
+}
+
+void JournalRecorder::recordOrigin(glm::ivec3 originCell) {
+	Journal::RecordHeader header = { Journal::Origin, 0, 0, 0, 0 };
+	int32_t origin[3] = { originCell.x, originCell.y, originCell.z };
+
+	std::lock_guard<std::mutex> lock(bufferMutex);
+	header.time = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+	append(header, origin, sizeof(origin), nullptr, 0);
+}
+
+void JournalRecorder::close() {
+	if (file == nullptr) {
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(bufferMutex);
+		stopping = true;
+	}
+
+	bufferReady.notify_one();
+	writer.join();
+
+	std::fclose(file);
+	file = nullptr;
+}
+
+unsigned long long JournalRecorder::getBytesRecorded() {
+	std::lock_guard<std::mutex> lock(bufferMutex);
+	return bytesRecorded;
+}
+
+void JournalRecorder::append(const Journal::RecordHeader& header, const void* payload, size_t payloadSize, const void* extra, size_t extraSize) {
+	if (file == nullptr || stopping) {
+		return;
+	}
+
+	size_t unpadded = sizeof(header) + payloadSize + extraSize;
+	size_t offset = buffer.size();
+
+	// Padding bytes are zero
+	buffer.resize(offset + padded(unpadded), 0);
+
+	unsigned char* record = buffer.data() + offset;
+	std::memcpy(record, &header, sizeof(header));
+	if (payloadSize > 0) {
+		std::memcpy(record + sizeof(header), payload, payloadSize);
+	}
+	if (extraSize > 0) {
+		std::memcpy(record + sizeof(header) + payloadSize, extra, extraSize);
+	}
+
+	bytesRecorded += padded(unpadded);
+
+	if (buffer.size() >= flushSize) {
+		bufferReady.notify_one();
+	}
+}
+
+void JournalRecorder::writeLoop() {
+	std::unique_lock<std::mutex> lock(bufferMutex);
+
+	while (true) {
+		bufferReady.wait_for(lock, std::chrono::milliseconds(100), [this] { return stopping || buffer.size() >= flushSize; });
+
+		if (buffer.empty()) {
+			if (stopping) {
+				break;
+			}
+
+			continue;
+		}
+
+		// The recording threads carry on with the other buffer while this one is written
+		writing.swap(buffer);
+		lock.unlock();
+
+		std::fwrite(writing.data(), 1, writing.size(), file);
+		std::fflush(file);
+		writing.clear();
+
+		lock.lock();
+	}
+}
+
+JournalReplayer::JournalReplayer(const std::string& path) {
+	data = nullptr;
+	mappedSize = 0;
+	size = 0;
+	valid = false;
+	position = fileHeaderSize;
+	numRecords = 0;
+	lastTime = 0;
+
+#ifdef _WIN32
+	fileHandle = INVALID_HANDLE_VALUE;
+	mappingHandle = NULL;
+
+	fileHandle = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (fileHandle == INVALID_HANDLE_VALUE) {
+		return;
+	}
+
+	LARGE_INTEGER fileSize;
+	if (!GetFileSizeEx(fileHandle, &fileSize) || fileSize.QuadPart < (LONGLONG)fileHeaderSize) {
+		return;
+	}
+
+	mappingHandle = CreateFileMappingA(fileHandle, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (mappingHandle == NULL) {
+		return;
+	}
+
+	data = static_cast<const unsigned char*>(MapViewOfFile(mappingHandle, FILE_MAP_READ, 0, 0, 0));
+	if (data == nullptr) {
+		return;
+	}
+
+	mappedSize = static_cast<size_t>(fileSize.QuadPart);
+#else
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0) {
+		return;
+	}
+
+	struct stat info;
+	if (fstat(fd, &info) != 0 || info.st_size < (off_t)fileHeaderSize) {
+		::close(fd);
+		return;
+	}
+
+	void* mapping = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	::close(fd);
+
+	if (mapping == MAP_FAILED) {
+		return;
+	}
+
+	madvise(mapping, info.st_size, MADV_SEQUENTIAL);
+
+	data = static_cast<const unsigned char*>(mapping);
+	mappedSize = info.st_size;
+#endif
+
+	uint32_t fileVersion;
+	std::memcpy(&fileVersion, data + sizeof(Journal::magic), sizeof(fileVersion));
+
+	if (std::memcmp(data, Journal::magic, sizeof(Journal::magic)) != 0 || fileVersion != Journal::version) {
+		return;
+	}
+
+	valid = true;
+	size = mappedSize;
+
+	// Counting the records (a record cut off by a crash ends the journal)
+	size_t offset = fileHeaderSize;
+	while (size_t length = recordSize(offset)) {
+		lastTime = headerAt(offset).time;
+		numRecords++;
+		offset += length;
+	}
+
+	size = offset;
+}
+
+JournalReplayer::~JournalReplayer() {
+#ifdef _WIN32
+	if (data != nullptr) {
+		UnmapViewOfFile(data);
+	}
+	if (mappingHandle != NULL) {
+		CloseHandle(mappingHandle);
+	}
+	if (fileHandle != INVALID_HANDLE_VALUE) {
+		CloseHandle(fileHandle);
+	}
+#else
+	if (data != nullptr) {
+		munmap(const_cast<unsigned char*>(data), mappedSize);
+	}
+#endif
+}
+
+bool JournalReplayer::isOpen() {
+	return valid;
+}
+
+unsigned long long JournalReplayer::getNumRecords() {
+	return numRecords;
+}
+
+double JournalReplayer::getDuration() {
+	return lastTime * 1e-9;
+}
+
+void JournalReplayer::replay(DensityMap& map, double speed, int resolveInterval) {
+	typedef std::chrono::steady_clock Clock;
+
+	if (position >= size) {
+		return;
+	}
+
+	Clock::time_point start = Clock::now();
+	int64_t firstTime = headerAt(position).time;
+
+	unsigned long long replayed = 0;
+
+	while (position < size) {
+		if (speed > 0) {
+			// Waiting until the record is due
+			int64_t due = static_cast<int64_t>((headerAt(position).time - firstTime) / speed);
+			std::this_thread::sleep_until(start + std::chrono::nanoseconds(due));
+		}
+
+		replayRecord(map);
+		replayed++;
+
+		if (resolveInterval > 0 && replayed % resolveInterval == 0) {
+			map.resolveQueues();
+		}
+	}
+
+	if (resolveInterval > 0) {
+		map.resolveQueues();
+	}
+}
+
+unsigned long long JournalReplayer::replayUntil(DensityMap& map, double time) {
+	int64_t until = static_cast<int64_t>(time * 1e9);
+	unsigned long long replayed = 0;
+
+	while (position < size && headerAt(position).time <= until) {
+		replayRecord(map);
+		replayed++;
+	}
+
+	return replayed;
+}
+
+void JournalReplayer::rewind() {
+	position = fileHeaderSize;
+}
+
+void JournalReplayer::replayRecord(DensityMap& map) {
+	const Journal::RecordHeader& header = headerAt(position);
+	const unsigned char* payload = data + position + sizeof(header);
+
+	switch (header.type) {
+	case Journal::Line: {
+		float points[6];
+		std::memcpy(points, payload, sizeof(points));
+
+		glm::vec3 p1(points[0], points[1], points[2]);
+		glm::vec3 p2(points[3], points[4], points[5]);
+
+		map.writeLine(p1, p2, payload + linePayloadSize, header.numSamples, static_cast<DensityMap::WriteMode>(header.writeMode));
+		break;
+	}
+	case Journal::Cell: {
+		uint32_t coordinates[3];
+		std::memcpy(coordinates, payload, sizeof(coordinates));
+
+		map.writeCell(coordinates[0], coordinates[1], coordinates[2], payload[sizeof(coordinates)]);
+		break;
+	}
+	case Journal::Clear:
+		map.clear(header.writeMode);
+		break;
+	case Journal::Block: {
+		int32_t region[6];
+		std::memcpy(region, payload, sizeof(region));
+
+		map.writeBlock(glm::ivec3(region[0], region[1], region[2]), glm::ivec3(region[3], region[4], region[5]), payload + blockPayloadSize);
+		break;
+	}
+	case Journal::Origin: {
+		int32_t origin[3];
+		std::memcpy(origin, payload, sizeof(origin));
+
+		map.scroll(glm::ivec3(origin[0], origin[1], origin[2]) - map.getOriginCell());
+		break;
+	}
+	}
+
+	position += recordSize(position);
+}
+
+const Journal::RecordHeader& JournalReplayer::headerAt(size_t offset) {
+	// Records are padded to 8 bytes and the mapping starts on a page, so this is aligned
+	return *reinterpret_cast<const Journal::RecordHeader*>(data + offset);
+}
+
+size_t JournalReplayer::recordSize(size_t offset) {
+	if (offset + sizeof(Journal::RecordHeader) > size) {
+		return 0;
+	}
+
+	const Journal::RecordHeader& header = headerAt(offset);
+
+	size_t length;
+	switch (header.type) {
+	case Journal::Line:
+		length = padded(sizeof(header) + linePayloadSize + header.numSamples);
+		break;
+	case Journal::Cell:
+		length = padded(sizeof(header) + cellPayloadSize);
+		break;
+	case Journal::Clear:
+		length = sizeof(header);
+		break;
+	case Journal::Block:
+		length = padded(sizeof(header) + blockPayloadSize + header.numSamples);
+		break;
+	case Journal::Origin:
+		length = padded(sizeof(header) + originPayloadSize);
+		break;
+	default:
+		return 0;
+	}
+
+	return offset + length <= size ? length : 0;
+}
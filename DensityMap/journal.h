@@ -0,0 +1,165 @@
+#pragma once
+
+#include <glm/glm.hpp>
+
+#include "densityMap.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Binary log of the writes made to a DensityMap, so a session can be replayed later
+//
+// The file starts with the 8 bytes "DMJL" + version, followed by records
+// Every record starts with a RecordHeader and is padded to a multiple of 8 bytes:
+//   Line:  header, float p1[3], float p2[3], samples[numSamples]
+//   Cell:  header, uint32 x, y, z, uint8 value
+//   Clear: header (value in writeMode)
+//   Block: header, int32 start[3], int32 size[3], values[numSamples]
+//   Origin: header, int32 originCell[3] (where the window is from then on, see DensityMap::scroll())
+// Numbers are stored in the byte order of the machine that recorded them
+namespace Journal {
+	enum RecordType : uint8_t {
+		Line = 1,
+		Cell = 2,
+		Clear = 3,
+		Block = 4,
+		Origin = 5
+	};
+
+	struct RecordHeader {
+		uint8_t type;
+		uint8_t writeMode;
+		uint16_t reserved;
+		uint32_t numSamples;
+
+		// Nanoseconds since recording started
+		int64_t time;
+	};
+
+	static const char magic[4] = { 'D', 'M', 'J', 'L' };
+	static const uint32_t version = 1;
+}
+
+// Appends writes to a journal file
+// The record functions only copy into a memory buffer, and a background
+// thread writes the buffer to disk, so the acquisition thread never waits for the disk
+class JournalRecorder {
+public:
+	// Constructor (creates or overwrites the file at path)
+	JournalRecorder(const std::string& path);
+
+	// Destructor (writes whatever is left)
+	~JournalRecorder();
+
+	JournalRecorder(const JournalRecorder&) = delete;
+	JournalRecorder& operator=(const JournalRecorder&) = delete;
+
+	// Returns false if the file couldn't be created
+	bool isOpen();
+
+	void recordLine(glm::vec3 p1, glm::vec3 p2, const unsigned char* samples, int numSamples, DensityMap::WriteMode writeMode);
+	void recordCell(unsigned int x, unsigned int y, unsigned int z, unsigned char value);
+	void recordClear(unsigned char value);
+	void recordBlock(glm::ivec3 blockStart, glm::ivec3 size, const unsigned char* values);
+	void recordOrigin(glm::ivec3 originCell);
+
+	// Writes everything recorded so far and closes the file
+	void close();
+
+	// Returns the number of bytes recorded so far (including those not on disk yet)
+	unsigned long long getBytesRecorded();
+
+private:
+	typedef std::chrono::steady_clock Clock;
+
+	// The background thread writes once this much is waiting (or every 100 ms)
+	static const size_t flushSize = 1 << 20;
+
+	FILE* file;
+	Clock::time_point start;
+
+	// Records are added to buffer, and the writer thread swaps it with its own
+	std::vector<unsigned char> buffer;
+	std::vector<unsigned char> writing;
+
+	std::mutex bufferMutex;
+	std::condition_variable bufferReady;
+	bool stopping;
+
+	unsigned long long bytesRecorded;
+
+	std::thread writer;
+
+	// Copies a header and its payload into the buffer (bufferMutex must be locked)
+	void append(const Journal::RecordHeader& header, const void* payload, size_t payloadSize, const void* extra, size_t extraSize);
+
+	// Body of the writer thread
+	void writeLoop();
+};
+
+// Plays a journal back into a DensityMap
+// The file is mapped into memory, so the samples are passed to writeLine() straight from the file
+class JournalReplayer {
+public:
+	// Constructor (maps the file at path)
+	JournalReplayer(const std::string& path);
+	~JournalReplayer();
+
+	JournalReplayer(const JournalReplayer&) = delete;
+	JournalReplayer& operator=(const JournalReplayer&) = delete;
+
+	// Returns false if the file couldn't be opened or isn't a journal
+	bool isOpen();
+
+	// Returns the number of records and the time of the last one (in seconds)
+	unsigned long long getNumRecords();
+	double getDuration();
+
+	// Writes every record to map
+	// speed is 1 for the original timing, N for N times faster and 0 for as fast as possible
+	// If resolveInterval isn't 0, map.resolveQueues() is called after every resolveInterval
+	// records (needed for headless maps, which nothing else resolves)
+	void replay(DensityMap& map, double speed = 1, int resolveInterval = 0);
+
+	// Writes the records up to a time (in seconds from the start of the journal)
+	// and returns how many were written. Continues from where the last call stopped
+	unsigned long long replayUntil(DensityMap& map, double time);
+
+	// Goes back to the first record
+	void rewind();
+
+private:
+	const unsigned char* data;
+	size_t mappedSize;
+
+	// End of the last complete record
+	size_t size;
+
+	bool valid;
+
+	// Offset of the next record to replay
+	size_t position;
+
+	unsigned long long numRecords;
+	int64_t lastTime;
+
+#ifdef _WIN32
+	void* fileHandle;
+	void* mappingHandle;
+#endif
+
+	// Writes the record at position to map and moves to the next one
+	void replayRecord(DensityMap& map);
+
+	// Returns the header of the record at an offset
+	const Journal::RecordHeader& headerAt(size_t offset);
+
+	// Returns the size of the record at an offset (0 if it is cut off or broken)
+	size_t recordSize(size_t offset);
+};
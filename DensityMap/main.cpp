@@ -9,6 +9,7 @@
 
 #include "shader.h"
 #include "camera.h"
+#include "trace.h"
 
 #include "densitymap.h"
 
@@ -50,6 +51,7 @@ int main() {
 	// Variables for measuring FPS
 	int numFrames = 0;
 	double lastFPSUpdate = 0;
+	unsigned long long lastSkippedFrames = 0;
 
 	// Initializing the OpenGL context
 	glfwInit();
@@ -95,75 +97,106 @@ int main() {
 		return -1;
 	}
 
+	// Compiled shaders are kept on disk so later launches start faster
+	ShaderBase::setBinaryCacheDirectory("shaderCache");
+
+#ifdef DENSITYMAP_ENABLE_TRACING
+	// Open the trace in chrome://tracing or ui.perfetto.dev
+	Trace::begin("densityMap.trace.json");
+	Trace::setThreadName("main");
+#endif
+
 	// Initializing mouse info
 	lastMouseX = SCR_WIDTH / 2.0;
 	lastMouseY = SCR_HEIGHT / 2.0;
 	firstMouse = true;
 
-	// Creating the density map
-	int dim = 100;
-	DensityMap grid(dim);
-
-	sphereDemo(grid);
-
-	// Display all non-empty cells
-	grid.setThreshold(1);
-
-	// Main event loop
-	while (!glfwWindowShouldClose(window)) {
-		double currentFrame = glfwGetTime();
-		cam.deltaTime = currentFrame - cam.lastFrame;
-		cam.lastFrame = currentFrame;
-
-		//glm::vec3 p1 = { float(rand()) / RAND_MAX, float(rand()) / RAND_MAX, float(rand()) / RAND_MAX };
-		//glm::vec3 p2 = { float(rand()) / RAND_MAX, float(rand()) / RAND_MAX, float(rand()) / RAND_MAX };
-		//std::vector<unsigned char> values;
-		//for (int i = 0; i < 100; i++) {
-		//	values.push_back(255);
-		//}
-		//grid.writeLine(p1, p2, values);
-
-		// Self-explanatory
-		processKeyboardInput(window);
-
-		// Clears the screen and fills it a dark grey color
-		glClearColor(0.1, 0.1, 0.1, 1.0);
-		glClear(GL_COLOR_BUFFER_BIT);
-
-		// Creating matrices to transform the vertices into NDC (screen) coordinates
-		// between -1 and 1 that OpenGL can use
-		glm::mat4 projection = glm::perspective<float>(glm::radians(cam.fov), float(SCR_WIDTH) / SCR_HEIGHT, 0.01, 500.0);
-		glm::mat4 view = cam.getViewMatrix();
-		glm::mat4 model = glm::mat4(1.0);
-
-		if (ROTATE_GRID) {
-			model = glm::rotate(model, rotationX, glm::vec3(1, 0, 0));
-			model = glm::rotate(model, rotationY, glm::vec3(0, 1, 0));
-		}
+	// The density map has to be destroyed before the OpenGL context
+	{
+		// Creating the density map
+		int dim = 100;
+		DensityMap grid(dim);
+
+		sphereDemo(grid);
+
+		ShaderBase::StartupStats shaderStats = ShaderBase::getStartupStats();
+		std::cout << "Shaders: " << shaderStats.compiled << " compiled in " << shaderStats.compileMilliseconds << " ms, "
+			<< shaderStats.cacheHits << " loaded from cache in " << shaderStats.cacheHitMilliseconds << " ms" << std::endl;
+
+		// Display all non-empty cells
+		grid.setThreshold(1);
+
+		// Only draw the volume again when something changed
+		grid.setFrameCaching(true);
+
+		// Spread bursts of writes over a few frames (4 ms of resolving per frame)
+		grid.setResolveBudget(4000);
+
+		// Main event loop
+		while (!glfwWindowShouldClose(window)) {
+			double currentFrame = glfwGetTime();
+			cam.deltaTime = currentFrame - cam.lastFrame;
+			cam.lastFrame = currentFrame;
+
+			//glm::vec3 p1 = { float(rand()) / RAND_MAX, float(rand()) / RAND_MAX, float(rand()) / RAND_MAX };
+			//glm::vec3 p2 = { float(rand()) / RAND_MAX, float(rand()) / RAND_MAX, float(rand()) / RAND_MAX };
+			//std::vector<unsigned char> values;
+			//for (int i = 0; i < 100; i++) {
+			//	values.push_back(255);
+			//}
+			//grid.writeLine(p1, p2, values);
+
+			// Self-explanatory
+			processKeyboardInput(window);
+
+			// Clears the screen and fills it a dark grey color
+			glClearColor(0.1, 0.1, 0.1, 1.0);
+			glClear(GL_COLOR_BUFFER_BIT);
+
+			// Creating matrices to transform the vertices into NDC (screen) coordinates
+			// between -1 and 1 that OpenGL can use
+			glm::mat4 projection = glm::perspective<float>(glm::radians(cam.fov), float(SCR_WIDTH) / SCR_HEIGHT, 0.01, 500.0);
+			glm::mat4 view = cam.getViewMatrix();
+			glm::mat4 model = glm::mat4(1.0);
+
+			if (ROTATE_GRID) {
+				model = glm::rotate(model, rotationX, glm::vec3(1, 0, 0));
+				model = glm::rotate(model, rotationY, glm::vec3(0, 1, 0));
+			}
 
-		// Draw the density map and the surrounding cube
-		grid.draw(projection, view, model);
+			// Draw the density map and the surrounding cube
+			grid.draw(projection, view, model);
 
-		// Used to make camera move speed consistent
-		cam.prevPos = cam.position;
+			// Used to make camera move speed consistent
+			cam.prevPos = cam.position;
 
-		// Update the screen
-		glfwSwapBuffers(window);
-		glfwPollEvents();
+			// Update the screen
+			glfwSwapBuffers(window);
+			glfwPollEvents();
 
-		// Measuring FPS
-		if (glfwGetTime() - lastFPSUpdate >= 1) {
-			std::string newTitle = windowTitle + " (" + std::to_string(numFrames) + " FPS)";
-			glfwSetWindowTitle(window, newTitle.c_str());
+			// Measuring FPS
+			if (glfwGetTime() - lastFPSUpdate >= 1) {
+				Metrics metrics = grid.getMetrics();
 
-			lastFPSUpdate = glfwGetTime();
-			numFrames = 0;
-		}
+				std::string newTitle = windowTitle + " (" + std::to_string(numFrames) + " FPS, " + std::to_string(grid.getSkippedFrames() - lastSkippedFrames) + " skipped, "
+					+ std::to_string(static_cast<long long int>(metrics.linesPerSecond)) + " lines/s, resolve p99 " + std::to_string(static_cast<int>(metrics.resolvePercentileSeconds(0.99) * 1e6)) + " us, backlog "
+					+ std::to_string(static_cast<int>(metrics.backlogAgeSeconds * 1e3)) + " ms)";
+				glfwSetWindowTitle(window, newTitle.c_str());
 
-		// Increment the number of frames in the past second
-		numFrames++;
+				lastFPSUpdate = glfwGetTime();
+				numFrames = 0;
+				lastSkippedFrames = grid.getSkippedFrames();
+
+				Trace::flush();
+			}
+
+			// Increment the number of frames in the past second
+			numFrames++;
+		}
 	}
 
+	Trace::end();
+
 	// GLFW cleanup
 	glfwTerminate();
 }
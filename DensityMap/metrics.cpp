@@ -0,0 +1,180 @@
+#include "metrics.h"
+
+namespace {
+	const std::memory_order relaxed = std::memory_order_relaxed;
+
+	unsigned long long toNanoseconds(MetricsCounters::Clock::duration duration) {
+		long long int ns = std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count();
+		return ns > 0 ? ns : 0;
+	}
+
+	// Raises peak to value (only ever called by the thread holding the queue's lock)
+	void raisePeak(std::atomic<unsigned long long>& peak, unsigned long long value) {
+		if (value > peak.load(relaxed)) {
+			peak.store(value, relaxed);
+		}
+	}
+}
+
+double Metrics::resolvePercentileSeconds(double fraction) const {
+	if (resolveCalls == 0) {
+		return 0;
+	}
+
+	unsigned long long wanted = static_cast<unsigned long long>(fraction * resolveCalls + 0.5);
+	unsigned long long count = 0;
+
+	for (int i = 0; i < histogramBuckets; i++) {
+		count += resolveHistogram[i];
+
+		if (count >= wanted) {
+			return static_cast<double>(2ULL << i) * 1e-6;
+		}
+	}
+
+	return static_cast<double>(2ULL << (histogramBuckets - 1)) * 1e-6;
+}
+
+MetricsCounters::MetricsCounters() {
+	lineQueueDepth = 0;
+	peakLineQueueDepth = 0;
+	cellQueueDepth = 0;
+	peakCellQueueDepth = 0;
+
+	backlogStart = 0;
+	carriedOverResolves = 0;
+
+	linesIngested = 0;
+	samplesIngested = 0;
+	cellsIngested = 0;
+	voxelsTouched = 0;
+
+	resolveCalls = 0;
+	resolveNanoseconds = 0;
+	for (int i = 0; i < Metrics::histogramBuckets; i++) {
+		resolveHistogram[i] = 0;
+	}
+
+	writeLockWaitNanoseconds = 0;
+	readLockWaitNanoseconds = 0;
+
+	frames = 0;
+	bytesUploadedLastFrame = 0;
+	bytesUploadedTotal = 0;
+
+	lastSnapshotTime = Clock::now().time_since_epoch().count();
+	lastLines = 0;
+	lastSamples = 0;
+	lastVoxels = 0;
+}
+
+void MetricsCounters::setLineQueueDepth(unsigned long long depth) {
+	lineQueueDepth.store(depth, relaxed);
+	raisePeak(peakLineQueueDepth, depth);
+}
+
+void MetricsCounters::setCellQueueDepth(unsigned long long depth) {
+	cellQueueDepth.store(depth, relaxed);
+	raisePeak(peakCellQueueDepth, depth);
+}
+
+void MetricsCounters::setBacklogStart(Clock::time_point queued) {
+	backlogStart.store(queued.time_since_epoch().count(), relaxed);
+}
+
+void MetricsCounters::clearBacklog() {
+	backlogStart.store(0, relaxed);
+}
+
+void MetricsCounters::addLines(unsigned long long lines, unsigned long long samples) {
+	linesIngested.fetch_add(lines, relaxed);
+	samplesIngested.fetch_add(samples, relaxed);
+}
+
+void MetricsCounters::addCells(unsigned long long cells) {
+	cellsIngested.fetch_add(cells, relaxed);
+}
+
+void MetricsCounters::addVoxelsTouched(unsigned long long voxels) {
+	voxelsTouched.fetch_add(voxels, relaxed);
+}
+
+void MetricsCounters::addResolve(Clock::duration duration) {
+	unsigned long long ns = toNanoseconds(duration);
+
+	// Bucket = floor(log2(microseconds))
+	unsigned long long us = ns / 1000;
+	int bucket = 0;
+	while (us > 1 && bucket < Metrics::histogramBuckets - 1) {
+		us >>= 1;
+		bucket++;
+	}
+
+	resolveCalls.fetch_add(1, relaxed);
+	resolveNanoseconds.fetch_add(ns, relaxed);
+	resolveHistogram[bucket].fetch_add(1, relaxed);
+}
+
+void MetricsCounters::addCarriedOverResolve() {
+	carriedOverResolves.fetch_add(1, relaxed);
+}
+
+void MetricsCounters::addWriteLockWait(Clock::duration duration) {
+	writeLockWaitNanoseconds.fetch_add(toNanoseconds(duration), relaxed);
+}
+
+void MetricsCounters::addReadLockWait(Clock::duration duration) {
+	readLockWaitNanoseconds.fetch_add(toNanoseconds(duration), relaxed);
+}
+
+void MetricsCounters::addFrame(unsigned long long bytesUploaded) {
+	frames.fetch_add(1, relaxed);
+	bytesUploadedLastFrame.store(bytesUploaded, relaxed);
+	bytesUploadedTotal.fetch_add(bytesUploaded, relaxed);
+}
+
+Metrics MetricsCounters::snapshot() {
+	Metrics metrics;
+
+	metrics.lineQueueDepth = lineQueueDepth.load(relaxed);
+	metrics.peakLineQueueDepth = peakLineQueueDepth.load(relaxed);
+	metrics.cellQueueDepth = cellQueueDepth.load(relaxed);
+	metrics.peakCellQueueDepth = peakCellQueueDepth.load(relaxed);
+	metrics.carriedOverResolves = carriedOverResolves.load(relaxed);
+
+	metrics.linesIngested = linesIngested.load(relaxed);
+	metrics.samplesIngested = samplesIngested.load(relaxed);
+	metrics.cellsIngested = cellsIngested.load(relaxed);
+	metrics.voxelsTouched = voxelsTouched.load(relaxed);
+
+	metrics.resolveCalls = resolveCalls.load(relaxed);
+	metrics.resolveSeconds = resolveNanoseconds.load(relaxed) * 1e-9;
+	for (int i = 0; i < Metrics::histogramBuckets; i++) {
+		metrics.resolveHistogram[i] = resolveHistogram[i].load(relaxed);
+	}
+
+	metrics.writeLockWaitSeconds = writeLockWaitNanoseconds.load(relaxed) * 1e-9;
+	metrics.readLockWaitSeconds = readLockWaitNanoseconds.load(relaxed) * 1e-9;
+
+	metrics.frames = frames.load(relaxed);
+	metrics.bytesUploadedLastFrame = bytesUploadedLastFrame.load(relaxed);
+	metrics.bytesUploadedTotal = bytesUploadedTotal.load(relaxed);
+
+	// Rates since the previous snapshot
+	long long int now = Clock::now().time_since_epoch().count();
+	long long int then = lastSnapshotTime.exchange(now, relaxed);
+	double seconds = std::chrono::duration<double>(Clock::duration(now - then)).count();
+
+	long long int queued = backlogStart.load(relaxed);
+	metrics.backlogAgeSeconds = queued != 0 && now > queued ? std::chrono::duration<double>(Clock::duration(now - queued)).count() : 0;
+
+	unsigned long long lines = metrics.linesIngested - lastLines.exchange(metrics.linesIngested, relaxed);
+	unsigned long long samples = metrics.samplesIngested - lastSamples.exchange(metrics.samplesIngested, relaxed);
+	unsigned long long voxels = metrics.voxelsTouched - lastVoxels.exchange(metrics.voxelsTouched, relaxed);
+
+	metrics.linesPerSecond = seconds > 0 ? lines / seconds : 0;
+	metrics.samplesPerSecond = seconds > 0 ? samples / seconds : 0;
+	metrics.voxelsPerSecond = seconds > 0 ? voxels / seconds : 0;
+
+	return metrics;
+}
@@ -0,0 +1,116 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+
+// Copy of a DensityMap's runtime counters at one moment (see DensityMap::getMetrics())
+struct Metrics {
+	static const int histogramBuckets = 32;
+
+	// Writes waiting in the queues now, and the most there have ever been
+	unsigned long long lineQueueDepth;
+	unsigned long long peakLineQueueDepth;
+	unsigned long long cellQueueDepth;
+	unsigned long long peakCellQueueDepth;
+
+	// How long the oldest write still waiting for resolveQueues() has waited (0 if none is), and how
+	// many resolveQueues() calls ran out of budget and left writes for the next one
+	double backlogAgeSeconds;
+	unsigned long long carriedOverResolves;
+
+	// Totals since the map was created
+	unsigned long long linesIngested;
+	unsigned long long samplesIngested;
+	unsigned long long cellsIngested;
+	unsigned long long voxelsTouched;
+
+	// Rates over the time since the previous getMetrics() call
+	double linesPerSecond;
+	double samplesPerSecond;
+	double voxelsPerSecond;
+
+	// resolveQueues() durations
+	// Bucket i counts the calls that took [2^i, 2^(i+1)) microseconds (bucket 0 includes anything shorter)
+	unsigned long long resolveCalls;
+	double resolveSeconds;
+	unsigned long long resolveHistogram[histogramBuckets];
+
+	// Total time threads spent waiting to lock each mutex
+	double writeLockWaitSeconds;
+	double readLockWaitSeconds;
+
+	// Bytes copied to the graphics card by the last draw() and in total
+	unsigned long long frames;
+	unsigned long long bytesUploadedLastFrame;
+	unsigned long long bytesUploadedTotal;
+
+	// Returns the duration below which a given fraction (0 to 1) of the resolveQueues() calls fall
+	// (the upper edge of the histogram bucket, so this is an estimate)
+	double resolvePercentileSeconds(double fraction) const;
+};
+
+// The counters behind Metrics
+// Everything is a relaxed atomic, so the threads that update them never wait on each other
+// and a snapshot is only approximately consistent between counters
+class MetricsCounters {
+public:
+	typedef std::chrono::steady_clock Clock;
+
+	MetricsCounters();
+
+	// Records the depth of a queue after a push (the caller holds the queue's lock)
+	void setLineQueueDepth(unsigned long long depth);
+	void setCellQueueDepth(unsigned long long depth);
+
+	// Records when the oldest write still waiting was queued, or that nothing is waiting
+	// (the caller holds the queues' lock)
+	void setBacklogStart(Clock::time_point queued);
+	void clearBacklog();
+
+	void addLines(unsigned long long lines, unsigned long long samples);
+	void addCells(unsigned long long cells);
+	void addVoxelsTouched(unsigned long long voxels);
+
+	void addResolve(Clock::duration duration);
+	void addCarriedOverResolve();
+
+	void addWriteLockWait(Clock::duration duration);
+	void addReadLockWait(Clock::duration duration);
+
+	void addFrame(unsigned long long bytesUploaded);
+
+	// Copies the counters (the rates are measured since the previous call)
+	Metrics snapshot();
+
+private:
+	std::atomic<unsigned long long> lineQueueDepth;
+	std::atomic<unsigned long long> peakLineQueueDepth;
+	std::atomic<unsigned long long> cellQueueDepth;
+	std::atomic<unsigned long long> peakCellQueueDepth;
+
+	// Clock ticks since the epoch (0 if nothing is waiting)
+	std::atomic<long long> backlogStart;
+	std::atomic<unsigned long long> carriedOverResolves;
+
+	std::atomic<unsigned long long> linesIngested;
+	std::atomic<unsigned long long> samplesIngested;
+	std::atomic<unsigned long long> cellsIngested;
+	std::atomic<unsigned long long> voxelsTouched;
+
+	std::atomic<unsigned long long> resolveCalls;
+	std::atomic<unsigned long long> resolveNanoseconds;
+	std::atomic<unsigned long long> resolveHistogram[Metrics::histogramBuckets];
+
+	std::atomic<unsigned long long> writeLockWaitNanoseconds;
+	std::atomic<unsigned long long> readLockWaitNanoseconds;
+
+	std::atomic<unsigned long long> frames;
+	std::atomic<unsigned long long> bytesUploadedLastFrame;
+	std::atomic<unsigned long long> bytesUploadedTotal;
+
+	// What the totals were at the previous snapshot, for the rates
+	std::atomic<long long> lastSnapshotTime;
+	std::atomic<unsigned long long> lastLines;
+	std::atomic<unsigned long long> lastSamples;
+	std::atomic<unsigned long long> lastVoxels;
+};
@@ -1,100 +1,372 @@
 #include "shader.h"
 
+#include <cstdint>
+#include <cstdio>
+
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#endif
+
+// Identifies program binary cache files
+static const char binaryMagic[4] = { 'D', 'M', 'P', 'B' };
+static const uint32_t binaryFileVersion = 1;
+
+// Program binaries are a few hundred KB at most, anything much bigger is a damaged file
+static const uint32_t maxBinaryLength = 64 << 20;
+
+std::string ShaderBase::binaryCacheDirectory;
+ShaderBase::StartupStats ShaderBase::startupStats = { 0, 0, 0.0, 0.0 };
+
 // Base class
 
 void ShaderBase::use() {
 	glUseProgram(ID);
 }
 
+int ShaderBase::getUniformLocation(const std::string& name) const {
+	auto it = uniformLocations.find(name);
+	if (it != uniformLocations.end()) {
+		return it->second;
+	}
+
+	// Things like single array elements aren't in the cache
+	return glGetUniformLocation(ID, name.c_str());
+}
+
+void ShaderBase::bindUniformBlock(const std::string& name, unsigned int binding) const {
+	unsigned int index = glGetUniformBlockIndex(ID, name.c_str());
+	if (index != GL_INVALID_INDEX) {
+		glUniformBlockBinding(ID, index, binding);
+	}
+}
+
 void ShaderBase::setBool(const std::string& name, bool value) const {
-	glUniform1i(glGetUniformLocation(ID, name.c_str()), int(value));
+	glUniform1i(getUniformLocation(name), int(value));
 }
 
 void ShaderBase::setInt(const std::string& name, int value) const {
-	glUniform1i(glGetUniformLocation(ID, name.c_str()), value);
+	glUniform1i(getUniformLocation(name), value);
 }
 
 void ShaderBase::setFloat(const std::string& name, float value) const {
-	glUniform1f(glGetUniformLocation(ID, name.c_str()), value);
+	glUniform1f(getUniformLocation(name), value);
 }
 
 void ShaderBase::setUInt(const std::string& name, unsigned int value) const {
-	glUniform1ui(glGetUniformLocation(ID, name.c_str()), value);
+	glUniform1ui(getUniformLocation(name), value);
 }
 
 void ShaderBase::setVec2(const std::string& name, const glm::vec2& value) const {
-	glUniform2fv(glGetUniformLocation(ID, name.c_str()), 1, &value[0]);
+	glUniform2fv(getUniformLocation(name), 1, &value[0]);
 }
 void ShaderBase::setVec2(const std::string& name, float x, float y) const {
-	glUniform2f(glGetUniformLocation(ID, name.c_str()), x, y);
+	glUniform2f(getUniformLocation(name), x, y);
 }
 
 void ShaderBase::setVec3(const std::string& name, const glm::vec3& value) const {
-	glUniform3fv(glGetUniformLocation(ID, name.c_str()), 1, &value[0]);
+	glUniform3fv(getUniformLocation(name), 1, &value[0]);
 }
 void ShaderBase::setVec3(const std::string& name, float x, float y, float z) const {
-	glUniform3f(glGetUniformLocation(ID, name.c_str()), x, y, z);
+	glUniform3f(getUniformLocation(name), x, y, z);
 }
 
 void ShaderBase::setVec4(const std::string& name, const glm::vec4& value) const {
-	glUniform4fv(glGetUniformLocation(ID, name.c_str()), 1, &value[0]);
+	glUniform4fv(getUniformLocation(name), 1, &value[0]);
 }
 void ShaderBase::setVec4(const std::string& name, float x, float y, float z, float w) const {
-	glUniform4f(glGetUniformLocation(ID, name.c_str()), x, y, z, w);
+	glUniform4f(getUniformLocation(name), x, y, z, w);
 }
 
 void ShaderBase::setIVec2(const std::string& name, const glm::ivec2& value) const {
-	glUniform2iv(glGetUniformLocation(ID, name.c_str()), 1, &value[0]);
+	glUniform2iv(getUniformLocation(name), 1, &value[0]);
 }
 void ShaderBase::setIVec2(const std::string& name, int x, int y) const {
-	glUniform2i(glGetUniformLocation(ID, name.c_str()), x, y);
+	glUniform2i(getUniformLocation(name), x, y);
 }
 
 void ShaderBase::setIVec3(const std::string& name, const glm::ivec3& value) const {
-	glUniform3iv(glGetUniformLocation(ID, name.c_str()), 1, &value[0]);
+	glUniform3iv(getUniformLocation(name), 1, &value[0]);
 }
 void ShaderBase::setIVec3(const std::string& name, int x, int y, int z) const {
-	glUniform3i(glGetUniformLocation(ID, name.c_str()), x, y, z);
+	glUniform3i(getUniformLocation(name), x, y, z);
 }
 
 void ShaderBase::setIVec4(const std::string& name, const glm::ivec4& value) const {
-	glUniform4iv(glGetUniformLocation(ID, name.c_str()), 1, &value[0]);
+	glUniform4iv(getUniformLocation(name), 1, &value[0]);
 }
 void ShaderBase::setIVec4(const std::string& name, int x, int y, int z, int w) const {
-	glUniform4i(glGetUniformLocation(ID, name.c_str()), x, y, z, w);
+	glUniform4i(getUniformLocation(name), x, y, z, w);
 }
 
 void ShaderBase::setUVec2(const std::string& name, const glm::uvec2& value) const {
-	glUniform2uiv(glGetUniformLocation(ID, name.c_str()), 1, &value[0]);
+	glUniform2uiv(getUniformLocation(name), 1, &value[0]);
 }
 void ShaderBase::setUVec2(const std::string& name, unsigned int x, unsigned int y) const {
-	glUniform2ui(glGetUniformLocation(ID, name.c_str()), x, y);
+	glUniform2ui(getUniformLocation(name), x, y);
 }
 
 void ShaderBase::setUVec3(const std::string& name, const glm::uvec3& value) const {
-	glUniform3uiv(glGetUniformLocation(ID, name.c_str()), 1, &value[0]);
+	glUniform3uiv(getUniformLocation(name), 1, &value[0]);
 }
 void ShaderBase::setUVec3(const std::string& name, unsigned int x, unsigned int y, unsigned int z) const {
-	glUniform3ui(glGetUniformLocation(ID, name.c_str()), x, y, z);
+	glUniform3ui(getUniformLocation(name), x, y, z);
 }
 
 void ShaderBase::setUVec4(const std::string& name, const glm::uvec4& value) const {
-	glUniform4uiv(glGetUniformLocation(ID, name.c_str()), 1, &value[0]);
+	glUniform4uiv(getUniformLocation(name), 1, &value[0]);
 }
 void ShaderBase::setUVec4(const std::string& name, unsigned int x, unsigned int y, unsigned int z, unsigned int w) const {
-	glUniform4ui(glGetUniformLocation(ID, name.c_str()), x, y, z, w);
+	glUniform4ui(getUniformLocation(name), x, y, z, w);
 }
 
 void ShaderBase::setMat2(const std::string& name, const glm::mat2& mat) const {
-	glUniformMatrix2fv(glGetUniformLocation(ID, name.c_str()), 1, GL_FALSE, &mat[0][0]);
+	glUniformMatrix2fv(getUniformLocation(name), 1, GL_FALSE, &mat[0][0]);
 }
 
 void ShaderBase::setMat3(const std::string& name, const glm::mat3& mat) const {
-	glUniformMatrix3fv(glGetUniformLocation(ID, name.c_str()), 1, GL_FALSE, &mat[0][0]);
+	glUniformMatrix3fv(getUniformLocation(name), 1, GL_FALSE, &mat[0][0]);
 }
 
 void ShaderBase::setMat4(const std::string& name, const glm::mat4& mat) const {
-	glUniformMatrix4fv(glGetUniformLocation(ID, name.c_str()), 1, GL_FALSE, &mat[0][0]);
+	glUniformMatrix4fv(getUniformLocation(name), 1, GL_FALSE, &mat[0][0]);
+}
+
+void ShaderBase::setBool(int location, bool value) const {
+	glUniform1i(location, int(value));
+}
+
+void ShaderBase::setInt(int location, int value) const {
+	glUniform1i(location, value);
+}
+
+void ShaderBase::setFloat(int location, float value) const {
+	glUniform1f(location, value);
+}
+
+void ShaderBase::setUInt(int location, unsigned int value) const {
+	glUniform1ui(location, value);
+}
+
+void ShaderBase::setVec2(int location, const glm::vec2& value) const {
+	glUniform2fv(location, 1, &value[0]);
+}
+
+void ShaderBase::setVec3(int location, const glm::vec3& value) const {
+	glUniform3fv(location, 1, &value[0]);
+}
+
+void ShaderBase::setVec4(int location, const glm::vec4& value) const {
+	glUniform4fv(location, 1, &value[0]);
+}
+
+void ShaderBase::setMat2(int location, const glm::mat2& mat) const {
+	glUniformMatrix2fv(location, 1, GL_FALSE, &mat[0][0]);
+}
+
+void ShaderBase::setMat3(int location, const glm::mat3& mat) const {
+	glUniformMatrix3fv(location, 1, GL_FALSE, &mat[0][0]);
+}
+
+void ShaderBase::setMat4(int location, const glm::mat4& mat) const {
+	glUniformMatrix4fv(location, 1, GL_FALSE, &mat[0][0]);
+}
+
+void ShaderBase::cacheUniformLocations() {
+	uniformLocations.clear();
+
+	int count = 0;
+	glGetProgramiv(ID, GL_ACTIVE_UNIFORMS, &count);
+
+	char name[256];
+	for (int i = 0; i < count; i++) {
+		int length = 0;
+		int size = 0;
+		GLenum type;
+		glGetActiveUniform(ID, i, sizeof(name), &length, &size, &type, name);
+
+		// Uniforms inside uniform blocks have no location
+		int location = glGetUniformLocation(ID, name);
+		if (location != -1) {
+			uniformLocations[std::string(name, length)] = location;
+		}
+	}
+}
+
+void ShaderBase::setBinaryCacheDirectory(const std::string& directory) {
+	binaryCacheDirectory = directory;
+
+	if (!directory.empty()) {
+#ifdef _WIN32
+		_mkdir(directory.c_str());
+#else
+		mkdir(directory.c_str(), 0755);
+#endif
+	}
+}
+
+std::string ShaderBase::getBinaryCacheDirectory() {
+	return binaryCacheDirectory;
+}
+
+ShaderBase::StartupStats ShaderBase::getStartupStats() {
+	return startupStats;
+}
+
+bool ShaderBase::binaryCacheAvailable() {
+	if (binaryCacheDirectory.empty() || !GLAD_GL_VERSION_4_1) {
+		return false;
+	}
+
+	int numFormats = 0;
+	glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &numFormats);
+
+	return numFormats > 0;
+}
+
+std::string ShaderBase::binaryCacheKey(std::initializer_list<const char*> sources) {
+	if (!binaryCacheAvailable()) {
+		return "";
+	}
+
+	// FNV-1a over the sources and the driver, since binaries only work on the driver that made them
+	uint64_t hash = 14695981039346656037ULL;
+	auto add = [&hash](const char* text) {
+		for (const char* c = text ? text : ""; *c; c++) {
+			hash ^= (unsigned char)*c;
+			hash *= 1099511628211ULL;
+		}
+
+		// Separator so that moving text between sources changes the hash
+		hash ^= 0xFF;
+		hash *= 1099511628211ULL;
+	};
+
+	for (const char* source : sources) {
+		add(source);
+	}
+
+	add((const char*)glGetString(GL_VENDOR));
+	add((const char*)glGetString(GL_RENDERER));
+	add((const char*)glGetString(GL_VERSION));
+
+	char name[17];
+	std::snprintf(name, sizeof(name), "%016llx", (unsigned long long)hash);
+
+	return name;
+}
+
+bool ShaderBase::loadCachedBinary(const std::string& key) {
+	if (key.empty()) {
+		return false;
+	}
+
+	std::ifstream file(binaryCacheDirectory + "/" + key + ".bin", std::ios::binary);
+	if (!file) {
+		return false;
+	}
+
+	char magic[4];
+	uint32_t version, format, length;
+	file.read(magic, sizeof(magic));
+	file.read((char*)&version, sizeof(version));
+	file.read((char*)&format, sizeof(format));
+	file.read((char*)&length, sizeof(length));
+
+	if (!file || std::memcmp(magic, binaryMagic, sizeof(magic)) != 0 || version != binaryFileVersion) {
+		return false;
+	}
+
+	// The length has to fit in what is left of the file before anything is allocated for it
+	std::streampos payloadStart = file.tellg();
+	file.seekg(0, std::ios::end);
+	std::streamoff remaining = file.tellg() - payloadStart;
+	file.seekg(payloadStart);
+
+	if (length == 0 || length > maxBinaryLength || std::streamoff(length) > remaining) {
+		return false;
+	}
+
+	std::vector<char> binary(length);
+	file.read(binary.data(), length);
+	if (!file) {
+		return false;
+	}
+
+	ID = glCreateProgram();
+	glProgramBinary(ID, format, binary.data(), length);
+
+	// The driver can reject a binary at any time (after an update for example)
+	int success = 0;
+	glGetProgramiv(ID, GL_LINK_STATUS, &success);
+	if (!success) {
+		glDeleteProgram(ID);
+		ID = 0;
+		return false;
+	}
+
+	return true;
+}
+
+void ShaderBase::storeCachedBinary(const std::string& key) {
+	if (key.empty()) {
+		return;
+	}
+
+	int success = 0;
+	glGetProgramiv(ID, GL_LINK_STATUS, &success);
+
+	int length = 0;
+	glGetProgramiv(ID, GL_PROGRAM_BINARY_LENGTH, &length);
+
+	if (!success || length <= 0) {
+		return;
+	}
+
+	std::vector<char> binary(length);
+	GLenum format = 0;
+	glGetProgramBinary(ID, length, &length, &format, binary.data());
+
+	// Written to a temporary file first so a crash never leaves half a binary behind
+	std::string path = binaryCacheDirectory + "/" + key + ".bin";
+	std::string tempPath = path + ".tmp";
+
+	{
+		std::ofstream file(tempPath, std::ios::binary | std::ios::trunc);
+		if (!file) {
+			return;
+		}
+
+		uint32_t version = binaryFileVersion;
+		uint32_t format32 = format;
+		uint32_t length32 = length;
+		file.write(binaryMagic, sizeof(binaryMagic));
+		file.write((const char*)&version, sizeof(version));
+		file.write((const char*)&format32, sizeof(format32));
+		file.write((const char*)&length32, sizeof(length32));
+		file.write(binary.data(), length);
+
+		if (!file) {
+			return;
+		}
+	}
+
+	std::remove(path.c_str());
+	std::rename(tempPath.c_str(), path.c_str());
+}
+
+void ShaderBase::recordStartupTime(bool cacheHit, std::chrono::steady_clock::time_point start) {
+	double milliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+	if (cacheHit) {
+		startupStats.cacheHits++;
+		startupStats.cacheHitMilliseconds += milliseconds;
+	}
+	else {
+		startupStats.compiled++;
+		startupStats.compileMilliseconds += milliseconds;
+	}
 }
 
 void ShaderBase::checkCompileErrors(unsigned int shader, std::string type) {
@@ -123,8 +395,10 @@ Shader::Shader(const GLchar* vertexPath, const GLchar* fragmentPath, const GLcha
 	const char* fShaderCode;
 	const char* gShaderCode;
 
+	// Declared out here so the code stays alive until it is compiled
+	std::string vertexCode, fragmentCode, geometryCode;
+
 	if (path) {
-		std::string vertexCode, fragmentCode, geometryCode;
 		std::ifstream vShaderFile, fShaderFile, gShaderFile;
 
 		vShaderFile.open(vertexPath);
@@ -154,6 +428,16 @@ Shader::Shader(const GLchar* vertexPath, const GLchar* fragmentPath, const GLcha
 		gShaderCode = geometryPath;
 	}
 
+	// Trying the binary cache before compiling anything
+	auto start = std::chrono::steady_clock::now();
+	std::string cacheKey = binaryCacheKey({ vShaderCode, fShaderCode, gShaderCode });
+
+	if (loadCachedBinary(cacheKey)) {
+		cacheUniformLocations();
+		recordStartupTime(true, start);
+		return;
+	}
+
 	// Compiling the shaders
 
 	unsigned int vertex, fragment, geometry;
@@ -179,20 +463,32 @@ Shader::Shader(const GLchar* vertexPath, const GLchar* fragmentPath, const GLcha
 	glAttachShader(ID, vertex);
 	glAttachShader(ID, fragment);
 	glAttachShader(ID, geometry);
+
+	// Only there from GL 4.1 on, and only needed when the binary is cached
+	if (!cacheKey.empty()) {
+		glProgramParameteri(ID, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+	}
+
 	glLinkProgram(ID);
 	checkCompileErrors(ID, "PROGRAM");
+	cacheUniformLocations();
 
 	glDeleteShader(vertex);
 	glDeleteShader(fragment);
 	glDeleteShader(geometry);
+
+	storeCachedBinary(cacheKey);
+	recordStartupTime(false, start);
 }
 
 Shader::Shader(const GLchar* vertexPath, const GLchar* fragmentPath, bool path) {
 	const char* vShaderCode;
 	const char* fShaderCode;
 
+	// Declared out here so the code stays alive until it is compiled
+	std::string vertexCode, fragmentCode;
+
 	if (path) {
-		std::string vertexCode, fragmentCode;
 		std::ifstream vShaderFile, fShaderFile;
 
 		vShaderFile.open(vertexPath);
@@ -216,6 +512,16 @@ Shader::Shader(const GLchar* vertexPath, const GLchar* fragmentPath, bool path)
 		fShaderCode = fragmentPath;
 	}
 
+	// Trying the binary cache before compiling anything
+	auto start = std::chrono::steady_clock::now();
+	std::string cacheKey = binaryCacheKey({ vShaderCode, fShaderCode });
+
+	if (loadCachedBinary(cacheKey)) {
+		cacheUniformLocations();
+		recordStartupTime(true, start);
+		return;
+	}
+
 	// Compiling the shaders
 
 	unsigned int vertex, fragment;
@@ -235,11 +541,21 @@ Shader::Shader(const GLchar* vertexPath, const GLchar* fragmentPath, bool path)
 	ID = glCreateProgram();
 	glAttachShader(ID, vertex);
 	glAttachShader(ID, fragment);
+
+	// Only there from GL 4.1 on, and only needed when the binary is cached
+	if (!cacheKey.empty()) {
+		glProgramParameteri(ID, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+	}
+
 	glLinkProgram(ID);
 	checkCompileErrors(ID, "PROGRAM");
+	cacheUniformLocations();
 
 	glDeleteShader(vertex);
 	glDeleteShader(fragment);
+
+	storeCachedBinary(cacheKey);
+	recordStartupTime(false, start);
 }
 
 ComputeShader::ComputeShader(const GLchar* path) {
@@ -268,6 +584,7 @@ ComputeShader::ComputeShader(const GLchar* path) {
 	glAttachShader(ID, shader);
 	glLinkProgram(ID);
 	checkCompileErrors(ID, "PROGRAM");
+	cacheUniformLocations();
 
 	glDeleteShader(shader);
 }
@@ -7,13 +7,41 @@
 #include <fstream>
 #include <sstream>
 #include <iostream>
+#include <unordered_map>
+#include <vector>
+#include <chrono>
+#include <cstring>
+#include <initializer_list>
 
 class ShaderBase {
 public:
 	unsigned int ID;
 
+	// How long building programs took, split into compiling from
+	// source and loading binaries from the cache
+	struct StartupStats {
+		int compiled;
+		int cacheHits;
+		double compileMilliseconds;
+		double cacheHitMilliseconds;
+	};
+
+	// Set and get the directory where linked programs are cached
+	// An empty string (the default) turns the cache off
+	static void setBinaryCacheDirectory(const std::string& directory);
+	static std::string getBinaryCacheDirectory();
+
+	// Returns the startup stats for every program built so far
+	static StartupStats getStartupStats();
+
 	void use();
 
+	// Returns the location of a uniform (looked up once when the program is linked)
+	int getUniformLocation(const std::string& name) const;
+
+	// Connects a uniform block in the program to a uniform buffer binding point
+	void bindUniformBlock(const std::string& name, unsigned int binding) const;
+
 	void setBool(const std::string& name, bool value) const;
 	void setInt(const std::string& name, int value) const;
 	void setFloat(const std::string& name, float value) const;
@@ -44,8 +72,40 @@ public:
 	void setMat3(const std::string& name, const glm::mat3& mat) const;
 	void setMat4(const std::string& name, const glm::mat4& mat) const;
 
+	// Same as above, but using a location from getUniformLocation()
+	void setBool(int location, bool value) const;
+	void setInt(int location, int value) const;
+	void setFloat(int location, float value) const;
+	void setUInt(int location, unsigned int value) const;
+
+	void setVec2(int location, const glm::vec2& value) const;
+	void setVec3(int location, const glm::vec3& value) const;
+	void setVec4(int location, const glm::vec4& value) const;
+
+	void setMat2(int location, const glm::mat2& mat) const;
+	void setMat3(int location, const glm::mat3& mat) const;
+	void setMat4(int location, const glm::mat4& mat) const;
+
 protected:
+	// Locations of all active uniforms, by name
+	std::unordered_map<std::string, int> uniformLocations;
+
 	void checkCompileErrors(unsigned int shader, std::string type);
+
+	// Fills uniformLocations (called after linking)
+	void cacheUniformLocations();
+
+	// Program binary cache
+	// The key is empty when the cache is off or the driver can't save binaries
+	static std::string binaryCacheKey(std::initializer_list<const char*> sources);
+	bool loadCachedBinary(const std::string& key);
+	void storeCachedBinary(const std::string& key);
+
+	static bool binaryCacheAvailable();
+	static void recordStartupTime(bool cacheHit, std::chrono::steady_clock::time_point start);
+
+	static std::string binaryCacheDirectory;
+	static StartupStats startupStats;
 };
 
 class Shader : public ShaderBase {
@@ -0,0 +1,267 @@
+#include "sharedMemoryRing.h"
+
+#ifdef DENSITYMAP_HAS_SHARED_MEMORY
+
+#include <cstring>
+#include <new>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace SharedMemoryRing;
+
+static_assert(sizeof(ControlBlock) == 256, "the control block is part of the shared memory format");
+static_assert(sizeof(ScanlineRecord) == 32, "the record header is part of the shared memory format");
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "the ring needs lock-free 64-bit atomics");
+
+namespace {
+	uint64_t padded(uint64_t size) {
+		return (size + 7) & ~uint64_t(7);
+	}
+
+	uint64_t recordSize(uint32_t numSamples) {
+		return padded(sizeof(ScanlineRecord) + numSamples);
+	}
+}
+
+SharedMemoryRingProducer::SharedMemoryRingProducer(const std::string& name, uint64_t capacity) {
+	this->name = name;
+	this->capacity = padded(capacity);
+
+	control = nullptr;
+	data = nullptr;
+	mappedSize = sizeof(ControlBlock) + this->capacity;
+	pendingHead = 0;
+	pendingSamples = 0;
+	droppedLines = 0;
+
+	// Anything left behind by a producer that crashed is replaced
+	shm_unlink(name.c_str());
+
+	int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+	if (fd < 0) {
+		return;
+	}
+
+	if (ftruncate(fd, mappedSize) != 0) {
+		close(fd);
+		shm_unlink(name.c_str());
+		return;
+	}
+
+	void* mapping = mmap(nullptr, mappedSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (mapping == MAP_FAILED) {
+		shm_unlink(name.c_str());
+		return;
+	}
+
+	control = new (mapping) ControlBlock();
+	control->version = version;
+	control->capacity = this->capacity;
+	control->head.store(0, std::memory_order_relaxed);
+	control->tail.store(0, std::memory_order_relaxed);
+
+	data = static_cast<unsigned char*>(mapping) + sizeof(ControlBlock);
+
+	// The magic goes in last, so a consumer never sees a half-made ring
+	std::atomic_thread_fence(std::memory_order_release);
+	std::memcpy(control->magic, magic, sizeof(magic));
+}
+
+SharedMemoryRingProducer::~SharedMemoryRingProducer() {
+	if (control != nullptr) {
+		munmap(control, mappedSize);
+		shm_unlink(name.c_str());
+	}
+}
+
+bool SharedMemoryRingProducer::isOpen() {
+	return control != nullptr;
+}
+
+bool SharedMemoryRingProducer::write(glm::vec3 p1, glm::vec3 p2, const unsigned char* samples, int numSamples, DensityMap::WriteMode writeMode) {
+	unsigned char* destination = beginLine(numSamples);
+	if (destination == nullptr) {
+		return false;
+	}
+
+	std::memcpy(destination, samples, numSamples);
+	commitLine(p1, p2, writeMode);
+
+	return true;
+}
+
+unsigned char* SharedMemoryRingProducer::beginLine(int numSamples) {
+	if (control == nullptr || numSamples < 0) {
+		return nullptr;
+	}
+
+	uint64_t size = recordSize(numSamples);
+	if (size > capacity) {
+		droppedLines++;
+		return nullptr;
+	}
+
+	uint64_t head = control->head.load(std::memory_order_relaxed);
+	uint64_t tail = control->tail.load(std::memory_order_acquire);
+
+	// A record that would cross the end of the data starts again at the beginning
+	uint64_t offset = head % capacity;
+	uint64_t skip = capacity - offset < size ? capacity - offset : 0;
+
+	if (head + skip + size - tail > capacity) {
+		droppedLines++;
+		return nullptr;
+	}
+
+	if (skip > 0) {
+		ScanlineRecord* marker = reinterpret_cast<ScanlineRecord*>(data + offset);
+		marker->numSamples = wrapMarker;
+		head += skip;
+	}
+
+	pendingHead = head;
+	pendingSamples = numSamples;
+
+	return data + head % capacity + sizeof(ScanlineRecord);
+}
+
+void SharedMemoryRingProducer::commitLine(glm::vec3 p1, glm::vec3 p2, DensityMap::WriteMode writeMode) {
+	ScanlineRecord* record = reinterpret_cast<ScanlineRecord*>(data + pendingHead % capacity);
+	record->numSamples = pendingSamples;
+	record->writeMode = static_cast<uint8_t>(writeMode);
+	record->p1[0] = p1.x;
+	record->p1[1] = p1.y;
+	record->p1[2] = p1.z;
+	record->p2[0] = p2.x;
+	record->p2[1] = p2.y;
+	record->p2[2] = p2.z;
+
+	// Publishing the record (and the wrap marker before it, if there is one)
+	control->head.store(pendingHead + recordSize(pendingSamples), std::memory_order_release);
+}
+
+unsigned long long SharedMemoryRingProducer::getDroppedLines() {
+	return droppedLines;
+}
+
+SharedMemoryRingConsumer::SharedMemoryRingConsumer(const std::string& name) {
+	control = nullptr;
+	data = nullptr;
+	capacity = 0;
+	mappedSize = 0;
+	corrupt = false;
+
+	int fd = shm_open(name.c_str(), O_RDWR, 0);
+	if (fd < 0) {
+		return;
+	}
+
+	struct stat info;
+	if (fstat(fd, &info) != 0 || info.st_size < (off_t)sizeof(ControlBlock)) {
+		close(fd);
+		return;
+	}
+
+	void* mapping = mmap(nullptr, info.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (mapping == MAP_FAILED) {
+		return;
+	}
+
+	ControlBlock* block = static_cast<ControlBlock*>(mapping);
+	std::atomic_thread_fence(std::memory_order_acquire);
+
+	if (std::memcmp(block->magic, magic, sizeof(magic)) != 0 || block->version != version || sizeof(ControlBlock) + block->capacity > (uint64_t)info.st_size ||
+		block->capacity == 0 || block->capacity != padded(block->capacity)) {
+		munmap(mapping, info.st_size);
+		return;
+	}
+
+	control = block;
+	data = static_cast<const unsigned char*>(mapping) + sizeof(ControlBlock);
+	capacity = block->capacity;
+	mappedSize = info.st_size;
+}
+
+SharedMemoryRingConsumer::~SharedMemoryRingConsumer() {
+	if (control != nullptr) {
+		munmap(control, mappedSize);
+	}
+}
+
+bool SharedMemoryRingConsumer::isOpen() {
+	return control != nullptr && !corrupt;
+}
+
+int SharedMemoryRingConsumer::consume(DensityMap& map, int maxLines) {
+	if (control == nullptr || corrupt) {
+		return 0;
+	}
+
+	uint64_t head = control->head.load(std::memory_order_acquire);
+	uint64_t tail = control->tail.load(std::memory_order_relaxed);
+
+	// The producer can't touch anything between tail and head until tail moves,
+	// so the views can point straight into the ring
+	views.clear();
+
+	// Everything is checked before it is read, as the other process can write anything to the ring
+	// (the offsets are multiples of 8, so there is always room for numSamples)
+	corrupt = head - tail > capacity || tail != padded(tail);
+
+	while (!corrupt && tail != head && static_cast<int>(views.size()) < maxLines) {
+		uint64_t offset = tail % capacity;
+		const ScanlineRecord* record = reinterpret_cast<const ScanlineRecord*>(data + offset);
+		uint32_t numSamples = record->numSamples;
+
+		if (numSamples == wrapMarker) {
+			if (capacity - offset > head - tail) {
+				corrupt = true;
+				break;
+			}
+
+			tail += capacity - offset;
+			continue;
+		}
+
+		uint64_t size = recordSize(numSamples);
+		uint8_t writeMode = record->writeMode;
+		if (size > capacity - offset || size > head - tail || writeMode > maxWriteMode) {
+			corrupt = true;
+			break;
+		}
+
+		DensityMap::ScanlineView view;
+		view.p1 = glm::vec3(record->p1[0], record->p1[1], record->p1[2]);
+		view.p2 = glm::vec3(record->p2[0], record->p2[1], record->p2[2]);
+		view.samples = data + offset + sizeof(ScanlineRecord);
+		view.numSamples = numSamples;
+		view.writeMode = static_cast<DensityMap::WriteMode>(writeMode);
+		views.push_back(view);
+
+		tail += size;
+	}
+
+	map.integrateLines(views.data(), views.size());
+
+	// Handing the space back to the producer
+	control->tail.store(tail, std::memory_order_release);
+
+	return views.size();
+}
+
+uint64_t SharedMemoryRingConsumer::getBytesWaiting() {
+	if (control == nullptr) {
+		return 0;
+	}
+
+	return control->head.load(std::memory_order_acquire) - control->tail.load(std::memory_order_relaxed);
+}
+
+#endif
@@ -0,0 +1,133 @@
+#pragma once
+
+#if defined(__unix__) || defined(__APPLE__)
+#define DENSITYMAP_HAS_SHARED_MEMORY
+
+#include <glm/glm.hpp>
+
+#include "densityMap.h"
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Single-producer single-consumer ring of scanlines in POSIX shared memory,
+// so an acquisition process can feed a DensityMap in another process
+// The consumer hands the samples to DensityMap::integrateLines() straight out
+// of shared memory, without copying them
+//
+// Layout of the shared memory object:
+//   Control block (256 bytes): magic "DMSR", version, capacity,
+//   head (bytes ever written, on its own cache line), tail (bytes ever read, on its own cache line)
+//   Data (capacity bytes) holding records, each padded to a multiple of 8 bytes:
+//     ScanlineRecord, then numSamples samples
+//   A record never wraps around the end of the data. If it doesn't fit, the producer
+//   writes a record with numSamples = wrapMarker and starts again at the beginning
+namespace SharedMemoryRing {
+	struct ScanlineRecord {
+		uint32_t numSamples;
+		uint8_t writeMode;
+		uint8_t reserved[3];
+		float p1[3];
+		float p2[3];
+	};
+
+	struct ControlBlock {
+		char magic[4];
+		uint32_t version;
+		uint64_t capacity;
+
+		alignas(64) std::atomic<uint64_t> head;
+		alignas(64) std::atomic<uint64_t> tail;
+
+		char padding[64];
+	};
+
+	static const char magic[4] = { 'D', 'M', 'S', 'R' };
+	static const uint32_t version = 1;
+	static const uint32_t wrapMarker = 0xFFFFFFFF;
+
+	// Largest writeMode a record may have (the last DensityMap::WriteMode)
+	static const uint8_t maxWriteMode = static_cast<uint8_t>(DensityMap::WriteMode::Compound);
+}
+
+// Writing side (the acquisition process)
+// Creates the shared memory object and removes it again when destroyed
+class SharedMemoryRingProducer {
+public:
+	// Constructor (name is a POSIX shared memory name such as "/densitymap")
+	SharedMemoryRingProducer(const std::string& name, uint64_t capacity = 64 << 20);
+	~SharedMemoryRingProducer();
+
+	SharedMemoryRingProducer(const SharedMemoryRingProducer&) = delete;
+	SharedMemoryRingProducer& operator=(const SharedMemoryRingProducer&) = delete;
+
+	// Returns false if the shared memory couldn't be created
+	bool isOpen();
+
+	// Copies a line into the ring
+	// Returns false (and writes nothing) if the consumer hasn't made enough room yet
+	bool write(glm::vec3 p1, glm::vec3 p2, const unsigned char* samples, int numSamples, DensityMap::WriteMode writeMode);
+
+	// Same as write(), but lets the samples be produced directly in shared memory:
+	// beginLine() returns where to put numSamples samples (nullptr if the ring is full)
+	// and commitLine() publishes them
+	unsigned char* beginLine(int numSamples);
+	void commitLine(glm::vec3 p1, glm::vec3 p2, DensityMap::WriteMode writeMode);
+
+	// Returns the number of times write() or beginLine() found the ring full
+	unsigned long long getDroppedLines();
+
+private:
+	std::string name;
+
+	SharedMemoryRing::ControlBlock* control;
+	unsigned char* data;
+	uint64_t capacity;
+	size_t mappedSize;
+
+	// Where the line started by beginLine() goes and how big it is
+	uint64_t pendingHead;
+	uint32_t pendingSamples;
+
+	unsigned long long droppedLines;
+};
+
+// Reading side (the process with the DensityMap)
+class SharedMemoryRingConsumer {
+public:
+	// Constructor (opens a ring made by a SharedMemoryRingProducer)
+	SharedMemoryRingConsumer(const std::string& name);
+	~SharedMemoryRingConsumer();
+
+	SharedMemoryRingConsumer(const SharedMemoryRingConsumer&) = delete;
+	SharedMemoryRingConsumer& operator=(const SharedMemoryRingConsumer&) = delete;
+
+	// Returns false if the ring doesn't exist or isn't compatible
+	// (or once consume() found something in it that no producer writes)
+	bool isOpen();
+
+	// Integrates up to maxLines waiting lines into map and returns how many there were
+	// The records are checked against the ring before they are read, and a ring with a record
+	// that doesn't fit, an unknown write mode or a head that isn't where records end is
+	// left alone from then on (the lines before the bad record are still integrated)
+	int consume(DensityMap& map, int maxLines = 4096);
+
+	// Returns the number of bytes written but not consumed yet
+	uint64_t getBytesWaiting();
+
+private:
+	SharedMemoryRing::ControlBlock* control;
+	const unsigned char* data;
+	uint64_t capacity;
+	size_t mappedSize;
+
+	// Set once the ring held something that no producer writes
+	bool corrupt;
+
+	// Views of the lines being integrated (kept to avoid reallocating)
+	std::vector<DensityMap::ScanlineView> views;
+};
+
+#endif
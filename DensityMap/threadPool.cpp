@@ -0,0 +1,117 @@
+#include "threadPool.h"
+
+ThreadPool::ThreadPool(unsigned int numThreads) {
+	if (numThreads == 0) {
+		numThreads = std::thread::hardware_concurrency();
+	}
+
+	if (numThreads == 0) {
+		numThreads = 1;
+	}
+
+	job = nullptr;
+	jobEnd = 0;
+	nextIndex = 0;
+	jobGeneration = 0;
+	busyWorkers = 0;
+	stopping = false;
+
+	// The thread calling parallelFor() counts as one of the threads
+	for (unsigned int i = 1; i < numThreads; i++) {
+		workers.push_back(std::thread(&ThreadPool::workerLoop, this));
+	}
+}
+
+ThreadPool::~ThreadPool() {
+	{
+		std::lock_guard<std::mutex> lock(jobMutex);
+		stopping = true;
+	}
+
+	jobStarted.notify_all();
+
+	for (std::thread& worker : workers) {
+		worker.join();
+	}
+}
+
+void ThreadPool::parallelFor(int begin, int end, const std::function<void(int)>& fn) {
+	if (end <= begin) {
+		return;
+	}
+
+	// Not worth waking anyone up for a single index
+	if (workers.empty() || end - begin == 1) {
+		for (int i = begin; i < end; i++) {
+			fn(i);
+		}
+
+		return;
+	}
+
+	std::lock_guard<std::mutex> callLock(callMutex);
+
+	{
+		std::lock_guard<std::mutex> lock(jobMutex);
+		job = &fn;
+		jobEnd = end;
+		nextIndex = begin;
+		busyWorkers = workers.size();
+		jobGeneration++;
+	}
+
+	jobStarted.notify_all();
+
+	runJob();
+
+	// Waits until every worker has let go of the job
+	std::unique_lock<std::mutex> lock(jobMutex);
+	jobFinished.wait(lock, [this] { return busyWorkers == 0; });
+	job = nullptr;
+}
+
+int ThreadPool::getNumThreads() {
+	return workers.size() + 1;
+}
+
+ThreadPool& ThreadPool::global() {
+	static ThreadPool pool;
+	return pool;
+}
+
+void ThreadPool::workerLoop() {
+	unsigned long long seenGeneration = 0;
+
+	while (true) {
+		{
+			std::unique_lock<std::mutex> lock(jobMutex);
+			jobStarted.wait(lock, [&] { return stopping || jobGeneration != seenGeneration; });
+
+			if (stopping) {
+				return;
+			}
+
+			seenGeneration = jobGeneration;
+		}
+
+		runJob();
+
+		{
+			std::lock_guard<std::mutex> lock(jobMutex);
+			busyWorkers--;
+		}
+
+		jobFinished.notify_one();
+	}
+}
+
+void ThreadPool::runJob() {
+	while (true) {
+		int i = nextIndex.fetch_add(1);
+		if (i >= jobEnd) {
+			break;
+		}
+
+		(*job)(i);
+	}
+}
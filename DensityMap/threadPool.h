@@ -0,0 +1,55 @@
+#pragma once
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+
+// Small fixed-size pool of worker threads used by the
+// volume kernels (filtering, resampling, compression...)
+class ThreadPool {
+public:
+	// Constructor (0 threads means one per hardware thread)
+	ThreadPool(unsigned int numThreads = 0);
+	~ThreadPool();
+
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	// Calls fn(i) for every i in [begin, end) spread over all threads
+	// The calling thread helps out and the call returns when every index is done
+	void parallelFor(int begin, int end, const std::function<void(int)>& fn);
+
+	// Returns the number of threads that work on a parallelFor() (including the caller)
+	int getNumThreads();
+
+	// Pool shared by the whole program
+	static ThreadPool& global();
+
+private:
+	std::vector<std::thread> workers;
+
+	std::mutex jobMutex;
+	std::condition_variable jobStarted;
+	std::condition_variable jobFinished;
+
+	// Only one parallelFor() runs at a time
+	std::mutex callMutex;
+
+	// The job that is currently running
+	const std::function<void(int)>* job;
+	int jobEnd;
+	std::atomic<int> nextIndex;
+	unsigned long long jobGeneration;
+	int busyWorkers;
+
+	bool stopping;
+
+	// Loop run by every worker thread
+	void workerLoop();
+
+	// Takes indices from nextIndex until the job runs out
+	void runJob();
+};
@@ -0,0 +1,184 @@
+#include "trace.h"
+
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace {
+	struct Span {
+		const char* name;
+		long long int start;
+		long long int end;
+	};
+
+	// Single-producer single-consumer ring of spans
+	// The owning thread moves head and flush() moves tail
+	struct ThreadRing {
+		static const unsigned int capacity = 1 << 15;
+
+		Span spans[capacity];
+		std::atomic<unsigned long long> head;
+		std::atomic<unsigned long long> tail;
+		std::atomic<unsigned long long> dropped;
+
+		// Only touched with registryMutex locked
+		int id;
+		std::string name;
+		bool nameWritten;
+
+		ThreadRing(int id) : head(0), tail(0), dropped(0) {
+			this->id = id;
+			nameWritten = false;
+		}
+	};
+
+	// Every ring ever created (they outlive their threads so nothing is lost)
+	std::mutex registryMutex;
+	std::vector<std::shared_ptr<ThreadRing>> rings;
+
+	// Output file and where time 0 is
+	FILE* file = nullptr;
+	bool firstEvent = true;
+	Trace::Clock::time_point epoch;
+
+	ThreadRing& threadRing() {
+		thread_local std::shared_ptr<ThreadRing> ring;
+
+		if (!ring) {
+			std::lock_guard<std::mutex> lock(registryMutex);
+			ring = std::make_shared<ThreadRing>(static_cast<int>(rings.size()) + 1);
+			rings.push_back(ring);
+		}
+
+		return *ring;
+	}
+
+	void writeEventSeparator() {
+		std::fputs(firstEvent ? "\n" : ",\n", file);
+		firstEvent = false;
+	}
+
+	// Writes the spans waiting in a ring (registryMutex must be locked)
+	void drain(ThreadRing& ring) {
+		if (!ring.nameWritten && !ring.name.empty()) {
+			writeEventSeparator();
+			std::fprintf(file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}", ring.id, ring.name.c_str());
+			ring.nameWritten = true;
+		}
+
+		unsigned long long head = ring.head.load(std::memory_order_acquire);
+		unsigned long long tail = ring.tail.load(std::memory_order_relaxed);
+
+		long long int zero = epoch.time_since_epoch().count();
+		double toMicroseconds = 1e6 * Trace::Clock::period::num / Trace::Clock::period::den;
+
+		for (; tail != head; tail++) {
+			const Span& span = ring.spans[tail % ThreadRing::capacity];
+
+			writeEventSeparator();
+			std::fprintf(file, "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+				span.name, ring.id, (span.start - zero) * toMicroseconds, (span.end - span.start) * toMicroseconds);
+		}
+
+		ring.tail.store(tail, std::memory_order_release);
+	}
+}
+
+std::atomic<bool> Trace::recording(false);
+
+bool Trace::begin(const std::string& path) {
+	std::lock_guard<std::mutex> lock(registryMutex);
+
+	if (file != nullptr) {
+		return false;
+	}
+
+	file = std::fopen(path.c_str(), "w");
+	if (file == nullptr) {
+		return false;
+	}
+
+	std::fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[", file);
+	firstEvent = true;
+	epoch = Clock::now();
+
+	// Spans left over from an earlier trace are thrown away
+	for (const std::shared_ptr<ThreadRing>& ring : rings) {
+		ring->tail.store(ring->head.load(std::memory_order_acquire), std::memory_order_release);
+		ring->nameWritten = false;
+	}
+
+	recording.store(true, std::memory_order_relaxed);
+
+	return true;
+}
+
+void Trace::flush() {
+	std::lock_guard<std::mutex> lock(registryMutex);
+
+	if (file == nullptr) {
+		return;
+	}
+
+	for (const std::shared_ptr<ThreadRing>& ring : rings) {
+		drain(*ring);
+	}
+
+	std::fflush(file);
+}
+
+void Trace::end() {
+	recording.store(false, std::memory_order_relaxed);
+
+	std::lock_guard<std::mutex> lock(registryMutex);
+
+	if (file == nullptr) {
+		return;
+	}
+
+	for (const std::shared_ptr<ThreadRing>& ring : rings) {
+		drain(*ring);
+	}
+
+	std::fputs("\n]}\n", file);
+	std::fclose(file);
+	file = nullptr;
+}
+
+void Trace::setThreadName(const std::string& name) {
+	ThreadRing& ring = threadRing();
+
+	std::lock_guard<std::mutex> lock(registryMutex);
+	ring.name = name;
+	ring.nameWritten = false;
+}
+
+unsigned long long Trace::getDroppedSpans() {
+	std::lock_guard<std::mutex> lock(registryMutex);
+
+	unsigned long long dropped = 0;
+	for (const std::shared_ptr<ThreadRing>& ring : rings) {
+		dropped += ring->dropped.load(std::memory_order_relaxed);
+	}
+
+	return dropped;
+}
+
+void Trace::record(const char* name, Clock::time_point start, Clock::time_point end) {
+	ThreadRing& ring = threadRing();
+
+	unsigned long long head = ring.head.load(std::memory_order_relaxed);
+
+	if (head - ring.tail.load(std::memory_order_acquire) >= ThreadRing::capacity) {
+		ring.dropped.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+
+	Span& span = ring.spans[head % ThreadRing::capacity];
+	span.name = name;
+	span.start = start.time_since_epoch().count();
+	span.end = end.time_since_epoch().count();
+
+	ring.head.store(head + 1, std::memory_order_release);
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <string>
+
+// Records timed spans from any thread and writes them as Chrome trace events
+// (open the file in chrome://tracing or ui.perfetto.dev)
+//
+// Spans are marked with TRACE_SCOPE("name"), which compiles to nothing unless
+// DENSITYMAP_ENABLE_TRACING is defined (the CMake option of the same name)
+// Each thread writes into its own fixed-size ring that only flush() reads,
+// so recording a span never takes a lock. When a ring is full, spans are dropped
+// until the next flush()
+class Trace {
+public:
+	typedef std::chrono::steady_clock Clock;
+
+	// Starts recording into a file (returns false if it can't be created)
+	static bool begin(const std::string& path);
+
+	// Writes everything recorded so far to the file
+	// Call this regularly (e.g. once a second) so the rings don't fill up
+	static void flush();
+
+	// Flushes, finishes the file and stops recording
+	static void end();
+
+	// Returns true between begin() and end()
+	static bool isRecording() {
+		return recording.load(std::memory_order_relaxed);
+	}
+
+	// Names the calling thread in the trace
+	static void setThreadName(const std::string& name);
+
+	// Returns the number of spans dropped because a ring was full
+	static unsigned long long getDroppedSpans();
+
+	// Adds a finished span (name must be a string literal or otherwise outlive the trace)
+	static void record(const char* name, Clock::time_point start, Clock::time_point end);
+
+	// Records a span from construction to destruction
+	class Scope {
+	public:
+		Scope(const char* name) {
+			this->name = name;
+			active = isRecording();
+
+			if (active) {
+				start = Clock::now();
+			}
+		}
+
+		~Scope() {
+			if (active) {
+				record(name, start, Clock::now());
+			}
+		}
+
+		Scope(const Scope&) = delete;
+		Scope& operator=(const Scope&) = delete;
+
+	private:
+		const char* name;
+		bool active;
+		Clock::time_point start;
+	};
+
+private:
+	static std::atomic<bool> recording;
+};
+
+#define TRACE_CONCAT_INNER(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_INNER(a, b)
+
+#ifdef DENSITYMAP_ENABLE_TRACING
+#define TRACE_SCOPE(name) Trace::Scope TRACE_CONCAT(traceScope, __LINE__)(name)
+#else
+#define TRACE_SCOPE(name) ((void)0)
+#endif
@@ -0,0 +1,138 @@
+#include "uploadRing.h"
+
+#include <cstring>
+
+UploadRing::UploadRing(long long int segmentSize) {
+	this->segmentSize = segmentSize;
+
+	segment = 0;
+	used = 0;
+	mapped = nullptr;
+	persistentMapping = nullptr;
+
+	for (int i = 0; i < numSegments; i++) {
+		fences[i] = 0;
+	}
+
+	persistent = GLAD_GL_VERSION_4_4;
+
+	glGenBuffers(1, &stagingBuffer);
+	glBindBuffer(GL_COPY_READ_BUFFER, stagingBuffer);
+
+	if (persistent) {
+		// One buffer holds all of the segments and stays mapped forever
+		GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+		glBufferStorage(GL_COPY_READ_BUFFER, numSegments * segmentSize, NULL, flags);
+		persistentMapping = (unsigned char*)glMapBufferRange(GL_COPY_READ_BUFFER, 0, numSegments * segmentSize, flags);
+	}
+	else {
+		glBufferData(GL_COPY_READ_BUFFER, segmentSize, NULL, GL_STREAM_DRAW);
+	}
+
+	glBindBuffer(GL_COPY_READ_BUFFER, 0);
+}
+
+UploadRing::~UploadRing() {
+	for (int i = 0; i < numSegments; i++) {
+		if (fences[i]) {
+			glDeleteSync(fences[i]);
+		}
+	}
+
+	if (persistent) {
+		glBindBuffer(GL_COPY_READ_BUFFER, stagingBuffer);
+		glUnmapBuffer(GL_COPY_READ_BUFFER);
+		glBindBuffer(GL_COPY_READ_BUFFER, 0);
+	}
+
+	glDeleteBuffers(1, &stagingBuffer);
+}
+
+void UploadRing::beginFrame() {
+	used = 0;
+	copies.clear();
+
+	if (persistent) {
+		segment = (segment + 1) % numSegments;
+
+		// The segment was last used three frames ago, so this almost never waits
+		if (fences[segment]) {
+			while (glClientWaitSync(fences[segment], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000) == GL_TIMEOUT_EXPIRED) {
+			}
+
+			glDeleteSync(fences[segment]);
+			fences[segment] = 0;
+		}
+
+		mapped = persistentMapping + segment * segmentSize;
+	}
+	else {
+		// Orphaning gives us fresh memory while the driver keeps the old
+		// storage alive until the graphics card is done with it
+		glBindBuffer(GL_COPY_READ_BUFFER, stagingBuffer);
+		glBufferData(GL_COPY_READ_BUFFER, segmentSize, NULL, GL_STREAM_DRAW);
+		mapped = (unsigned char*)glMapBufferRange(GL_COPY_READ_BUFFER, 0, segmentSize, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+		glBindBuffer(GL_COPY_READ_BUFFER, 0);
+	}
+}
+
+bool UploadRing::upload(const unsigned char* data, long long int size, unsigned int targetBuffer, long long int targetOffset) {
+	if (mapped == nullptr || used + size > segmentSize) {
+		return false;
+	}
+
+	std::memcpy(mapped + used, data, size);
+
+	long long int sourceOffset = (persistent ? segment * segmentSize : 0) + used;
+
+	// Neighbouring pieces of data are merged into a single copy
+	if (!copies.empty()) {
+		Copy& last = copies.back();
+
+		if (last.targetBuffer == targetBuffer && last.sourceOffset + last.size == sourceOffset && last.targetOffset + last.size == targetOffset) {
+			last.size += size;
+			used += size;
+			return true;
+		}
+	}
+
+	copies.push_back({ targetBuffer, sourceOffset, targetOffset, size });
+	used += size;
+
+	return true;
+}
+
+void UploadRing::endFrame() {
+	glBindBuffer(GL_COPY_READ_BUFFER, stagingBuffer);
+
+	if (!persistent) {
+		glUnmapBuffer(GL_COPY_READ_BUFFER);
+	}
+
+	mapped = nullptr;
+
+	for (const Copy& copy : copies) {
+		glBindBuffer(GL_COPY_WRITE_BUFFER, copy.targetBuffer);
+		glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, copy.sourceOffset, copy.targetOffset, copy.size);
+	}
+
+	glBindBuffer(GL_COPY_READ_BUFFER, 0);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+
+	// The segment can be written again once the graphics card has done these copies
+	if (persistent && !copies.empty()) {
+		fences[segment] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	}
+}
+
+long long int UploadRing::getSpaceLeft() {
+	return mapped == nullptr ? 0 : segmentSize - used;
+}
+
+long long int UploadRing::getBytesUploaded() {
+	return used;
+}
+
+bool UploadRing::isPersistent() {
+	return persistent;
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <glad/glad.h>
+
+#include <vector>
+
+// Streams data from the CPU into buffers on the graphics card
+// Data is written into one of three staging segments and then copied
+// on the graphics card, so the CPU never waits for a buffer that is
+// still being drawn from. Each segment is guarded by a fence.
+// On OpenGL 4.4+ the staging buffer is persistently mapped, and on
+// older versions it is orphaned and mapped again every frame
+class UploadRing {
+public:
+	// Constructor (segmentSize is the most that can be uploaded in one frame)
+	UploadRing(long long int segmentSize);
+	~UploadRing();
+
+	UploadRing(const UploadRing&) = delete;
+	UploadRing& operator=(const UploadRing&) = delete;
+
+	// Moves to the next segment, waiting for the graphics card to finish with it if needed
+	void beginFrame();
+
+	// Queues size bytes of data to be copied to targetOffset in targetBuffer
+	// Returns false (and copies nothing) if there isn't enough room left this frame
+	bool upload(const unsigned char* data, long long int size, unsigned int targetBuffer, long long int targetOffset);
+
+	// Issues the copies queued since beginFrame()
+	void endFrame();
+
+	// Returns the number of bytes that can still be uploaded this frame
+	long long int getSpaceLeft();
+
+	// Returns the number of bytes queued since beginFrame()
+	long long int getBytesUploaded();
+
+	// Returns true if persistent mapping is being used
+	bool isPersistent();
+
+private:
+	static const int numSegments = 3;
+
+	struct Copy {
+		unsigned int targetBuffer;
+		long long int sourceOffset;
+		long long int targetOffset;
+		long long int size;
+	};
+
+	bool persistent;
+
+	long long int segmentSize;
+
+	// Index of the segment being written and how much of it is used
+	int segment;
+	long long int used;
+
+	unsigned int stagingBuffer;
+
+	// Start of the current segment in CPU memory
+	unsigned char* mapped;
+
+	// Persistent mapping of the whole staging buffer
+	unsigned char* persistentMapping;
+
+	GLsync fences[numSegments];
+
+	// Copies waiting for endFrame()
+	std::vector<Copy> copies;
+};
@@ -0,0 +1,418 @@
+#include "volumeFilter.h"
+#include "threadPool.h"
+#include "volumeKernels.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+
+// Largest radius allowed (a brick only waits for its direct neighbours
+// before being written back, so the radius can't exceed the brick size)
+static const int maxRadius = 16;
+
+// Min and max for the median sorting network, one overload per vector width
+static inline unsigned char vmin(unsigned char a, unsigned char b) { return a < b ? a : b; }
+static inline unsigned char vmax(unsigned char a, unsigned char b) { return a < b ? b : a; }
+
+#if defined(__SSE2__) || defined(_M_X64)
+static inline __m128i vmin(__m128i a, __m128i b) { return _mm_min_epu8(a, b); }
+static inline __m128i vmax(__m128i a, __m128i b) { return _mm_max_epu8(a, b); }
+#endif
+
+#ifdef __AVX2__
+static inline __m256i vmin(__m256i a, __m256i b) { return _mm256_min_epu8(a, b); }
+static inline __m256i vmax(__m256i a, __m256i b) { return _mm256_max_epu8(a, b); }
+#endif
+
+// Compare-exchange: a ends up with the smaller value and b with the larger one
+template <class V>
+static inline void cmpx(V& a, V& b) {
+	V t = vmin(a, b);
+	b = vmax(a, b);
+	a = t;
+}
+
+// Median of 27 values using forgetful selection
+// Out of any 15 values, the smallest and largest can't be the median of 27,
+// so they are dropped and the next value takes their place until 3 remain
+template <class V>
+static inline V median27(const V* v) {
+	V s[15];
+	for (int i = 0; i < 15; i++) {
+		s[i] = v[i];
+	}
+
+	int n = 15;
+	int next = 15;
+
+	while (true) {
+		// Moves the minimum to s[0] and the maximum to s[n - 1]
+		for (int i = 1; i < n; i++) {
+			cmpx(s[0], s[i]);
+		}
+
+		for (int i = 1; i < n - 1; i++) {
+			cmpx(s[i], s[n - 1]);
+		}
+
+		if (next == 27) {
+			return s[1];
+		}
+
+		s[0] = v[next];
+		next++;
+		n--;
+	}
+}
+
+// ------------------
+// Brick helpers
+
+static inline int clampIndex(int i, int dim) {
+	return i < 0 ? 0 : (i >= dim ? dim - 1 : i);
+}
+
+// Copies the cells in [origin - r, origin + size + r) into dst, converted to T
+// Cells outside the volume repeat the closest cell on the border
+template <class T>
+static void loadRegion(const unsigned char* cells, int dim, glm::ivec3 origin, glm::ivec3 size, int r, T* dst) {
+	glm::ivec3 rs = size + 2 * r;
+
+	for (int x = 0; x < rs.x; x++) {
+		long long cx = clampIndex(origin.x - r + x, dim);
+
+		for (int y = 0; y < rs.y; y++) {
+			long long cy = clampIndex(origin.y - r + y, dim);
+
+			const unsigned char* src = cells + (cx * dim + cy) * dim;
+			T* row = dst + (x * rs.y + y) * rs.z;
+
+			for (int z = 0; z < rs.z; z++) {
+				row[z] = src[clampIndex(origin.z - r + z, dim)];
+			}
+		}
+	}
+}
+
+// Scratch space for each thread so bricks never allocate
+static thread_local std::vector<float> scratchA;
+static thread_local std::vector<float> scratchB;
+static thread_local std::vector<unsigned char> scratchBytes;
+
+// ------------------
+// VolumeFilter
+
+VolumeFilter::VolumeFilter(Type type, float size) {
+	this->type = type;
+
+	switch (type) {
+	case Type::Gaussian: {
+		float sigma = std::max(size, 0.01f);
+		radius = std::min(maxRadius, std::max(1, int(std::ceil(3 * sigma))));
+
+		float sum = 0;
+		for (int i = -radius; i <= radius; i++) {
+			float w = std::exp(-(i * i) / (2 * sigma * sigma));
+			weights.push_back(w);
+			sum += w;
+		}
+
+		for (float& w : weights) {
+			w /= sum;
+		}
+
+		break;
+	}
+	case Type::Box:
+		radius = std::min(maxRadius, std::max(1, int(size + 0.5f)));
+		break;
+	case Type::Median:
+		radius = 1;
+		break;
+	}
+}
+
+int VolumeFilter::getRadius() const {
+	return radius;
+}
+
+VolumeFilter::Type VolumeFilter::getType() const {
+	return type;
+}
+
+void VolumeFilter::apply(unsigned char* cells, int dim, int brickSize) const {
+	int bricksPerSide = (dim + brickSize - 1) / brickSize;
+	int slabBricks = bricksPerSide * bricksPerSide;
+	int brickVolume = brickSize * brickSize * brickSize;
+
+	// The volume is filtered one slab of bricks (along x) at a time
+	// A slab can only be written back once the next slab has been
+	// filtered, since the next slab reads the original cells in its halo
+	std::vector<unsigned char> slabs[2];
+	slabs[0].resize(size_t(slabBricks) * brickVolume);
+	slabs[1].resize(size_t(slabBricks) * brickVolume);
+
+	for (int bx = 0; bx <= bricksPerSide; bx++) {
+		if (bx < bricksPerSide) {
+			unsigned char* slab = slabs[bx % 2].data();
+
+			ThreadPool::global().parallelFor(0, slabBricks, [&](int i) {
+				glm::ivec3 brick(bx, i / bricksPerSide, i % bricksPerSide);
+				filterBrick(cells, dim, brickSize, brick, slab + size_t(i) * brickVolume);
+			});
+		}
+
+		if (bx > 0) {
+			const unsigned char* slab = slabs[(bx - 1) % 2].data();
+
+			ThreadPool::global().parallelFor(0, slabBricks, [&](int i) {
+				glm::ivec3 brick(bx - 1, i / bricksPerSide, i % bricksPerSide);
+				storeBrick(cells, dim, brickSize, brick, slab + size_t(i) * brickVolume);
+			});
+		}
+	}
+}
+
+void VolumeFilter::applyToBricks(unsigned char* cells, int dim, int brickSize, const std::vector<glm::ivec3>& bricks) const {
+	int brickVolume = brickSize * brickSize * brickSize;
+
+	// Every brick is filtered before any is written back so that
+	// bricks next to each other see each other's original cells
+	std::vector<unsigned char> filtered(bricks.size() * brickVolume);
+
+	ThreadPool::global().parallelFor(0, bricks.size(), [&](int i) {
+		filterBrick(cells, dim, brickSize, bricks[i], filtered.data() + size_t(i) * brickVolume);
+	});
+
+	ThreadPool::global().parallelFor(0, bricks.size(), [&](int i) {
+		storeBrick(cells, dim, brickSize, bricks[i], filtered.data() + size_t(i) * brickVolume);
+	});
+}
+
+void VolumeFilter::filterBrick(const unsigned char* cells, int dim, int brickSize, glm::ivec3 brick, unsigned char* out) const {
+	glm::ivec3 origin = brick * brickSize;
+	glm::ivec3 size = glm::min(glm::ivec3(brickSize), glm::ivec3(dim) - origin);
+
+	switch (type) {
+	case Type::Gaussian:
+		gaussianBrick(cells, dim, origin, size, out);
+		break;
+	case Type::Box:
+		boxBrick(cells, dim, origin, size, out);
+		break;
+	case Type::Median:
+		medianBrick(cells, dim, origin, size, out);
+		break;
+	}
+}
+
+void VolumeFilter::gaussianBrick(const unsigned char* cells, int dim, glm::ivec3 origin, glm::ivec3 size, unsigned char* out) const {
+	int r = radius;
+	int taps = 2 * r + 1;
+	glm::ivec3 rs = size + 2 * r;
+
+	scratchA.resize(size_t(rs.x) * rs.y * rs.z);
+	scratchB.resize(size_t(rs.x) * rs.y * size.z);
+	float* in = scratchA.data();
+	float* passZ = scratchB.data();
+
+	loadRegion(cells, dim, origin, size, r, in);
+
+	// Pass along z: rs.x * rs.y rows of size.z
+	std::fill(passZ, passZ + size_t(rs.x) * rs.y * size.z, 0.0f);
+	for (int row = 0; row < rs.x * rs.y; row++) {
+		for (int k = 0; k < taps; k++) {
+			axpy(passZ + row * size.z, in + row * rs.z + k, weights[k], size.z);
+		}
+	}
+
+	// Pass along y: rs.x * size.y rows (reuses the input buffer)
+	float* passY = in;
+	std::fill(passY, passY + size_t(rs.x) * size.y * size.z, 0.0f);
+	for (int x = 0; x < rs.x; x++) {
+		for (int y = 0; y < size.y; y++) {
+			float* dst = passY + (x * size.y + y) * size.z;
+
+			for (int k = 0; k < taps; k++) {
+				axpy(dst, passZ + (x * rs.y + y + k) * size.z, weights[k], size.z);
+			}
+		}
+	}
+
+	// Pass along x: size.x * size.y rows
+	float* passX = passZ;
+	std::fill(passX, passX + size_t(size.x) * size.y * size.z, 0.0f);
+	for (int x = 0; x < size.x; x++) {
+		for (int k = 0; k < taps; k++) {
+			axpy(passX + x * size.y * size.z, passY + (x + k) * size.y * size.z, weights[k], size.y * size.z);
+		}
+	}
+
+	toBytes(out, passX, 1.0f, size.x * size.y * size.z);
+}
+
+void VolumeFilter::boxBrick(const unsigned char* cells, int dim, glm::ivec3 origin, glm::ivec3 size, unsigned char* out) const {
+	int r = radius;
+	int taps = 2 * r + 1;
+	glm::ivec3 rs = size + 2 * r;
+
+	scratchA.resize(size_t(rs.x) * rs.y * rs.z);
+	scratchB.resize(size_t(rs.x) * rs.y * size.z);
+	float* in = scratchA.data();
+	float* passZ = scratchB.data();
+
+	loadRegion(cells, dim, origin, size, r, in);
+
+	// Pass along z: a running sum slides along each row
+	for (int row = 0; row < rs.x * rs.y; row++) {
+		const float* src = in + row * rs.z;
+		float* dst = passZ + row * size.z;
+
+		float sum = 0;
+		for (int k = 0; k < taps; k++) {
+			sum += src[k];
+		}
+
+		for (int z = 0; z < size.z; z++) {
+			dst[z] = sum;
+
+			if (z + 1 < size.z) {
+				sum += src[z + taps] - src[z];
+			}
+		}
+	}
+
+	// Pass along y: whole rows are added to and removed from the running sum
+	float* passY = in;
+	int rowSize = size.z;
+	for (int x = 0; x < rs.x; x++) {
+		const float* src = passZ + x * rs.y * rowSize;
+		float* dst = passY + x * size.y * rowSize;
+
+		std::fill(dst, dst + rowSize, 0.0f);
+		for (int k = 0; k < taps; k++) {
+			axpy(dst, src + k * rowSize, 1.0f, rowSize);
+		}
+
+		for (int y = 1; y < size.y; y++) {
+			std::memcpy(dst + y * rowSize, dst + (y - 1) * rowSize, rowSize * sizeof(float));
+			addSub(dst + y * rowSize, src + (y - 1 + taps) * rowSize, src + (y - 1) * rowSize, rowSize);
+		}
+	}
+
+	// Pass along x: whole planes are added to and removed from the running sum
+	float* passX = passZ;
+	int planeSize = size.y * size.z;
+
+	std::fill(passX, passX + planeSize, 0.0f);
+	for (int k = 0; k < taps; k++) {
+		axpy(passX, passY + k * planeSize, 1.0f, planeSize);
+	}
+
+	for (int x = 1; x < size.x; x++) {
+		std::memcpy(passX + x * planeSize, passX + (x - 1) * planeSize, planeSize * sizeof(float));
+		addSub(passX + x * planeSize, passY + (x - 1 + taps) * planeSize, passY + (x - 1) * planeSize, planeSize);
+	}
+
+	toBytes(out, passX, 1.0f / (taps * taps * taps), size.x * size.y * size.z);
+}
+
+void VolumeFilter::medianBrick(const unsigned char* cells, int dim, glm::ivec3 origin, glm::ivec3 size, unsigned char* out) const {
+	glm::ivec3 rs = size + 2;
+
+	scratchBytes.resize(size_t(rs.x) * rs.y * rs.z);
+	unsigned char* in = scratchBytes.data();
+
+	loadRegion(cells, dim, origin, size, 1, in);
+
+	// The 27 neighbours of cell (x, y, z) are rows[i][z]
+	auto neighbourRows = [&](int x, int y, const unsigned char** rows) {
+		for (int i = 0; i < 27; i++) {
+			int dx = i / 9;
+			int dy = (i / 3) % 3;
+			int dz = i % 3;
+			rows[i] = in + ((x + dx) * rs.y + y + dy) * rs.z + dz;
+		}
+	};
+
+	auto medianRow = [&](const unsigned char** rows, unsigned char* dst, int z) {
+#if defined(__SSE2__) || defined(_M_X64)
+		for (; z + 16 <= size.z; z += 16) {
+			__m128i v[27];
+			for (int i = 0; i < 27; i++) {
+				v[i] = _mm_loadu_si128((const __m128i*)(rows[i] + z));
+			}
+
+			_mm_storeu_si128((__m128i*)(dst + z), median27(v));
+		}
+#endif
+
+		for (; z < size.z; z++) {
+			unsigned char v[27];
+			for (int i = 0; i < 27; i++) {
+				v[i] = rows[i][z];
+			}
+
+			dst[z] = median27(v);
+		}
+	};
+
+	for (int x = 0; x < size.x; x++) {
+		int y = 0;
+
+#ifdef __AVX2__
+		// Bricks are only 16 cells deep, so two rows share each register, one per lane
+		for (; y + 2 <= size.y; y += 2) {
+			const unsigned char* rows[27];
+			const unsigned char* nextRows[27];
+			neighbourRows(x, y, rows);
+			neighbourRows(x, y + 1, nextRows);
+
+			unsigned char* dst = out + (x * size.y + y) * size.z;
+			unsigned char* nextDst = dst + size.z;
+
+			int z = 0;
+			for (; z + 16 <= size.z; z += 16) {
+				__m256i v[27];
+				for (int i = 0; i < 27; i++) {
+					__m128i low = _mm_loadu_si128((const __m128i*)(rows[i] + z));
+					__m128i high = _mm_loadu_si128((const __m128i*)(nextRows[i] + z));
+					v[i] = _mm256_inserti128_si256(_mm256_castsi128_si256(low), high, 1);
+				}
+
+				__m256i m = median27(v);
+				_mm_storeu_si128((__m128i*)(dst + z), _mm256_castsi256_si128(m));
+				_mm_storeu_si128((__m128i*)(nextDst + z), _mm256_extracti128_si256(m, 1));
+			}
+
+			medianRow(rows, dst, z);
+			medianRow(nextRows, nextDst, z);
+		}
+#endif
+
+		for (; y < size.y; y++) {
+			const unsigned char* rows[27];
+			neighbourRows(x, y, rows);
+
+			medianRow(rows, out + (x * size.y + y) * size.z, 0);
+		}
+	}
+}
+
+void VolumeFilter::storeBrick(unsigned char* cells, int dim, int brickSize, glm::ivec3 brick, const unsigned char* data) {
+	glm::ivec3 origin = brick * brickSize;
+	glm::ivec3 size = glm::min(glm::ivec3(brickSize), glm::ivec3(dim) - origin);
+
+	for (int x = 0; x < size.x; x++) {
+		for (int y = 0; y < size.y; y++) {
+			long long index = ((long long)(origin.x + x) * dim + origin.y + y) * dim + origin.z;
+			std::memcpy(cells + index, data + (x * size.y + y) * size.z, size.z);
+		}
+	}
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <glm/glm.hpp>
+
+#include <vector>
+
+// 3D smoothing filters that run in place over a dim^3 array of cells
+// The volume is processed in bricks (cubes of brickSize^3 cells) that
+// are read together with a halo of neighbouring cells, so no temporary
+// copy of the whole volume is ever needed
+class VolumeFilter {
+public:
+	// Enum for the constructor
+	enum class Type {
+		Gaussian,	// Separable Gaussian, size is the standard deviation in cells
+		Box,		// Box filter using running sums, size is the radius in cells
+		Median		// 3x3x3 median, size is ignored
+	};
+
+	// Constructor
+	VolumeFilter(Type type, float size = 1);
+
+	// Filters the whole volume in place
+	void apply(unsigned char* cells, int dim, int brickSize) const;
+
+	// Filters only the listed bricks in place (given in brick coordinates)
+	// Cells around the bricks are read but never written
+	void applyToBricks(unsigned char* cells, int dim, int brickSize, const std::vector<glm::ivec3>& bricks) const;
+
+	// Returns how many cells around a brick the filter reads
+	int getRadius() const;
+
+	Type getType() const;
+
+private:
+	Type type;
+
+	// Radius of the kernel in cells
+	int radius;
+
+	// Normalized 1D weights of the Gaussian (2 * radius + 1 of them)
+	std::vector<float> weights;
+
+	// Filters one brick (or the part of it inside the volume) and writes the result to out
+	void filterBrick(const unsigned char* cells, int dim, int brickSize, glm::ivec3 brick, unsigned char* out) const;
+
+	void gaussianBrick(const unsigned char* cells, int dim, glm::ivec3 origin, glm::ivec3 size, unsigned char* out) const;
+	void boxBrick(const unsigned char* cells, int dim, glm::ivec3 origin, glm::ivec3 size, unsigned char* out) const;
+	void medianBrick(const unsigned char* cells, int dim, glm::ivec3 origin, glm::ivec3 size, unsigned char* out) const;
+
+	// Writes a filtered brick back into the volume
+	static void storeBrick(unsigned char* cells, int dim, int brickSize, glm::ivec3 brick, const unsigned char* data);
+};
@@ -0,0 +1,317 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+// Small loops shared by the volume kernels
+// They have AVX2 versions when compiled with AVX2 and plain loops otherwise
+
+// out[i] += w * in[i]
+static inline void axpy(float* out, const float* in, float w, int n) {
+	int i = 0;
+
+#ifdef __AVX2__
+	__m256 vw = _mm256_set1_ps(w);
+	for (; i + 8 <= n; i += 8) {
+		__m256 o = _mm256_loadu_ps(out + i);
+		__m256 v = _mm256_loadu_ps(in + i);
+		_mm256_storeu_ps(out + i, _mm256_add_ps(o, _mm256_mul_ps(v, vw)));
+	}
+#endif
+
+	for (; i < n; i++) {
+		out[i] += w * in[i];
+	}
+}
+
+// acc[i] += add[i] - sub[i]
+static inline void addSub(float* acc, const float* add, const float* sub, int n) {
+	int i = 0;
+
+#ifdef __AVX2__
+	for (; i + 8 <= n; i += 8) {
+		__m256 a = _mm256_loadu_ps(acc + i);
+		__m256 p = _mm256_loadu_ps(add + i);
+		__m256 m = _mm256_loadu_ps(sub + i);
+		_mm256_storeu_ps(acc + i, _mm256_sub_ps(_mm256_add_ps(a, p), m));
+	}
+#endif
+
+	for (; i < n; i++) {
+		acc[i] += add[i] - sub[i];
+	}
+}
+
+// out[i] = round(in[i] * scale) clamped to [0, 255]
+static inline void toBytes(unsigned char* out, const float* in, float scale, int n) {
+	int i = 0;
+
+#ifdef __AVX2__
+	__m256 vs = _mm256_set1_ps(scale);
+	__m256 half = _mm256_set1_ps(0.5f);
+	for (; i + 8 <= n; i += 8) {
+		__m256 v = _mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(in + i), vs), half);
+		__m256i v32 = _mm256_cvttps_epi32(v);
+		__m128i v16 = _mm_packs_epi32(_mm256_castsi256_si128(v32), _mm256_extracti128_si256(v32, 1));
+		__m128i v8 = _mm_packus_epi16(v16, v16);
+		_mm_storel_epi64((__m128i*)(out + i), v8);
+	}
+#endif
+
+	for (; i < n; i++) {
+		float v = in[i] * scale + 0.5f;
+		out[i] = static_cast<unsigned char>(std::min(std::max(v, 0.0f), 255.0f));
+	}
+}
+
+// out[i] += w * in[i] with bytes as the input
+static inline void axpyBytes(float* out, const unsigned char* in, float w, int n) {
+	int i = 0;
+
+#ifdef __AVX2__
+	__m256 vw = _mm256_set1_ps(w);
+	for (; i + 8 <= n; i += 8) {
+		__m256 v = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(in + i))));
+		__m256 o = _mm256_loadu_ps(out + i);
+		_mm256_storeu_ps(out + i, _mm256_add_ps(o, _mm256_mul_ps(v, vw)));
+	}
+#endif
+
+	for (; i < n; i++) {
+		out[i] += w * in[i];
+	}
+}
+
+// Splits n positions into cells and fractions: cell[i] = floor(p[i]) and fraction[i] = p[i] - cell[i]
+static inline void floorFractions(const float* p, int* cell, float* fraction, int n) {
+	int i = 0;
+
+#ifdef __AVX2__
+	for (; i + 8 <= n; i += 8) {
+		__m256 v = _mm256_loadu_ps(p + i);
+		__m256 f = _mm256_floor_ps(v);
+		_mm256_storeu_si256((__m256i*)(cell + i), _mm256_cvttps_epi32(f));
+		_mm256_storeu_ps(fraction + i, _mm256_sub_ps(v, f));
+	}
+#endif
+
+	for (; i < n; i++) {
+		float f = std::floor(p[i]);
+		cell[i] = static_cast<int>(f);
+		fraction[i] = p[i] - f;
+	}
+}
+
+// Adds the trilinear splats of the samples [begin, end), which all have the same cell, to the
+// 8 cells around them. The fractions of sample i are (fx[i], fy[i], fz[i]), and the corner
+// (dx, dy, dz) is at weights[dx * xStride + dy * yStride + dz] (the same for sums, which get
+// the weights times the values). The samples are added up first, so the corners are only written once
+static inline void addTrilinear(const float* fx, const float* fy, const float* fz, const unsigned char* values, int begin, int end,
+	float* weights, float* sums, int yStride, int xStride) {
+#ifdef __AVX2__
+	// The weight of a corner along an axis is 1 - f or f, so a + f * b with a and b picked per corner
+	const __m256 ax = _mm256_setr_ps(1, 1, 1, 1, 0, 0, 0, 0);
+	const __m256 bx = _mm256_setr_ps(-1, -1, -1, -1, 1, 1, 1, 1);
+	const __m256 ay = _mm256_setr_ps(1, 1, 0, 0, 1, 1, 0, 0);
+	const __m256 by = _mm256_setr_ps(-1, -1, 1, 1, -1, -1, 1, 1);
+	const __m256 az = _mm256_setr_ps(1, 0, 1, 0, 1, 0, 1, 0);
+	const __m256 bz = _mm256_setr_ps(-1, 1, -1, 1, -1, 1, -1, 1);
+
+	__m256 w = _mm256_setzero_ps();
+	__m256 s = _mm256_setzero_ps();
+
+	for (int i = begin; i < end; i++) {
+		__m256 wx = _mm256_add_ps(ax, _mm256_mul_ps(_mm256_set1_ps(fx[i]), bx));
+		__m256 wy = _mm256_add_ps(ay, _mm256_mul_ps(_mm256_set1_ps(fy[i]), by));
+		__m256 wz = _mm256_add_ps(az, _mm256_mul_ps(_mm256_set1_ps(fz[i]), bz));
+		__m256 corner = _mm256_mul_ps(_mm256_mul_ps(wx, wy), wz);
+
+		w = _mm256_add_ps(w, corner);
+		s = _mm256_add_ps(s, _mm256_mul_ps(corner, _mm256_set1_ps(values[i])));
+	}
+
+	// The corners come in pairs along z, which are next to each other in memory
+	const int offsets[4] = { 0, yStride, xStride, xStride + yStride };
+	__m128 pairs[2][4];
+	pairs[0][0] = _mm256_castps256_ps128(w);
+	pairs[0][1] = _mm_movehl_ps(pairs[0][0], pairs[0][0]);
+	pairs[0][2] = _mm256_extractf128_ps(w, 1);
+	pairs[0][3] = _mm_movehl_ps(pairs[0][2], pairs[0][2]);
+	pairs[1][0] = _mm256_castps256_ps128(s);
+	pairs[1][1] = _mm_movehl_ps(pairs[1][0], pairs[1][0]);
+	pairs[1][2] = _mm256_extractf128_ps(s, 1);
+	pairs[1][3] = _mm_movehl_ps(pairs[1][2], pairs[1][2]);
+
+	for (int p = 0; p < 4; p++) {
+		__m64* weightPair = (__m64*)(weights + offsets[p]);
+		__m64* sumPair = (__m64*)(sums + offsets[p]);
+		_mm_storel_pi(weightPair, _mm_add_ps(_mm_loadl_pi(_mm_setzero_ps(), weightPair), pairs[0][p]));
+		_mm_storel_pi(sumPair, _mm_add_ps(_mm_loadl_pi(_mm_setzero_ps(), sumPair), pairs[1][p]));
+	}
+#else
+	float w[8] = {};
+	float s[8] = {};
+
+	for (int i = begin; i < end; i++) {
+		float wx[2] = { 1 - fx[i], fx[i] };
+		float wy[2] = { 1 - fy[i], fy[i] };
+		float wz[2] = { 1 - fz[i], fz[i] };
+
+		for (int corner = 0; corner < 8; corner++) {
+			float weight = wx[corner >> 2] * wy[(corner >> 1) & 1] * wz[corner & 1];
+			w[corner] += weight;
+			s[corner] += weight * values[i];
+		}
+	}
+
+	for (int corner = 0; corner < 8; corner++) {
+		int offset = (corner >> 2) * xStride + ((corner >> 1) & 1) * yStride + (corner & 1);
+		weights[offset] += w[corner];
+		sums[offset] += s[corner];
+	}
+#endif
+}
+
+// Blends the means of accumulated splats into n cells: where weights[i] > 0, the value
+// round(sums[i] / weights[i]) is blended into the cell like blendCells() does (with a weight
+// out of 256 from blendWeight()), so a splatted mean rounds the same as an Avg value
+// Cells without weight are left alone
+// The weights and sums are zeroed on the way, ready for the next splats
+static inline void blendSplats(unsigned char* cells, float* weights, float* sums, int weight, int n) {
+	int i = 0;
+
+#ifdef __AVX2__
+	__m256i vw = _mm256_set1_epi32(weight);
+	__m256i vk = _mm256_set1_epi32(256 - weight);
+	__m256 half = _mm256_set1_ps(0.5f);
+	__m256 maxValue = _mm256_set1_ps(255.0f);
+	__m256 zero = _mm256_setzero_ps();
+	for (; i + 8 <= n; i += 8) {
+		__m256 w = _mm256_loadu_ps(weights + i);
+		__m256 s = _mm256_loadu_ps(sums + i);
+		_mm256_storeu_ps(weights + i, zero);
+		_mm256_storeu_ps(sums + i, zero);
+
+		// Lanes without weight divide by 1 instead of 0
+		__m256 hasWeight = _mm256_cmp_ps(w, zero, _CMP_GT_OQ);
+		__m256 mean = _mm256_div_ps(s, _mm256_blendv_ps(_mm256_set1_ps(1.0f), w, hasWeight));
+		__m256i value = _mm256_cvttps_epi32(_mm256_min_ps(_mm256_add_ps(mean, half), maxValue));
+
+		// The values, cells and weights fit in 16 bits, so 16-bit products of the lanes are exact
+		__m256i current = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(cells + i)));
+		__m256i blended = _mm256_srli_epi32(_mm256_add_epi32(_mm256_mullo_epi16(value, vw), _mm256_mullo_epi16(current, vk)), 8);
+
+		__m256i empty = _mm256_cmpeq_epi32(current, _mm256_setzero_si256());
+		blended = _mm256_blendv_epi8(blended, value, empty);
+		blended = _mm256_blendv_epi8(current, blended, _mm256_castps_si256(hasWeight));
+
+		__m128i v16 = _mm_packs_epi32(_mm256_castsi256_si128(blended), _mm256_extracti128_si256(blended, 1));
+		_mm_storel_epi64((__m128i*)(cells + i), _mm_packus_epi16(v16, v16));
+	}
+#endif
+
+	for (; i < n; i++) {
+		if (weights[i] > 0) {
+			int value = static_cast<int>(std::min(sums[i] / weights[i] + 0.5f, 255.0f));
+			int mixed = (value * weight + cells[i] * (256 - weight)) >> 8;
+
+			cells[i] = static_cast<unsigned char>(cells[i] == 0 ? value : mixed);
+		}
+
+		weights[i] = 0;
+		sums[i] = 0;
+	}
+}
+
+// Writes the means of n running sums into n cells, rounded to the nearest value
+// Each sum holds the sum of the values above countBits bits and the number of values below them
+// Counts of 1 << (countBits - 1) or more are halved with their sums on the way, which
+// keeps the mean (up to rounding). Cells whose count is 0 are left alone
+static inline void compoundMeans(unsigned int* sums, unsigned char* cells, int countBits, int n) {
+	const unsigned int countMask = (1u << countBits) - 1;
+	int i = 0;
+
+#ifdef __AVX2__
+	__m256i vMask = _mm256_set1_epi32(countMask);
+	__m128i vBits = _mm_cvtsi32_si128(countBits);
+	__m128i vHalve = _mm_cvtsi32_si128(countBits - 1);
+	__m256i one = _mm256_set1_epi32(1);
+	for (; i + 8 <= n; i += 8) {
+		__m256i packed = _mm256_loadu_si256((const __m256i*)(sums + i));
+		__m256i count = _mm256_and_si256(packed, vMask);
+		__m256i sum = _mm256_srl_epi32(packed, vBits);
+
+		// Shifted by 1 where the count is high enough
+		__m256i halve = _mm256_srl_epi32(count, vHalve);
+		count = _mm256_srlv_epi32(count, halve);
+		sum = _mm256_srlv_epi32(sum, halve);
+		_mm256_storeu_si256((__m256i*)(sums + i), _mm256_or_si256(_mm256_sll_epi32(sum, vBits), count));
+
+		// Dividing floats is exact here, since sum + count / 2 and count are below 2^24
+		__m256i rounded = _mm256_add_epi32(sum, _mm256_srli_epi32(count, 1));
+		__m256 mean = _mm256_div_ps(_mm256_cvtepi32_ps(rounded), _mm256_cvtepi32_ps(_mm256_max_epi32(count, one)));
+		__m256i value = _mm256_cvttps_epi32(mean);
+
+		__m256i current = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(cells + i)));
+		__m256i hasCount = _mm256_cmpgt_epi32(count, _mm256_setzero_si256());
+		value = _mm256_blendv_epi8(current, value, hasCount);
+
+		__m128i v16 = _mm_packs_epi32(_mm256_castsi256_si128(value), _mm256_extracti128_si256(value, 1));
+		_mm_storel_epi64((__m128i*)(cells + i), _mm_packus_epi16(v16, v16));
+	}
+#endif
+
+	for (; i < n; i++) {
+		unsigned int count = sums[i] & countMask;
+		unsigned int sum = sums[i] >> countBits;
+
+		unsigned int halve = count >> (countBits - 1);
+		count >>= halve;
+		sum >>= halve;
+		sums[i] = sum << countBits | count;
+
+		if (count > 0) {
+			cells[i] = static_cast<unsigned char>((sum + count / 2) / count);
+		}
+	}
+}
+
+// Turns a blend coefficient on [0, 1] into a weight out of 256 for blendCells()
+static inline int blendWeight(float coefficient) {
+	return static_cast<int>(std::min(std::max(coefficient, 0.0f), 1.0f) * 256 + 0.5f);
+}
+
+// Blends n new values into n cells like writeLine() does: a cell of 0 takes the value as it is,
+// any other cell becomes (weight * value + (256 - weight) * cell) >> 8 (see blendWeight())
+// This is within 1 of the float blend (truncating coefficient * value + (1 - coefficient) * cell)
+// current and out may be the same array
+static inline void blendCells(const unsigned char* current, const unsigned char* values, unsigned char* out, int weight, int n) {
+	int i = 0;
+
+#ifdef __AVX2__
+	// Both products fit in 16 bits, and so does their sum (at most 255 * 256)
+	__m256i vw = _mm256_set1_epi16(static_cast<short>(weight));
+	__m256i vk = _mm256_set1_epi16(static_cast<short>(256 - weight));
+	__m256i zero = _mm256_setzero_si256();
+	for (; i + 16 <= n; i += 16) {
+		__m256i cell = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(current + i)));
+		__m256i value = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(values + i)));
+
+		__m256i mixed = _mm256_srli_epi16(_mm256_add_epi16(_mm256_mullo_epi16(value, vw), _mm256_mullo_epi16(cell, vk)), 8);
+		mixed = _mm256_blendv_epi8(mixed, value, _mm256_cmpeq_epi16(cell, zero));
+
+		// Packing works within each lane, so the halves are put back in order
+		__m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(mixed, mixed), _MM_SHUFFLE(3, 1, 2, 0));
+		_mm_storeu_si128((__m128i*)(out + i), _mm256_castsi256_si128(packed));
+	}
+#endif
+
+	for (; i < n; i++) {
+		int mixed = (values[i] * weight + current[i] * (256 - weight)) >> 8;
+		out[i] = static_cast<unsigned char>(current[i] == 0 ? values[i] : mixed);
+	}
+}
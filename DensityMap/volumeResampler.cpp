@@ -0,0 +1,191 @@
+#include "volumeResampler.h"
+#include "threadPool.h"
+#include "volumeKernels.h"
+
+#include <cmath>
+
+// Number of output rows (along y) computed together from one block of source rows
+static const int rowBlock = 16;
+
+static const float pi = 3.14159265358979f;
+
+static float sinc(float x) {
+	if (x == 0) {
+		return 1;
+	}
+
+	return std::sin(pi * x) / (pi * x);
+}
+
+VolumeResampler::VolumeResampler(Type type) {
+	this->type = type;
+}
+
+bool VolumeResampler::isValidRegion(glm::vec3 regionMin, glm::vec3 regionMax) {
+	for (int i = 0; i < 3; i++) {
+		if (!std::isfinite(regionMin[i]) || !std::isfinite(regionMax[i])) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+VolumeResampler::Type VolumeResampler::getType() const {
+	return type;
+}
+
+float VolumeResampler::kernel(float d) const {
+	d = std::fabs(d);
+
+	switch (type) {
+	case Type::Box:
+		if (d < 0.5f) {
+			return 1;
+		}
+
+		return d == 0.5f ? 0.5f : 0.0f;
+	case Type::Trilinear:
+		return d < 1 ? 1 - d : 0;
+	case Type::Lanczos:
+		return d < 3 ? sinc(d) * sinc(d / 3) : 0;
+	}
+
+	return 0;
+}
+
+float VolumeResampler::support() const {
+	switch (type) {
+	case Type::Box:
+		return 0.5f;
+	case Type::Trilinear:
+		return 1;
+	case Type::Lanczos:
+		return 3;
+	}
+
+	return 1;
+}
+
+VolumeResampler::AxisWeights VolumeResampler::computeWeights(int srcDim, int dstDim, float regionMin, float regionMax) const {
+	AxisWeights axis;
+
+	// Cell i sits at i / (dim - 1) on [0, 1], like in writeLine()
+	float start = regionMin * (srcDim - 1);
+	float step = dstDim > 1 ? (regionMax - regionMin) * (srcDim - 1) / (dstDim - 1) : 0;
+
+	// When shrinking, the filter is stretched to cover every source cell
+	float scale = std::max(std::fabs(step), 1.0f);
+	float halfWidth = support() * scale;
+
+	for (int j = 0; j < dstDim; j++) {
+		float center = dstDim > 1 ? start + j * step : (regionMin + regionMax) / 2 * (srcDim - 1);
+
+		int lo = int(std::ceil(center - halfWidth));
+		int hi = int(std::floor(center + halfWidth));
+
+		Contribution c;
+		c.first = std::min(std::max(lo, 0), srcDim - 1);
+		c.count = std::min(std::max(hi, 0), srcDim - 1) - c.first + 1;
+		c.weightOffset = axis.weights.size();
+		axis.weights.resize(axis.weights.size() + c.count, 0.0f);
+
+		// Cells outside the volume repeat the closest border cell
+		float sum = 0;
+		for (int i = lo; i <= hi; i++) {
+			float w = kernel((i - center) / scale);
+			int ci = std::min(std::max(i, 0), srcDim - 1);
+
+			axis.weights[c.weightOffset + ci - c.first] += w;
+			sum += w;
+		}
+
+		if (sum != 0) {
+			for (int i = 0; i < c.count; i++) {
+				axis.weights[c.weightOffset + i] /= sum;
+			}
+		}
+		else {
+			// Only happens if the filter falls between cells, so use the nearest one
+			int nearest = std::min(std::max(int(std::floor(center + 0.5f)), c.first), c.first + c.count - 1);
+			axis.weights[c.weightOffset + nearest - c.first] = 1;
+		}
+
+		axis.contributions.push_back(c);
+	}
+
+	return axis;
+}
+
+bool VolumeResampler::apply(const unsigned char* src, int srcDim, unsigned char* dst, int dstDim, glm::vec3 regionMin, glm::vec3 regionMax) const {
+	// Without any output cells there are no contributions to take the z range from
+	if (srcDim <= 0 || dstDim <= 0 || !isValidRegion(regionMin, regionMax)) {
+		return false;
+	}
+
+	AxisWeights wx = computeWeights(srcDim, dstDim, regionMin.x, regionMax.x);
+	AxisWeights wy = computeWeights(srcDim, dstDim, regionMin.y, regionMax.y);
+	AxisWeights wz = computeWeights(srcDim, dstDim, regionMin.z, regionMax.z);
+
+	// Source cells along z needed by any output cell
+	int zLo = std::min(wz.contributions.front().first, wz.contributions.back().first);
+	int zHi = std::max(wz.contributions.front().first + wz.contributions.front().count, wz.contributions.back().first + wz.contributions.back().count);
+	int nz = zHi - zLo;
+
+	int numRowBlocks = (dstDim + rowBlock - 1) / rowBlock;
+
+	// Each task is one output x slice and one block of output y rows
+	ThreadPool::global().parallelFor(0, dstDim * numRowBlocks, [&](int task) {
+		int ox = task / numRowBlocks;
+		int oy0 = (task % numRowBlocks) * rowBlock;
+		int oy1 = std::min(oy0 + rowBlock, dstDim);
+
+		// Source rows along y needed by this block
+		const Contribution& cFirst = wy.contributions[oy0];
+		const Contribution& cLast = wy.contributions[oy1 - 1];
+		int yLo = std::min(cFirst.first, cLast.first);
+		int yHi = std::max(cFirst.first + cFirst.count, cLast.first + cLast.count);
+		int ny = yHi - yLo;
+
+		std::vector<float> slab(size_t(ny) * nz, 0.0f);
+		std::vector<float> row(nz);
+
+		// Pass along x: blend the source slices into one slab
+		const Contribution& cx = wx.contributions[ox];
+		for (int k = 0; k < cx.count; k++) {
+			long long sx = cx.first + k;
+			float w = wx.weights[cx.weightOffset + k];
+
+			for (int y = 0; y < ny; y++) {
+				axpyBytes(slab.data() + y * nz, src + (sx * srcDim + yLo + y) * srcDim + zLo, w, nz);
+			}
+		}
+
+		for (int oy = oy0; oy < oy1; oy++) {
+			// Pass along y: blend rows of the slab into one row
+			const Contribution& cy = wy.contributions[oy];
+			std::fill(row.begin(), row.end(), 0.0f);
+
+			for (int k = 0; k < cy.count; k++) {
+				axpy(row.data(), slab.data() + (cy.first + k - yLo) * nz, wy.weights[cy.weightOffset + k], nz);
+			}
+
+			// Pass along z: each output cell takes a few cells of the row
+			unsigned char* out = dst + ((long long)ox * dstDim + oy) * dstDim;
+			for (int oz = 0; oz < dstDim; oz++) {
+				const Contribution& cz = wz.contributions[oz];
+				const float* w = wz.weights.data() + cz.weightOffset;
+				const float* in = row.data() + cz.first - zLo;
+
+				float value = 0.5f;
+				for (int k = 0; k < cz.count; k++) {
+					value += w[k] * in[k];
+				}
+
+				out[oz] = static_cast<unsigned char>(std::min(std::max(value, 0.0f), 255.0f));
+			}
+		}
+	});
+
+	return true;
+}
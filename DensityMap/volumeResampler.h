@@ -0,0 +1,56 @@
+#pragma once
+
+#include <glm/glm.hpp>
+
+#include <vector>
+
+// Resamples a dim^3 array of cells to a different resolution
+// The three axes are filtered separately, one small block of
+// output rows at a time so the working set stays in cache
+class VolumeResampler {
+public:
+	// Enum for the constructor
+	enum class Type {
+		Box,
+		Trilinear,
+		Lanczos
+	};
+
+	// Constructor
+	VolumeResampler(Type type = Type::Trilinear);
+
+	// Resamples the region between regionMin and regionMax (on [0, 1]) of src
+	// so that it fills all of dst
+	// Returns false (and writes nothing) if either dim isn't positive or the region isn't valid
+	bool apply(const unsigned char* src, int srcDim, unsigned char* dst, int dstDim,
+		glm::vec3 regionMin = glm::vec3(0), glm::vec3 regionMax = glm::vec3(1)) const;
+
+	Type getType() const;
+
+	// Whether every bound of the region is finite (a reversed axis flips the volume)
+	static bool isValidRegion(glm::vec3 regionMin, glm::vec3 regionMax);
+
+private:
+	Type type;
+
+	// Source cells and weights that make up one output cell along an axis
+	struct Contribution {
+		int first;
+		int count;
+		int weightOffset;
+	};
+
+	struct AxisWeights {
+		std::vector<Contribution> contributions;
+		std::vector<float> weights;
+	};
+
+	// Value of the filter at distance d (in source cells, already scaled)
+	float kernel(float d) const;
+
+	// Half-width of the filter in output cells
+	float support() const;
+
+	// Works out the contributions for one axis
+	AxisWeights computeWeights(int srcDim, int dstDim, float regionMin, float regionMax) const;
+};
@@ -0,0 +1,308 @@
+#include "volumeSequence.h"
+#include "brickCodec.h"
+#include "threadPool.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <cstring>
+#include <unordered_set>
+
+namespace {
+	const int brickSize = DensityMap::brickSize;
+	const size_t cellsPerBrick = brickSize * brickSize * brickSize;
+}
+
+VolumeSequence::VolumeSequence(int dim, int capacity, int maxChain) {
+	this->dim = dim;
+	this->capacity = std::max(capacity, 1);
+	this->maxChain = std::max(maxChain, 0);
+
+	bricksPerSide = (dim + brickSize - 1) / brickSize;
+
+	sourceMap = nullptr;
+	sourceVersion = 0;
+	shownMap = nullptr;
+	shownVersion = 0;
+}
+
+bool VolumeSequence::addFrame(DensityMap& map) {
+	TRACE_SCOPE("addFrame");
+
+	if (map.getDim() != dim) {
+		return false;
+	}
+
+	// The bricks of another map are all new, and the ones it never wrote are zeros
+	Frame frame;
+	unsigned long long since = 0;
+
+	if (&map == sourceMap && !frames.empty()) {
+		frame = frames.back();
+		since = sourceVersion;
+	}
+	else {
+		frame.assign(size_t(bricksPerSide) * bricksPerSide * bricksPerSide, nullptr);
+	}
+
+	bricks.clear();
+	glm::ivec3 origin;
+	sourceVersion = map.copyChangedBricks(since, bricks, brickCells, &origin);
+	sourceMap = &map;
+
+	std::vector<BrickPointer> encoded(bricks.size());
+
+	ThreadPool::global().parallelFor(0, static_cast<int>(bricks.size()), [&](int b) {
+		glm::ivec3 brick = bricks[b];
+		const BrickPointer& previous = frame[(brick.x * bricksPerSide + brick.y) * bricksPerSide + brick.z];
+
+		encoded[b] = encodeBrick(brickCells.data() + b * cellsPerBrick, previous);
+	});
+
+	for (size_t b = 0; b < bricks.size(); b++) {
+		glm::ivec3 brick = bricks[b];
+		frame[(brick.x * bricksPerSide + brick.y) * bricksPerSide + brick.z] = std::move(encoded[b]);
+	}
+
+	frames.push_back(std::move(frame));
+	frameOrigins.push_back(origin);
+	if (static_cast<int>(frames.size()) > capacity) {
+		frames.pop_front();
+		frameOrigins.pop_front();
+	}
+
+	return true;
+}
+
+int VolumeSequence::getNumFrames() {
+	return static_cast<int>(frames.size());
+}
+
+int VolumeSequence::getCapacity() {
+	return capacity;
+}
+
+int VolumeSequence::getDim() {
+	return dim;
+}
+
+bool VolumeSequence::getFrame(int index, unsigned char* out) {
+	if (index < 0 || index >= getNumFrames()) {
+		return false;
+	}
+
+	const Frame& frame = frames[index];
+	long long int size = dim;
+
+	// Where the window started in the array
+	glm::ivec3 wrap;
+	for (int axis = 0; axis < 3; axis++) {
+		wrap[axis] = ((frameOrigins[index][axis] % dim) + dim) % dim;
+	}
+
+	std::vector<char> failed(bricksPerSide, 0);
+
+	// One slab of bricks per task
+	ThreadPool::global().parallelFor(0, bricksPerSide, [&](int bx) {
+		unsigned char cells[cellsPerBrick];
+
+		for (int by = 0; by < bricksPerSide; by++) {
+			for (int bz = 0; bz < bricksPerSide; bz++) {
+				if (!decodeBrick(frame[(bx * bricksPerSide + by) * bricksPerSide + bz], cells)) {
+					failed[bx] = 1;
+				}
+
+				glm::ivec3 start = glm::ivec3(bx, by, bz) * brickSize;
+				glm::ivec3 end = glm::min(start + brickSize, glm::ivec3(dim));
+
+				for (int x = start.x; x < end.x; x++) {
+					long long int wx = (x - wrap.x + size) % size;
+
+					for (int y = start.y; y < end.y; y++) {
+						long long int wy = (y - wrap.y + size) % size;
+						const unsigned char* row = cells + ((x - start.x) * brickSize + (y - start.y)) * brickSize;
+
+						// The row is split where the window starts in the array
+						for (int z = start.z; z < end.z;) {
+							int count = z < wrap.z ? std::min(end.z, wrap.z) - z : end.z - z;
+							std::memcpy(out + (wx * size + wy) * size + (z - wrap.z + size) % size, row + (z - start.z), count);
+							z += count;
+						}
+					}
+				}
+			}
+		}
+	});
+
+	return std::find(failed.begin(), failed.end(), 1) == failed.end();
+}
+
+bool VolumeSequence::showFrame(int index, DensityMap& map) {
+	TRACE_SCOPE("showFrame");
+
+	if (index < 0 || index >= getNumFrames() || map.getDim() != dim) {
+		return false;
+	}
+
+	const Frame& frame = frames[index];
+
+	// Bricks that differ from what the map shows
+	std::vector<char> changed(frame.size(), 0);
+
+	if (&map == shownMap) {
+		for (size_t i = 0; i < frame.size(); i++) {
+			changed[i] = frame[i] != shownFrame[i];
+		}
+
+		bricks.clear();
+		map.copyChangedBricks(shownVersion, bricks, brickCells);
+
+		for (glm::ivec3 brick : bricks) {
+			changed[(brick.x * bricksPerSide + brick.y) * bricksPerSide + brick.z] = 1;
+		}
+	}
+	else {
+		std::fill(changed.begin(), changed.end(), 1);
+	}
+
+	std::vector<int> toWrite;
+	for (size_t i = 0; i < changed.size(); i++) {
+		if (changed[i]) {
+			toWrite.push_back(static_cast<int>(i));
+		}
+	}
+
+	std::vector<glm::ivec3> positions(toWrite.size());
+	brickCells.resize(toWrite.size() * cellsPerBrick);
+	std::vector<char> failed(toWrite.size(), 0);
+
+	ThreadPool::global().parallelFor(0, static_cast<int>(toWrite.size()), [&](int b) {
+		int i = toWrite[b];
+		positions[b] = glm::ivec3(i / (bricksPerSide * bricksPerSide), (i / bricksPerSide) % bricksPerSide, i % bricksPerSide);
+
+		if (!decodeBrick(frame[i], brickCells.data() + b * cellsPerBrick)) {
+			failed[b] = 1;
+		}
+	});
+
+	shownVersion = map.writeBricks(positions.data(), static_cast<int>(positions.size()), brickCells.data());
+	if (map.getOriginCell() != frameOrigins[index]) {
+		shownVersion = map.restoreOrigin(frameOrigins[index]);
+	}
+
+	shownMap = &map;
+	shownFrame = frame;
+
+	return std::find(failed.begin(), failed.end(), 1) == failed.end();
+}
+
+unsigned long long VolumeSequence::getBytesUsed() {
+	std::unordered_set<const Brick*> counted;
+	unsigned long long bytes = 0;
+
+	for (const Frame& frame : frames) {
+		bytes += frame.size() * sizeof(BrickPointer);
+
+		for (const BrickPointer& brick : frame) {
+			for (const Brick* b = brick.get(); b != nullptr && counted.insert(b).second; b = b->base.get()) {
+				bytes += sizeof(Brick) + b->data.capacity();
+			}
+		}
+	}
+
+	return bytes;
+}
+
+void VolumeSequence::clear() {
+	frames.clear();
+	frameOrigins.clear();
+
+	sourceMap = nullptr;
+	shownMap = nullptr;
+	shownFrame.clear();
+}
+
+VolumeSequence::BrickPointer VolumeSequence::encodeBrick(const unsigned char* cells, const BrickPointer& previous) {
+	unsigned char value;
+	if (BrickCodec::isUniform(cells, cellsPerBrick, value)) {
+		if (previous == nullptr ? value == 0 : previous->uniform && previous->value == value) {
+			return previous;
+		}
+
+		std::shared_ptr<Brick> brick = std::make_shared<Brick>();
+		brick->uniform = true;
+		brick->value = value;
+		brick->chainLength = 0;
+
+		return brick;
+	}
+
+	unsigned char previousCells[cellsPerBrick];
+	decodeBrick(previous, previousCells);
+
+	// Rewritten with the same values
+	if (std::memcmp(cells, previousCells, cellsPerBrick) == 0) {
+		return previous;
+	}
+
+	std::shared_ptr<Brick> brick = std::make_shared<Brick>();
+	brick->uniform = false;
+	brick->value = 0;
+	brick->chainLength = 0;
+	BrickCodec::encode(cells, cellsPerBrick, brick->data);
+
+	// XOR with the previous version, if that is smaller and the chain may grow
+	if (previous != nullptr && !previous->uniform && previous->chainLength < maxChain) {
+		unsigned char difference[cellsPerBrick];
+		for (size_t i = 0; i < cellsPerBrick; i++) {
+			difference[i] = cells[i] ^ previousCells[i];
+		}
+
+		std::vector<unsigned char> encoded;
+		BrickCodec::encode(difference, cellsPerBrick, encoded);
+
+		if (encoded.size() < brick->data.size()) {
+			brick->data.swap(encoded);
+			brick->base = previous;
+			brick->chainLength = previous->chainLength + 1;
+		}
+	}
+
+	brick->data.shrink_to_fit();
+
+	return brick;
+}
+
+bool VolumeSequence::decodeBrick(const BrickPointer& brick, unsigned char* out) {
+	if (brick == nullptr) {
+		std::memset(out, 0, cellsPerBrick);
+		return true;
+	}
+
+	// Starting from the brick stored on its own and applying each XOR on the way back
+	std::vector<const Brick*> chain;
+	for (const Brick* b = brick.get(); b != nullptr; b = b->base.get()) {
+		chain.push_back(b);
+	}
+
+	const Brick* root = chain.back();
+	if (root->uniform) {
+		std::memset(out, root->value, cellsPerBrick);
+	}
+	else if (!BrickCodec::decode(root->data.data(), root->data.size(), out, cellsPerBrick)) {
+		return false;
+	}
+
+	unsigned char difference[cellsPerBrick];
+
+	for (int i = static_cast<int>(chain.size()) - 2; i >= 0; i--) {
+		if (!BrickCodec::decode(chain[i]->data.data(), chain[i]->data.size(), difference, cellsPerBrick)) {
+			return false;
+		}
+
+		for (size_t c = 0; c < cellsPerBrick; c++) {
+			out[c] ^= difference[c];
+		}
+	}
+
+	return true;
+}
@@ -0,0 +1,102 @@
+#pragma once
+
+#include <glm/glm.hpp>
+
+#include "densityMap.h"
+
+#include <deque>
+#include <memory>
+#include <vector>
+
+// Ring of the last few volumes of a repeating sweep (for cardiac and other dynamic imaging)
+//
+// Every frame is a table with one pointer per brick. Bricks that didn't change between
+// frames are shared, so a frame only costs memory for the bricks that changed
+// A changed brick is stored compressed (BrickCodec), either on its own or as the XOR
+// with the same brick in the previous frame (which is mostly zeros when little changed),
+// whichever is smaller. Chains of XOR bricks are at most maxChain long, so decoding
+// any brick of any frame takes at most maxChain + 1 decompressions
+// Bricks that were never written are nullptr and read as zeros
+// Bricks are kept as the map stores them, with the window's origin of each frame
+//
+// Not thread-safe: add and show frames from one thread
+class VolumeSequence {
+public:
+	// Constructor (keeps up to capacity frames of dim^3 cells)
+	VolumeSequence(int dim, int capacity, int maxChain = 8);
+
+	VolumeSequence(const VolumeSequence&) = delete;
+	VolumeSequence& operator=(const VolumeSequence&) = delete;
+
+	// Adds the cells of map as the newest frame, dropping the oldest one if the ring is full
+	// Only the bricks that changed since the last call with the same map are copied and compressed
+	// Returns false if map doesn't have the dim of the sequence
+	bool addFrame(DensityMap& map);
+
+	// Number of frames stored (frame 0 is the oldest)
+	int getNumFrames();
+	int getCapacity();
+	int getDim();
+
+	// Writes all dim^3 cells of a frame to out, in window order (like DensityMap::readCell())
+	bool getFrame(int index, unsigned char* out);
+
+	// Makes map show a frame, with the origin the frame had. Only the bricks that differ from the frame
+	// shown last (or that something else wrote since then) are decompressed and written, so playing
+	// the frames in order costs about as much as the change between them
+	bool showFrame(int index, DensityMap& map);
+
+	// Bytes held by the sequence: the compressed bricks (counted once, however
+	// many frames share them) and the frame tables
+	unsigned long long getBytesUsed();
+
+	// Removes every frame
+	void clear();
+
+private:
+	struct Brick {
+		// BrickCodec data (empty for uniform bricks)
+		std::vector<unsigned char> data;
+
+		bool uniform;
+		unsigned char value;
+
+		// If not nullptr, data is the XOR with this brick
+		std::shared_ptr<const Brick> base;
+
+		// Number of XOR bricks on the way to a brick stored on its own
+		int chainLength;
+	};
+
+	typedef std::shared_ptr<const Brick> BrickPointer;
+	typedef std::vector<BrickPointer> Frame;
+
+	int dim;
+	int capacity;
+	int maxChain;
+	int bricksPerSide;
+
+	std::deque<Frame> frames;
+
+	// World position of the window's corner in cells for each frame
+	std::deque<glm::ivec3> frameOrigins;
+
+	// Map the last frame was taken from and its version at the time
+	const DensityMap* sourceMap;
+	unsigned long long sourceVersion;
+
+	// What showFrame() last wrote to a map
+	const DensityMap* shownMap;
+	unsigned long long shownVersion;
+	Frame shownFrame;
+
+	// Reused buffers for the bricks being copied or written
+	std::vector<glm::ivec3> bricks;
+	std::vector<unsigned char> brickCells;
+
+	// Compresses new cells for a brick whose previous version is previous
+	BrickPointer encodeBrick(const unsigned char* cells, const BrickPointer& previous);
+
+	// Decompresses a brick (with its chain of bases) into brickSize^3 cells
+	static bool decodeBrick(const BrickPointer& brick, unsigned char* out);
+};
@@ -0,0 +1,302 @@
+#include "volumeSnapshot.h"
+#include "brickCodec.h"
+#include "threadPool.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+namespace {
+	const char magic[4] = { 'D', 'M', 'S', 'N' };
+
+	// Cells of the brick at (bx, by, bz) that lie inside the volume
+	struct BrickExtent {
+		int x0, y0, z0;
+		int x1, y1, z1;
+
+		BrickExtent(int bx, int by, int bz, int dim, int brickSize) {
+			x0 = bx * brickSize;
+			y0 = by * brickSize;
+			z0 = bz * brickSize;
+			x1 = std::min(x0 + brickSize, dim);
+			y1 = std::min(y0 + brickSize, dim);
+			z1 = std::min(z0 + brickSize, dim);
+		}
+
+		size_t numCells() const {
+			return size_t(x1 - x0) * (y1 - y0) * (z1 - z0);
+		}
+	};
+
+	// Copies a brick out of the volume into a packed array
+	void gatherBrick(const unsigned char* cells, long long int dim, const BrickExtent& brick, unsigned char* out) {
+		size_t rowLength = brick.z1 - brick.z0;
+
+		for (long long int x = brick.x0; x < brick.x1; x++) {
+			for (long long int y = brick.y0; y < brick.y1; y++) {
+				std::memcpy(out, cells + (x * dim + y) * dim + brick.z0, rowLength);
+				out += rowLength;
+			}
+		}
+	}
+
+	// Returns true if every cell of a brick has the same value (checked in place, one row at a time)
+	bool isUniformBrick(const unsigned char* cells, long long int dim, const BrickExtent& brick, unsigned char& value) {
+		value = cells[(brick.x0 * dim + brick.y0) * dim + brick.z0];
+
+		unsigned char row[256];
+		size_t rowLength = brick.z1 - brick.z0;
+		if (rowLength > sizeof(row)) {
+			return false;
+		}
+
+		std::memset(row, value, rowLength);
+
+		for (long long int x = brick.x0; x < brick.x1; x++) {
+			for (long long int y = brick.y0; y < brick.y1; y++) {
+				if (std::memcmp(cells + (x * dim + y) * dim + brick.z0, row, rowLength) != 0) {
+					return false;
+				}
+			}
+		}
+
+		return true;
+	}
+
+	// Fills the part of a brick inside [cellMin, cellMax) with one value
+	void fillBrick(unsigned char value, const BrickExtent& brick, unsigned char* cells, long long int dim, glm::ivec3 cellMin, glm::ivec3 cellMax) {
+		int x0 = std::max(brick.x0, cellMin.x), x1 = std::min(brick.x1, cellMax.x);
+		int y0 = std::max(brick.y0, cellMin.y), y1 = std::min(brick.y1, cellMax.y);
+		int z0 = std::max(brick.z0, cellMin.z), z1 = std::min(brick.z1, cellMax.z);
+
+		for (long long int x = x0; x < x1; x++) {
+			for (long long int y = y0; y < y1; y++) {
+				std::memset(cells + (x * dim + y) * dim + z0, value, z1 - z0);
+			}
+		}
+	}
+
+	// Copies the part of a packed brick inside [cellMin, cellMax) into the volume
+	void scatterBrick(const unsigned char* brickCells, const BrickExtent& brick, unsigned char* cells, long long int dim, glm::ivec3 cellMin, glm::ivec3 cellMax) {
+		int x0 = std::max(brick.x0, cellMin.x), x1 = std::min(brick.x1, cellMax.x);
+		int y0 = std::max(brick.y0, cellMin.y), y1 = std::min(brick.y1, cellMax.y);
+		int z0 = std::max(brick.z0, cellMin.z), z1 = std::min(brick.z1, cellMax.z);
+
+		long long int sizeY = brick.y1 - brick.y0;
+		long long int sizeZ = brick.z1 - brick.z0;
+
+		for (long long int x = x0; x < x1; x++) {
+			for (long long int y = y0; y < y1; y++) {
+				const unsigned char* row = brickCells + ((x - brick.x0) * sizeY + (y - brick.y0)) * sizeZ;
+				std::memcpy(cells + (x * dim + y) * dim + z0, row + (z0 - brick.z0), z1 - z0);
+			}
+		}
+	}
+}
+
+bool VolumeSnapshot::save(const std::string& path, const unsigned char* cells, int dim, int brickSize) {
+	return save(path, dim, brickSize, [cells, dim](int x0, int) {
+		return cells + size_t(x0) * dim * dim;
+	});
+}
+
+bool VolumeSnapshot::save(const std::string& path, int dim, int brickSize, const SlabReader& readSlab) {
+	int bricksPerSide = (dim + brickSize - 1) / brickSize;
+	size_t bricksPerSlab = size_t(bricksPerSide) * bricksPerSide;
+
+	std::vector<IndexEntry> index(bricksPerSlab * bricksPerSide);
+
+	// Each row of bricks (same bx and by) is compressed by one task into its own buffer
+	// and the index offsets are relative to that buffer until everything is done
+	std::vector<std::vector<unsigned char>> rows(bricksPerSlab);
+
+	for (int bx = 0; bx < bricksPerSide; bx++) {
+		int x0 = bx * brickSize;
+		const unsigned char* slabCells = readSlab(x0, std::min(x0 + brickSize, dim));
+
+		ThreadPool::global().parallelFor(0, bricksPerSide, [&](int by) {
+			std::vector<unsigned char> brickCells(size_t(brickSize) * brickSize * brickSize);
+			std::vector<unsigned char>& row = rows[bx * bricksPerSide + by];
+
+			for (int bz = 0; bz < bricksPerSide; bz++) {
+				// Brick positions within the slab
+				BrickExtent brick(bx, by, bz, dim, brickSize);
+				brick.x0 -= x0;
+				brick.x1 -= x0;
+
+				IndexEntry& entry = index[bx * bricksPerSlab + by * bricksPerSide + bz];
+
+				entry.reserved = 0;
+				entry.offset = row.size();
+
+				// Most bricks of a sparse volume are empty, so those are never copied
+				unsigned char value;
+				if (isUniformBrick(slabCells, dim, brick, value)) {
+					entry.uniform = 1;
+					entry.value = value;
+					entry.size = 0;
+				}
+				else {
+					entry.uniform = 0;
+					entry.value = 0;
+
+					gatherBrick(slabCells, dim, brick, brickCells.data());
+					BrickCodec::encode(brickCells.data(), brick.numCells(), row);
+					entry.size = static_cast<uint32_t>(row.size() - entry.offset);
+				}
+			}
+		});
+	}
+
+	// Turning the offsets into file offsets
+	uint64_t rowStart = sizeof(FileHeader) + index.size() * sizeof(IndexEntry);
+	for (size_t r = 0; r < rows.size(); r++) {
+		for (int bz = 0; bz < bricksPerSide; bz++) {
+			index[r * bricksPerSide + bz].offset += rowStart;
+		}
+
+		rowStart += rows[r].size();
+	}
+
+	FileHeader header;
+	std::memcpy(header.magic, magic, sizeof(magic));
+	header.version = version;
+	header.dim = dim;
+	header.brickSize = brickSize;
+
+	std::string temporaryPath = path + ".tmp";
+	FILE* file = std::fopen(temporaryPath.c_str(), "wb");
+	if (file == nullptr) {
+		return false;
+	}
+
+	bool ok = std::fwrite(&header, sizeof(header), 1, file) == 1;
+	ok = ok && std::fwrite(index.data(), sizeof(IndexEntry), index.size(), file) == index.size();
+	for (const std::vector<unsigned char>& row : rows) {
+		ok = ok && std::fwrite(row.data(), 1, row.size(), file) == row.size();
+	}
+
+	ok = std::fclose(file) == 0 && ok;
+
+	if (!ok) {
+		std::remove(temporaryPath.c_str());
+		return false;
+	}
+
+	// rename() doesn't replace existing files on every platform
+	std::remove(path.c_str());
+	return std::rename(temporaryPath.c_str(), path.c_str()) == 0;
+}
+
+bool VolumeSnapshot::load(const std::string& path, unsigned char* cells, int dim, int brickSize,
+	glm::ivec3 cellMin, glm::ivec3 cellMax, std::vector<glm::ivec3>* loadedBricks) {
+
+	cellMin = glm::max(cellMin, glm::ivec3(0));
+	cellMax = glm::min(cellMax, glm::ivec3(dim));
+
+	FILE* file = std::fopen(path.c_str(), "rb");
+	if (file == nullptr) {
+		return false;
+	}
+
+	FileHeader header;
+	if (std::fread(&header, sizeof(header), 1, file) != 1 || std::memcmp(header.magic, magic, sizeof(magic)) != 0 ||
+		header.version != version || header.dim != static_cast<uint32_t>(dim) || header.brickSize != static_cast<uint32_t>(brickSize)) {
+		std::fclose(file);
+		return false;
+	}
+
+	int bricksPerSide = (dim + brickSize - 1) / brickSize;
+	size_t bricksPerSlab = size_t(bricksPerSide) * bricksPerSide;
+
+	std::vector<IndexEntry> index(bricksPerSlab * bricksPerSide);
+	if (std::fread(index.data(), sizeof(IndexEntry), index.size(), file) != index.size()) {
+		std::fclose(file);
+		return false;
+	}
+
+	if (glm::any(glm::greaterThanEqual(cellMin, cellMax))) {
+		std::fclose(file);
+		return true;
+	}
+
+	// Only the bricks overlapping the region are read
+	glm::ivec3 firstBrick = cellMin / brickSize;
+	glm::ivec3 lastBrick = (cellMax - 1) / brickSize;
+
+	std::vector<glm::ivec3> bricks;
+	std::vector<size_t> dataStart;
+	std::vector<unsigned char> data;
+
+	for (int bx = firstBrick.x; bx <= lastBrick.x; bx++) {
+		for (int by = firstBrick.y; by <= lastBrick.y; by++) {
+			for (int bz = firstBrick.z; bz <= lastBrick.z; bz++) {
+				const IndexEntry& entry = index[bx * bricksPerSlab + by * bricksPerSide + bz];
+
+				bricks.push_back(glm::ivec3(bx, by, bz));
+				dataStart.push_back(data.size());
+
+				if (entry.uniform) {
+					continue;
+				}
+
+				data.resize(data.size() + entry.size);
+
+				if (std::fseek(file, static_cast<long>(entry.offset), SEEK_SET) != 0 ||
+					std::fread(data.data() + dataStart.back(), 1, entry.size, file) != entry.size) {
+					std::fclose(file);
+					return false;
+				}
+			}
+		}
+	}
+
+	std::fclose(file);
+
+	// Decompressing in parallel (bricks never overlap, so the tasks never write the same cells)
+	std::vector<char> failed(bricks.size(), 0);
+
+	ThreadPool::global().parallelFor(0, static_cast<int>(bricks.size()), [&](int i) {
+		glm::ivec3 b = bricks[i];
+		BrickExtent brick(b.x, b.y, b.z, dim, brickSize);
+		const IndexEntry& entry = index[b.x * bricksPerSlab + b.y * bricksPerSide + b.z];
+
+		if (entry.uniform) {
+			fillBrick(entry.value, brick, cells, dim, cellMin, cellMax);
+			return;
+		}
+
+		std::vector<unsigned char> brickCells(brick.numCells());
+
+		if (!BrickCodec::decode(data.data() + dataStart[i], entry.size, brickCells.data(), brickCells.size())) {
+			failed[i] = 1;
+			return;
+		}
+
+		scatterBrick(brickCells.data(), brick, cells, dim, cellMin, cellMax);
+	});
+
+	if (loadedBricks != nullptr) {
+		loadedBricks->insert(loadedBricks->end(), bricks.begin(), bricks.end());
+	}
+
+	return std::find(failed.begin(), failed.end(), 1) == failed.end();
+}
+
+bool VolumeSnapshot::readInfo(const std::string& path, int& dim, int& brickSize) {
+	FILE* file = std::fopen(path.c_str(), "rb");
+	if (file == nullptr) {
+		return false;
+	}
+
+	FileHeader header;
+	bool ok = std::fread(&header, sizeof(header), 1, file) == 1 && std::memcmp(header.magic, magic, sizeof(magic)) == 0 && header.version == version;
+	std::fclose(file);
+
+	if (ok) {
+		dim = header.dim;
+		brickSize = header.brickSize;
+	}
+
+	return ok;
+}
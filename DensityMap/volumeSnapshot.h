@@ -0,0 +1,59 @@
+#pragma once
+
+#include <glm/glm.hpp>
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+// Saves and loads volumes as files of independently compressed bricks
+//
+// File layout (numbers in the byte order of the machine that saved it):
+//   Header:  "DMSN", uint32 version, uint32 dim, uint32 brickSize
+//   Index:   one entry per brick (x-major, like the cells)
+//   Data:    the compressed bricks (BrickCodec), in index order
+// Bricks where every cell has the same value have no data at all
+// The index makes it possible to load only the bricks of a region
+class VolumeSnapshot {
+public:
+	// Compresses the bricks in parallel and writes the file
+	// (to a temporary file that replaces path at the end, so a crash never leaves half a snapshot)
+	static bool save(const std::string& path, const unsigned char* cells, int dim, int brickSize);
+
+	// Returns the cells of the planes [x0, x1) (dim^2 cells each), valid until the next call
+	typedef std::function<const unsigned char*(int x0, int x1)> SlabReader;
+
+	// Same as above, but the cells are read one slab of brickSize planes at a time,
+	// so they don't have to be in memory (or unchanging) all at once
+	static bool save(const std::string& path, int dim, int brickSize, const SlabReader& readSlab);
+
+	// Loads the cells in [cellMin, cellMax) from a snapshot with the same dim and brickSize
+	// If loadedBricks isn't nullptr, the bricks that were written to are added to it
+	static bool load(const std::string& path, unsigned char* cells, int dim, int brickSize,
+		glm::ivec3 cellMin, glm::ivec3 cellMax, std::vector<glm::ivec3>* loadedBricks = nullptr);
+
+	// Reads the dim and brickSize of a snapshot without loading it
+	static bool readInfo(const std::string& path, int& dim, int& brickSize);
+
+private:
+	struct FileHeader {
+		char magic[4];
+		uint32_t version;
+		uint32_t dim;
+		uint32_t brickSize;
+	};
+
+	struct IndexEntry {
+		// Where the compressed brick starts in the file and its size
+		uint64_t offset;
+		uint32_t size;
+
+		// 1 if every cell is value (and there is no data)
+		uint8_t uniform;
+		uint8_t value;
+		uint16_t reserved;
+	};
+
+	static const uint32_t version = 1;
+};
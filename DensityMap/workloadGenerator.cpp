@@ -0,0 +1,175 @@
+#include "workloadGenerator.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace {
+	const float pi = 3.14159265358979f;
+
+	// Where the probe touches the skin and the directions it looks in
+	const glm::vec3 probeCenter(0.5f, 0.5f, 0.9f);
+	const glm::vec3 axial(0, 0, -1);
+	const glm::vec3 lateral(1, 0, 0);
+	const glm::vec3 elevation(0, 1, 0);
+
+	// How far the sweeps reach in the elevation direction
+	const float maxTilt = 0.5f;
+	const float maxTranslation = 0.3f;
+
+	// Goes from -1 to 1 and back once per period
+	float triangleWave(double t, double period) {
+		double phase = t / period - std::floor(t / period);
+		return static_cast<float>(phase < 0.5 ? 4 * phase - 1 : 3 - 4 * phase);
+	}
+}
+
+WorkloadGenerator::WorkloadGenerator(const Settings& settings) : rng(settings.seed) {
+	this->settings = settings;
+
+	time = 0;
+	linesGenerated = 0;
+	lineCarry = 0;
+	shake = glm::vec3(0);
+
+	// Echoes get weaker the deeper they come from
+	attenuation.resize(settings.samplesPerLine);
+	for (int i = 0; i < settings.samplesPerLine; i++) {
+		float d = settings.depth * (i + 0.5f) / settings.samplesPerLine;
+		attenuation[i] = std::exp(-1.5f * d);
+	}
+}
+
+int WorkloadGenerator::advance(DensityMap& map, double seconds) {
+	double exact = seconds * settings.linesPerSecond + lineCarry;
+	int numLines = static_cast<int>(exact);
+	lineCarry = exact - numLines;
+
+	Line line;
+	for (int i = 0; i < numLines; i++) {
+		nextLine(line);
+		map.writeLine(line.p1, line.p2, line.samples, settings.writeMode);
+	}
+
+	time += seconds;
+
+	return numLines;
+}
+
+void WorkloadGenerator::nextLine(Line& line) {
+	int lineInPlane = linesGenerated % settings.linesPerPlane;
+
+	// Position of the line across the image plane, on [-1, 1]
+	float u = (lineInPlane + 0.5f) / settings.linesPerPlane * 2 - 1;
+
+	// Where the probe is in its sweep, on [-1, 1]
+	float sweep = triangleWave(linesGenerated / settings.linesPerSecond, settings.sweepPeriod);
+
+	// A shaky hand moves the whole image plane at once
+	if (lineInPlane == 0 && settings.sweep == Sweep::FreehandRotation) {
+		shake = settings.jitter * glm::vec3(normal(), normal(), normal());
+	}
+
+	glm::vec3 direction;
+
+	switch (settings.sweep) {
+	case Sweep::SectorFan: {
+		float tilt = maxTilt * sweep;
+		glm::vec3 tiltedAxial = std::cos(tilt) * axial + std::sin(tilt) * elevation;
+
+		float angle = u * settings.sectorAngle / 2;
+		direction = std::cos(angle) * tiltedAxial + std::sin(angle) * lateral;
+
+		line.p1 = probeCenter;
+		break;
+	}
+	case Sweep::LinearTranslation:
+		direction = axial;
+
+		line.p1 = probeCenter + (maxTranslation * sweep) * elevation + (u * settings.width / 2) * lateral;
+		break;
+	case Sweep::FreehandRotation: {
+		float rotation = pi / 2 * sweep;
+		glm::vec3 rotatedLateral = std::cos(rotation) * lateral + std::sin(rotation) * elevation;
+
+		float angle = u * settings.sectorAngle / 2;
+		direction = std::cos(angle) * axial + std::sin(angle) * rotatedLateral;
+
+		line.p1 = probeCenter + shake;
+		break;
+	}
+	}
+
+	line.p2 = line.p1 + settings.depth * direction;
+
+	// Speckle is Rayleigh distributed (divided by its mean so it averages to 1)
+	int numSamples = settings.samplesPerLine;
+	line.samples.resize(numSamples);
+
+	glm::vec3 step = (line.p2 - line.p1) / static_cast<float>(numSamples);
+	glm::vec3 p = line.p1 + step * 0.5f;
+
+	for (int i = 0; i < numSamples; i++) {
+		float speckle = std::sqrt(-2 * std::log(uniform())) * 0.7979f;
+		float value = echogenicity(p) * attenuation[i] * speckle;
+
+		line.samples[i] = static_cast<unsigned char>(std::min(value, 255.0f));
+		p += step;
+	}
+
+	linesGenerated++;
+}
+
+double WorkloadGenerator::getTime() {
+	return time;
+}
+
+unsigned long long WorkloadGenerator::getLinesGenerated() {
+	return linesGenerated;
+}
+
+const WorkloadGenerator::Settings& WorkloadGenerator::getSettings() {
+	return settings;
+}
+
+const char* WorkloadGenerator::sweepName(Sweep sweep) {
+	switch (sweep) {
+	case Sweep::SectorFan:
+		return "fan";
+	case Sweep::LinearTranslation:
+		return "linear";
+	case Sweep::FreehandRotation:
+		return "freehand";
+	}
+
+	return "";
+}
+
+float WorkloadGenerator::uniform() {
+	return static_cast<float>((rng() + 1.0) / 4294967296.0);
+}
+
+float WorkloadGenerator::normal() {
+	// Box-Muller transform
+	float r = std::sqrt(-2 * std::log(uniform()));
+	return r * std::cos(2 * pi * uniform());
+}
+
+float WorkloadGenerator::echogenicity(glm::vec3 p) {
+	// A cyst with a bright wall, sitting on a bright layer of tissue
+	glm::vec3 d = p - glm::vec3(0.5f, 0.5f, 0.45f);
+	float r = std::sqrt(glm::dot(d, d));
+
+	if (r < 0.16f) {
+		return 5;
+	}
+
+	if (r < 0.18f) {
+		return 230;
+	}
+
+	if (p.z > 0.25f && p.z < 0.28f) {
+		return 160;
+	}
+
+	return 70;
+}
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <glm/glm.hpp>
+
+#include "densityMap.h"
+
+#include <random>
+#include <vector>
+
+// Generates scanlines the way a moving ultrasound probe would, for load tests and benchmarks
+// Everything comes from one seeded generator, so the same settings and the same calls
+// to advance() always produce exactly the same lines
+// The probe sits near the top of the volume and looks down (towards -z)
+class WorkloadGenerator {
+public:
+	// How the probe moves
+	enum class Sweep {
+		// Fan of lines from one apex, tilted back and forth (like a wobbler probe)
+		SectorFan,
+		// Parallel lines, moved back and forth along the elevation direction (like a linear probe on a track)
+		LinearTranslation,
+		// Fan rotated around the probe's axis by hand, with random shaking
+		FreehandRotation
+	};
+
+	struct Settings {
+		Sweep sweep = Sweep::SectorFan;
+
+		// Lines written per second of simulated time
+		double linesPerSecond = 5000;
+
+		// Samples in each line and lines in each image plane
+		int samplesPerLine = 512;
+		int linesPerPlane = 128;
+
+		// Length of a line (in volume units)
+		float depth = 0.7f;
+
+		// Width of the image plane for LinearTranslation (in volume units)
+		// and angle of the fan for the other sweeps (in radians)
+		float width = 0.6f;
+		float sectorAngle = 1.2f;
+
+		// Seconds for the probe to sweep one way and back
+		float sweepPeriod = 4;
+
+		// Standard deviation of the hand shaking in FreehandRotation (in volume units)
+		float jitter = 0.005f;
+
+		DensityMap::WriteMode writeMode = DensityMap::WriteMode::Avg;
+
+		unsigned int seed = 1;
+	};
+
+	// One generated scanline
+	struct Line {
+		glm::vec3 p1;
+		glm::vec3 p2;
+		std::vector<unsigned char> samples;
+	};
+
+	// Constructor
+	WorkloadGenerator(const Settings& settings);
+
+	// Writes the lines that the probe acquires in the next seconds of simulated time
+	// Returns the number of lines written
+	int advance(DensityMap& map, double seconds);
+
+	// Makes the next line without writing it anywhere
+	void nextLine(Line& line);
+
+	// Returns the simulated time and the number of lines made so far
+	double getTime();
+	unsigned long long getLinesGenerated();
+
+	const Settings& getSettings();
+
+	// Returns the name of a sweep ("fan", "linear" or "freehand")
+	static const char* sweepName(Sweep sweep);
+
+private:
+	Settings settings;
+
+	// Raw 32-bit output is used everywhere instead of the standard
+	// distributions, whose results differ between standard libraries
+	std::mt19937 rng;
+
+	double time;
+	unsigned long long linesGenerated;
+
+	// Fraction of a line left over from the last advance()
+	double lineCarry;
+
+	// Echo strength lost to attenuation at each sample
+	std::vector<float> attenuation;
+
+	// Hand shaking of the current image plane
+	glm::vec3 shake;
+
+	// Uniform on (0, 1]
+	float uniform();
+
+	// Roughly normal with mean 0 and standard deviation 1
+	float normal();
+
+	// How strongly the simulated tissue reflects at a point
+	static float echogenicity(glm::vec3 p);
+};